@@ -0,0 +1,337 @@
+/*
+ *
+ *	Generator of synthetic directory trees for benchmarking quotacheck
+ *
+ *	Builds a tree of given shape with files owned by pseudo-random users
+ *	and groups and writes usage each of them should have so that the
+ *	results of quotacheck can be verified.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pot.h"
+#include "common.h"
+
+#define CORPUS_DIR "corpus"	/* Directory the tree is created in */
+#define LINK_POOL 256		/* Number of recent files hardlinks are made to */
+
+/* Expected usage of one ID */
+struct usage {
+	unsigned long long inodes;
+	unsigned long long space;
+};
+
+char *progname;
+
+static int depth = 3;			/* Levels of directories below the corpus directory */
+static int fanout = 10;			/* Subdirectories in each directory */
+static int files = 100;			/* Files in each directory */
+static int max_size = 8192;		/* Maximal size of a file */
+static int nuids = 100, ngids = 20;	/* Number of users and groups owning files */
+static int base_id = 10000;		/* First uid and gid used */
+static int skew = 1;			/* Skew of ID distribution (1 = uniform) */
+static int link_ratio = 5;		/* Percentage of files which are hardlinks */
+static unsigned long long seed = 1;	/* Seed of the generator */
+static char *out_name;			/* Where to write expected usage */
+
+static struct usage *user_usage, *group_usage;	/* Usage of generated IDs */
+static struct usage *other_usage[2];	/* Usage of IDs of files which existed before */
+static unsigned long *other_ids[2];
+static int other_cnt[2];
+
+static char link_pool[LINK_POOL][PATH_MAX];	/* Recently created files */
+static int link_pool_cnt;
+static unsigned long long created_files, created_dirs, created_links;
+
+static void usage(void)
+{
+	errstr(_("Utility for generating trees for benchmarking quotacheck.\n\
+Usage: %s [options] -o expected-usage directory\n\n\
+-d, --depth=n         levels of directories (default 3)\n\
+-f, --fanout=n        subdirectories in each directory (default 10)\n\
+-n, --files=n         files in each directory (default 100)\n\
+-s, --max-size=bytes  maximal size of a file (default 8192)\n\
+-u, --uids=n          number of users owning files (default 100)\n\
+-g, --gids=n          number of groups owning files (default 20)\n\
+-b, --base-id=id      first uid and gid used (default 10000)\n\
+-k, --skew=n          skew of distribution of owners, 1 is uniform (default 1)\n\
+-l, --links=percent   percentage of files which are hardlinks (default 5)\n\
+-r, --seed=n          seed of the generator (default 1)\n\
+-o, --output=file     file to write expected usage of each ID to\n"), progname);
+	exit(1);
+}
+
+/* xorshift64* - fast and reproducible across platforms */
+static unsigned long long rnd(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ULL;
+}
+
+/* Random number in [0, n) */
+static unsigned long rnd_range(unsigned long n)
+{
+	return (rnd() >> 11) % n;
+}
+
+/*
+ * Pick one of n IDs. With skew k, the probability of an ID is proportional
+ * to the k-th power of a uniform variable so low IDs are preferred.
+ */
+static unsigned long rnd_id(unsigned long n)
+{
+	double r = (double)(rnd() >> 11) / (double)(1ULL << 53);
+	double p = 1;
+	int i;
+
+	for (i = 0; i < skew; i++)
+		p *= r;
+	return (unsigned long)(p * n) % n;
+}
+
+static int get_num(const char *arg, int min)
+{
+	char *end;
+	long val = strtol(arg, &end, 10);
+
+	if (*end || val < min || val > INT_MAX) {
+		errstr(_("Bad number: %s\n"), arg);
+		usage();
+	}
+	return val;
+}
+
+static void parse_options(int argc, char **argv)
+{
+	struct option long_opts[] = {
+		{ "depth", 1, NULL, 'd' },
+		{ "fanout", 1, NULL, 'f' },
+		{ "files", 1, NULL, 'n' },
+		{ "max-size", 1, NULL, 's' },
+		{ "uids", 1, NULL, 'u' },
+		{ "gids", 1, NULL, 'g' },
+		{ "base-id", 1, NULL, 'b' },
+		{ "skew", 1, NULL, 'k' },
+		{ "links", 1, NULL, 'l' },
+		{ "seed", 1, NULL, 'r' },
+		{ "output", 1, NULL, 'o' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int ret;
+
+	while ((ret = getopt_long(argc, argv, "d:f:n:s:u:g:b:k:l:r:o:", long_opts, NULL)) != -1) {
+		switch (ret) {
+			case 'd':
+				depth = get_num(optarg, 0);
+				break;
+			case 'f':
+				fanout = get_num(optarg, 0);
+				break;
+			case 'n':
+				files = get_num(optarg, 0);
+				break;
+			case 's':
+				max_size = get_num(optarg, 0);
+				break;
+			case 'u':
+				nuids = get_num(optarg, 1);
+				break;
+			case 'g':
+				ngids = get_num(optarg, 1);
+				break;
+			case 'b':
+				base_id = get_num(optarg, 1);
+				break;
+			case 'k':
+				skew = get_num(optarg, 1);
+				break;
+			case 'l':
+				link_ratio = get_num(optarg, 0);
+				if (link_ratio > 100)
+					usage();
+				break;
+			case 'r':
+				seed = get_num(optarg, 1);
+				break;
+			case 'o':
+				out_name = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (!out_name || optind != argc - 1)
+		usage();
+}
+
+/* Add usage of an inode owned by given IDs */
+static void account(const char *name)
+{
+	struct stat st;
+	unsigned long ids[2];
+	int type, i;
+
+	if (lstat(name, &st) < 0)
+		die(1, _("Cannot stat %s: %s\n"), name, strerror(errno));
+	ids[0] = st.st_uid;
+	ids[1] = st.st_gid;
+	for (type = 0; type < 2; type++) {
+		struct usage *u;
+		int n = type ? ngids : nuids;
+
+		if (ids[type] >= base_id && ids[type] < base_id + n)
+			u = (type ? group_usage : user_usage) + ids[type] - base_id;
+		else {
+			for (i = 0; i < other_cnt[type] && other_ids[type][i] != ids[type]; i++);
+			if (i == other_cnt[type]) {
+				other_cnt[type]++;
+				other_ids[type] = srealloc(other_ids[type], sizeof(unsigned long) * other_cnt[type]);
+				other_usage[type] = srealloc(other_usage[type], sizeof(struct usage) * other_cnt[type]);
+				other_ids[type][i] = ids[type];
+				memset(other_usage[type] + i, 0, sizeof(struct usage));
+			}
+			u = other_usage[type] + i;
+		}
+		u->inodes++;
+		u->space += (unsigned long long)st.st_blocks << 9;
+	}
+}
+
+static void set_owner(const char *name)
+{
+	if (lchown(name, base_id + rnd_id(nuids), base_id + rnd_id(ngids)) < 0)
+		die(1, _("Cannot change owner of %s: %s\n"), name, strerror(errno));
+}
+
+static void make_file(const char *name)
+{
+	static char buf[65536];
+	int fd, size, chunk;
+
+	if (link_pool_cnt && rnd_range(100) < link_ratio) {
+		if (link(link_pool[rnd_range(link_pool_cnt)], name) < 0)
+			die(1, _("Cannot create hardlink %s: %s\n"), name, strerror(errno));
+		created_links++;
+		return;
+	}
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+		die(1, _("Cannot create %s: %s\n"), name, strerror(errno));
+	for (size = max_size ? rnd_range(max_size + 1) : 0; size > 0; size -= chunk) {
+		chunk = size > (int)sizeof(buf) ? (int)sizeof(buf) : size;
+		if (write(fd, buf, chunk) != chunk)
+			die(1, _("Cannot write %s: %s\n"), name, strerror(errno));
+	}
+	if (close(fd) < 0)
+		die(1, _("Cannot write %s: %s\n"), name, strerror(errno));
+	set_owner(name);
+	account(name);
+	sstrncpy(link_pool[link_pool_cnt < LINK_POOL ? link_pool_cnt++ : rnd_range(LINK_POOL)],
+		 name, PATH_MAX);
+	created_files++;
+}
+
+/* Create directory with its files and subdirectories */
+static void make_dir(const char *name, int level)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (mkdir(name, 0755) < 0)
+		die(1, _("Cannot create directory %s: %s\n"), name, strerror(errno));
+	set_owner(name);
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", name, i);
+		make_file(path);
+	}
+	if (level < depth)
+		for (i = 0; i < fanout; i++) {
+			snprintf(path, sizeof(path), "%s/d%d", name, i);
+			make_dir(path, level + 1);
+		}
+	/* Size of the directory is final once all entries are created */
+	account(name);
+	created_dirs++;
+}
+
+/*
+ * Account entries which existed on the filesystem before (root directory,
+ * lost+found...). Quota files are not accounted by quotacheck.
+ */
+static void account_existing(const char *root)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dp;
+
+	account(root);
+	if (!(dp = opendir(root)))
+		die(1, _("Cannot open directory %s: %s\n"), root, strerror(errno));
+	while ((de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+		    !strcmp(de->d_name, CORPUS_DIR) || !strncmp(de->d_name, "aquota.", 7) ||
+		    !strncmp(de->d_name, "quota.", 6))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", root, de->d_name);
+		account(path);
+	}
+	closedir(dp);
+}
+
+static void write_usage(FILE *f, const char *type, struct usage *u, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (u[i].inodes)
+			fprintf(f, "%s %d %llu %llu\n", type, base_id + i, u[i].inodes, u[i].space);
+}
+
+int main(int argc, char **argv)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int type, i;
+
+	gettexton();
+	progname = basename(argv[0]);
+	parse_options(argc, argv);
+
+	user_usage = smalloc(sizeof(struct usage) * nuids);
+	memset(user_usage, 0, sizeof(struct usage) * nuids);
+	group_usage = smalloc(sizeof(struct usage) * ngids);
+	memset(group_usage, 0, sizeof(struct usage) * ngids);
+
+	snprintf(path, sizeof(path), "%s/%s", argv[optind], CORPUS_DIR);
+	make_dir(path, 0);
+	sync();
+	account_existing(argv[optind]);
+
+	if (!(f = fopen(out_name, "w")))
+		die(1, _("Cannot create %s: %s\n"), out_name, strerror(errno));
+	write_usage(f, "user", user_usage, nuids);
+	write_usage(f, "group", group_usage, ngids);
+	for (type = 0; type < 2; type++)
+		for (i = 0; i < other_cnt[type]; i++)
+			fprintf(f, "%s %lu %llu %llu\n", type ? "group" : "user", other_ids[type][i],
+				other_usage[type][i].inodes, other_usage[type][i].space);
+	if (fclose(f) < 0)
+		die(1, _("Cannot write %s: %s\n"), out_name, strerror(errno));
+	printf(_("Created %llu directories, %llu files and %llu hardlinks.\n"),
+	       created_dirs, created_files, created_links);
+	return 0;
+}
@@ -172,6 +172,31 @@ static void print_fs_location(struct dquot *q)
 	}
 }
 
+/* Handle lists shared by all ids of each type */
+static struct quota_handle **type_handles[MAXQUOTAS];
+
+static struct quota_handle **get_handles(int type, int mntcnt, char **mnt)
+{
+	if (!type_handles[type])
+		type_handles[type] = create_handle_list(mntcnt, mnt, type, fmt,
+			IOI_READONLY | ((flags & FL_NO_MIXED_PATHS) ? 0 : IOI_NFS_MIXED_PATHS),
+			((flags & FL_NOAUTOFS) ? MS_NO_AUTOFS : 0)
+			| ((flags & FL_LOCALONLY) ? MS_LOCALONLY : 0)
+			| ((flags & FL_NFSALL) ? MS_NFS_ALL : 0));
+	return type_handles[type];
+}
+
+static void dispose_handles(void)
+{
+	int type;
+
+	for (type = 0; type < MAXQUOTAS; type++)
+		if (type_handles[type]) {
+			dispose_handle_list(type_handles[type]);
+			type_handles[type] = NULL;
+		}
+}
+
 static int showquotas(int type, qid_t id, int mntcnt, char **mnt)
 {
 	struct dquot *qlist, *q;
@@ -184,11 +209,7 @@ static int showquotas(int type, qid_t id, int mntcnt, char **mnt)
 
 	time(&now);
 	id2name(id, type, name);
-	handles = create_handle_list(mntcnt, mnt, type, fmt,
-		IOI_READONLY | ((flags & FL_NO_MIXED_PATHS) ? 0 : IOI_NFS_MIXED_PATHS),
-		((flags & FL_NOAUTOFS) ? MS_NO_AUTOFS : 0)
-		| ((flags & FL_LOCALONLY) ? MS_LOCALONLY : 0)
-		| ((flags & FL_NFSALL) ? MS_NFS_ALL : 0));
+	handles = get_handles(type, mntcnt, mnt);
 	qlist = getprivs(id, handles, !!(flags & FL_QUIETREFUSE));
 	over = 0;
 	for (q = qlist; q; q = q->dq_next) {
@@ -289,7 +310,6 @@ static int showquotas(int type, qid_t id, int mntcnt, char **mnt)
 	if (!(flags & FL_QUIET) && !lines && qlist)
 		heading(type, id, name, _("none"));
 	freeprivs(qlist);
-	dispose_handle_list(handles);
 	return over > 0 ? 1 : 0;
 }
 
@@ -418,6 +438,7 @@ int main(int argc, char **argv)
 			for (i = 0; i < ngroups; i++)
 				ret |= showquotas(GRPQUOTA, gidsetp[i], argc, argv);
 		}
+		dispose_handles();
 		exit(ret);
 	}
 
@@ -430,5 +451,6 @@ int main(int argc, char **argv)
 	else if (flags & FL_GROUP)
 		for (; argc > 0; argc--, argv++)
 			ret |= showquotas(GRPQUOTA, group2gid(*argv, !!(flags & FL_NUMNAMES), NULL), 0, NULL);
+	dispose_handles();
 	return ret;
 }
@@ -0,0 +1,114 @@
+#!/bin/bash
+
+# Benchmark of quotacheck scan on a synthetic tree.
+#
+# The script creates a loopback ext4 image (or uses an already mounted empty
+# filesystem given by -m), fills it with a tree generated by qcgen, runs
+# quotacheck on it and reports scanned inodes per second and peak memory
+# usage. With -t, system calls per inode are counted by strace in an extra run
+# which is not timed. Usage computed by quotacheck is then compared with usage
+# expected by the generator.
+#
+# Must be run as root from the build directory. Options after -- are passed
+# to qcgen (see qcgen --help for shape of the tree).
+
+SIZE=1G
+MNT=""
+COLD=0
+RUNS=1
+TRACE=0
+QCARGS=""
+
+usage()
+{
+  echo "Usage: $0 [-s image-size] [-m mountpoint] [-c] [-r runs] [-t] [-q quotacheck-options] [-- qcgen-options]" >&2
+  echo "  -s  size of the loopback image (default $SIZE)" >&2
+  echo "  -m  use this empty filesystem mounted with usrquota,grpquota instead of an image" >&2
+  echo "  -c  drop caches before each run to measure a cold scan" >&2
+  echo "  -r  number of runs of quotacheck (default $RUNS)" >&2
+  echo "  -t  count system calls per inode with strace in a separate run" >&2
+  echo "  -q  additional options for quotacheck" >&2
+  exit 1
+}
+
+while getopts "s:m:cr:tq:h" OPT; do
+  case $OPT in
+    s) SIZE=$OPTARG ;;
+    m) MNT=$OPTARG ;;
+    c) COLD=1 ;;
+    r) RUNS=$OPTARG ;;
+    t) TRACE=1 ;;
+    q) QCARGS=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+for PROG in ./qcgen ./quotacheck ./repquota; do
+  if [ ! -x $PROG ]; then
+    echo "$PROG not found. Run 'make bench' first." >&2
+    exit 1
+  fi
+done
+if [ $TRACE = 1 ] && ! command -v strace >/dev/null; then
+  echo "strace not found, cannot count system calls." >&2
+  exit 1
+fi
+
+WORK=`mktemp -d /tmp/quotacheck-bench.XXXXXX` || exit 1
+cleanup()
+{
+  if [ -n "$IMAGE" ]; then
+    umount $MNT 2>/dev/null
+    rm -f $IMAGE
+    rmdir $MNT 2>/dev/null
+  fi
+  rm -rf $WORK
+}
+trap cleanup EXIT
+
+if [ -z "$MNT" ]; then
+  IMAGE=$WORK.img
+  MNT=$WORK.mnt
+  truncate -s $SIZE $IMAGE && mkfs.ext4 -q -F -i 4096 $IMAGE && mkdir $MNT &&
+    mount -o loop,usrquota,grpquota $IMAGE $MNT || exit 1
+fi
+
+echo "Generating tree on $MNT..."
+./qcgen -o $WORK/expected "$@" $MNT || exit 1
+sync
+
+get() { echo "$SUMMARY" | sed -e "s/.*\"$1\":\([0-9.]*\).*/\1/"; }
+for RUN in `seq $RUNS`; do
+  rm -f $MNT/aquota.user $MNT/aquota.group
+  if [ $COLD = 1 ]; then
+    sync
+    echo 3 >/proc/sys/vm/drop_caches
+  fi
+  ./quotacheck -cugm $QCARGS --progress-fd=3 $MNT 3>$WORK/progress || exit 1
+  SUMMARY=`grep '"event":"summary"' $WORK/progress | tail -n 1`
+  INODES=$((`get files` + `get dirs`))
+  SCAN=`get scan`
+  RATE=`awk "BEGIN { if ($SCAN > 0) printf \"%.0f\", $INODES / $SCAN; else print \"-\" }"`
+  echo "Run $RUN: $INODES inodes, scan ${SCAN}s, $RATE inodes/s, peak RSS `get peak_rss_kb` KB"
+done
+
+# Tracing slows the scan down a lot so system calls are counted in a run of its own
+if [ $TRACE = 1 ]; then
+  rm -f $MNT/aquota.user $MNT/aquota.group
+  strace -f -c -o $WORK/strace ./quotacheck -cugm $QCARGS $MNT || exit 1
+  CALLS=`awk '/ total$/ { print $4 }' $WORK/strace`
+  echo "System calls: $CALLS, `awk "BEGIN { printf \"%.2f\", $CALLS / $INODES }"` per inode"
+fi
+
+# Compare computed usage with the expected one. repquota reports space in KB.
+./repquota -un $MNT | awk '/^#/ { sub("#", "", $1); print "user", $1, $3, $(NF-2) }' >$WORK/got
+./repquota -gn $MNT | awk '/^#/ { sub("#", "", $1); print "group", $1, $3, $(NF-2) }' >>$WORK/got
+awk '{ print $1, $2, int(($4 + 1023) / 1024), $3 }' $WORK/expected | sort >$WORK/want
+sort -o $WORK/got $WORK/got
+if diff -u $WORK/want $WORK/got; then
+  echo "Usage matches expected values."
+else
+  echo "Usage DIFFERS from expected values (type id KB inodes)." >&2
+  exit 2
+fi
@@ -19,14 +19,19 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/sysmacros.h>
 #include <sys/file.h>
 #include <sys/statfs.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/utsname.h>
+#include <sys/resource.h>
 
 #if defined(HAVE_EXT2_INCLUDE)
 #include <linux/types.h>
@@ -46,12 +51,50 @@
 typedef ino_t ext2_ino_t;
 #endif
 
-#define LINKSHASHSIZE 16384	/* Size of hashtable for hardlinked inodes */
-#define DQUOTHASHSIZE 32768	/* Size of hashtable for dquots from file */
+#define HASH_MIN_BITS 10	/* Hash tables start with 1 << HASH_MIN_BITS slots */
+#define DIR_ACCT_MIN_BITS 5	/* Index of usage in a directory starts with 1 << DIR_ACCT_MIN_BITS slots */
+#define ARENA_CHUNK_SIZE 65536	/* Size of one chunk of memory for dquot structures */
+#define ARENA_ALIGN 16		/* Alignment of structures allocated from arena */
+#define LINKS_BITMAP_MAX_MEM (64 << 20)	/* Maximal size of bitmap of hardlinked inodes (per quota type) */
+#define CKPT_NAME "quotacheck.ckpt"	/* Name of file with checkpoint of the scan */
+#define CKPT_MAGIC "QCCKPT02"	/* Magic identifying checkpoint file */
+#define VERIFY_WORST 10		/* Number of IDs with the largest drift to report */
+#define PROGRESS_INTERVAL 1	/* How often to report progress of the scan (in seconds) */
+#define DIR_REPORT_TOP 10	/* Default number of directories reported for each ID */
+
+/* Exit codes in verify mode */
+#define VERIFY_EXIT_DRIFT 1	/* Computed usage differs from the recorded one */
+#define VERIFY_EXIT_ERROR 2	/* Verification failed */
+
+/* Phases of check of one filesystem whose duration is reported */
+enum { PHASE_LOAD, PHASE_SCAN, PHASE_DUMP, PHASE_RENAME, PHASE_VERIFY, PHASES };
+
+/* Chunk of memory from which dquot structures are carved */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;		/* Usable size of the chunk */
+	size_t used;		/* Number of bytes already handed out */
+	char data[0] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+/* Hash table of dquots with open addressing */
+struct dquot_table {
+	struct dquot **slots;
+	uint bits;		/* Table has 1 << bits slots */
+	uint used;		/* Number of occupied slots */
+};
 
-struct dlinks {
-	ino_t i_num;
-	struct dlinks *next;
+/*
+ * Set of already counted hardlinked inodes. Inodes below bitmap_inodes are
+ * tracked in a bitmap, the rest in a hash table where zero marks free slot.
+ */
+struct links_table {
+	char *bitmap;		/* Bitmap of counted inodes (allocated on first use) */
+	ino_t bitmap_inodes;	/* Number of inodes covered by the bitmap */
+	ino_t *slots;
+	uint bits;		/* Table has 1 << bits slots */
+	uint used;		/* Number of occupied slots */
+	int have_zero;		/* Inode number 0 cannot be stored in the table */
 };
 
 struct dirs {
@@ -59,14 +102,117 @@ struct dirs {
 	struct dirs *next;
 };
 
+/* Header of checkpoint file. Values are in host byte order. */
+struct ckpt_header {
+	char magic[8];
+	u_int64_t dev;		/* Device being scanned */
+	u_int64_t blocks, bfree, files, ffree;	/* State of filesystem from statfs() */
+	u_int32_t bfree_valid;	/* Can free blocks be compared (checkpoint is on other device)? */
+	u_int32_t ucheck, gcheck, fmt;	/* What was checked */
+	u_int64_t files_done, dirs_done, bytes_done;	/* Statistics of the scan */
+	u_int64_t max_ino;	/* Inodes covered by bitmaps of hardlinks */
+};
+
+/* Usage of one ID stored in checkpoint file */
+struct ckpt_dquot {
+	u_int32_t id;
+	u_int32_t pad;
+	u_int64_t curinodes;
+	u_int64_t curspace;
+};
+
+/* Old quota file being buffered into memory */
+struct qf_load {
+	int type;		/* Type of quota file (-1 if nothing to load) */
+	char *qfname;		/* Name of quota file */
+	int fd;			/* Opened quota file (-1 if there's no file) */
+	int newfile;		/* Quota file was not found */
+	int ret;		/* Result of loading */
+};
+
+/* Difference between computed and recorded usage of one ID */
+struct drift {
+	qid_t id;
+	qsize_t rspace, rinodes;	/* Recorded usage */
+	qsize_t cspace, cinodes;	/* Computed usage */
+};
+
+/* Usage of one ID in one directory */
+struct dir_usage {
+	char *dir_name;
+	qsize_t space, inodes;
+};
+
+/* Directories with the largest usage of one ID kept in min-heaps by space and by inodes */
+struct id_dirs {
+	qid_t id;
+	uint nspace, ninodes;	/* Number of entries in the heaps */
+	struct dir_usage *space, *inodes;
+};
+
+/* Hash table of directory usage of IDs with open addressing */
+struct id_dirs_table {
+	struct id_dirs **slots;
+	uint bits;		/* Table has 1 << bits slots */
+	uint used;		/* Number of occupied slots */
+};
+
+/* Usage of one ID in the directory being scanned */
+struct dir_acct {
+	int type;
+	qid_t id;
+	uint slot;		/* Slot of the index pointing to this structure */
+	qsize_t space, inodes;
+};
+
+/* Check of one filesystem running in a separate process */
+struct check_job {
+	struct mount_entry *mnt;	/* Filesystem to check */
+	int ucheck, gcheck, cfmt;	/* What and in which format to check */
+	dev_t disk;		/* Disk the filesystem is on (0 when unknown) */
+	pid_t pid;		/* Process doing the check (0 = not started yet, -1 = done) */
+	FILE *out, *err;	/* Output of the check buffered until it finishes */
+};
+
 #define BITS_SIZE 4		/* sizeof(bits) == 5 */
 #define BLIT_RATIO 10		/* Blit in just 1/10 of blit() calls */
 
 static dev_t cur_dev;			/* Device we are working on */
+static ino_t cur_max_ino;		/* Upper bound on inode numbers of the device (0 if unknown) */
 static int files_done, dirs_done;
 int flags, fmt = -1, cfmt;	/* Options from command line; Quota format to use spec. by user; Actual format to check */
 static int uwant, gwant, ucheck, gcheck;	/* Does user want to check user/group quota; Do we check user/group quota? */
 static char *mntpoint;			/* Mountpoint to check */
+static int jobs = 1;			/* Maximal number of filesystems checked in parallel */
+static struct dirs *dir_stack;		/* Directories waiting to be scanned */
+static int ckpt_interval;		/* How often to write checkpoint (in seconds, 0 = never) */
+static time_t ckpt_next;		/* When to write next checkpoint */
+static char *ckpt_name;			/* Name of checkpoint file of current filesystem */
+static char *ckpt_file;			/* Checkpoint file given by user (NULL = next to quota file) */
+static const char *ckpt_mntdir;		/* Mountpoint of filesystem being checkpointed */
+static dev_t ckpt_dir_dev;		/* Device of directory with checkpoint file */
+static ino_t ckpt_dir_ino;		/* Inode of directory with checkpoint file */
+static int verify_type;			/* Quota type being verified */
+static int drift_compared, drift_ids;	/* Number of compared IDs and IDs with drift */
+static qsize_t drift_space[2], drift_inodes[2];	/* Total usage computed above / below recorded one */
+static struct drift drift_worst[VERIFY_WORST];	/* IDs with the largest drift */
+static int drift_found;			/* Was drift found on any filesystem? */
+static FILE *progress_file;		/* Where to report progress (NULL = nowhere) */
+static const char *progress_mntdir;	/* Mountpoint of filesystem being scanned */
+static double progress_start, progress_next;	/* Start of the scan; time of next report */
+static int progress_base;		/* Files and directories done before the scan started */
+static int progress_dirs_base;		/* Directories done before the scan started */
+static u_int64_t scan_inodes;		/* Used inodes of filesystem being scanned (0 = unknown) */
+static u_int64_t bytes_done;		/* Space used by scanned files */
+static int dirs_queued;			/* Number of directories on the directory stack */
+static double phase_time[PHASES];	/* Time spent in phases of current check */
+static const char *phase_names[PHASES] = { "load", "scan", "dump", "rename", "verify" };
+static char *dir_report;		/* File to write directories with the largest usage to */
+static int dir_report_top = DIR_REPORT_TOP;	/* Number of directories to report for each ID */
+static struct dir_acct *dir_accts;	/* Usage of IDs in the directory being scanned */
+static int dir_accts_used, dir_accts_size;
+static int *dir_acct_slots;		/* Index of dir_accts by ID (position + 1, 0 = free) */
+static uint dir_acct_bits;		/* Index has 1 << dir_acct_bits slots */
 char *progname;
 struct util_dqinfo old_info[MAXQUOTAS];	/* Loaded infos */
 
@@ -78,8 +224,13 @@ static size_t malloc_mem = 0;
 static size_t free_mem = 0;
 #endif
 
-static struct dquot *dquot_hash[MAXQUOTAS][DQUOTHASHSIZE];
-static struct dlinks *links_hash[MAXQUOTAS][DQUOTHASHSIZE];
+static struct arena_chunk *dquot_arena;
+static struct dquot_table dquot_tables[MAXQUOTAS];	/* Usage gathered by the scan */
+static struct arena_chunk *file_arena;
+static struct dquot_table file_tables[MAXQUOTAS];	/* Structures loaded from old quota files */
+static struct links_table links_tables[MAXQUOTAS];
+static struct arena_chunk *dirs_arena;
+static struct id_dirs_table id_dirs_tables[MAXQUOTAS];	/* Directories with the largest usage */
 
 /*
  * Ok check each memory allocation.
@@ -111,10 +262,71 @@ void debug(int df, char *fmtstr, ...)
 	va_end(args);
 }
 
+/*
+ * Get zeroed memory from an arena. Memory is released only all at once
+ * by arena_release().
+ */
+static void *arena_alloc(struct arena_chunk **arena, size_t size)
+{
+	struct arena_chunk *chunk = *arena;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t csize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+		chunk = xmalloc(sizeof(struct arena_chunk) + csize);
+		chunk->size = csize;
+		chunk->next = *arena;
+		*arena = chunk;
+	}
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+/* Free all memory handed out by the arena */
+static void arena_release(struct arena_chunk **arena)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = *arena)) {
+		*arena = chunk->next;
+#ifdef DEBUG_MALLOC
+		free_mem += sizeof(struct arena_chunk) + chunk->size;
+#endif
+		free(chunk);
+	}
+}
+
 /* Compute hashvalue for given inode number */
-static inline uint hash_ino(uint i_num)
+static inline uint hash_ino(ino_t i_num, uint bits)
 {
-	return ((i_num ^ (i_num << 16)) * 997) & (LINKSHASHSIZE - 1);
+	return (uint)(((unsigned long long)i_num * 0x9e3779b97f4a7c15ULL) >> (64 - bits));
+}
+
+/* Double the size of table of hardlinks and rehash stored inodes */
+static void links_table_grow(struct links_table *t)
+{
+	ino_t *old = t->slots;
+	uint oldsize = old ? 1 << t->bits : 0;
+	uint i, pos, mask;
+
+	t->bits = old ? t->bits + 1 : HASH_MIN_BITS;
+	t->slots = xmalloc(sizeof(ino_t) << t->bits);
+	mask = (1 << t->bits) - 1;
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i])
+			continue;
+		for (pos = hash_ino(old[i], t->bits); t->slots[pos]; pos = (pos + 1) & mask);
+		t->slots[pos] = old[i];
+	}
+	if (old) {
+#ifdef DEBUG_MALLOC
+		free_mem += sizeof(ino_t) * oldsize;
+#endif
+		free(old);
+	}
 }
 
 /*
@@ -122,62 +334,333 @@ static inline uint hash_ino(uint i_num)
  */
 static int store_dlinks(int type, ino_t i_num)
 {
-	struct dlinks *lptr;
-	uint hash = hash_ino(i_num);
+	struct links_table *t = links_tables + type;
+	uint pos, mask;
 
 	debug(FL_DEBUG, _("Adding hardlink for inode %llu\n"), (unsigned long long)i_num);
 
-	for (lptr = links_hash[type][hash]; lptr; lptr = lptr->next)
-		if (lptr->i_num == i_num)
-			return 1;
-
-	lptr = (struct dlinks *)xmalloc(sizeof(struct dlinks));
+	if (i_num < cur_max_ino) {
+		char bit = 1 << (i_num & 7);
 
-	lptr->i_num = i_num;
-	lptr->next = links_hash[type][hash];
-	links_hash[type][hash] = lptr;
+		if (!t->bitmap) {
+			t->bitmap_inodes = cur_max_ino;
+			t->bitmap = xmalloc((cur_max_ino + 7) >> 3);
+		}
+		if (t->bitmap[i_num >> 3] & bit)
+			return 1;
+		t->bitmap[i_num >> 3] |= bit;
+		return 0;
+	}
+	if (!i_num) {
+		if (t->have_zero)
+			return 1;
+		t->have_zero = 1;
+		return 0;
+	}
+	if (!t->slots || (t->used + 1) * 4 > (3U << t->bits))
+		links_table_grow(t);
+	mask = (1 << t->bits) - 1;
+	for (pos = hash_ino(i_num, t->bits); t->slots[pos]; pos = (pos + 1) & mask)
+		if (t->slots[pos] == i_num)
+			return 1;
+	t->slots[pos] = i_num;
+	t->used++;
 	return 0;
 }
 
 /* Hash given id */
-static inline uint hash_dquot(uint id)
+static inline uint hash_dquot(qid_t id, uint bits)
 {
-	return ((id ^ (id << 16)) * 997) & (DQUOTHASHSIZE - 1);
+	return ((uint)id * 0x9e3779b9U) >> (32 - bits);
 }
 
-/*
- * Do a lookup of a type of quota for a specific id. Use short cut with
- * most recently used dquot struct pointer.
- */
-struct dquot *lookup_dquot(qid_t id, int type)
+/* Double the size of table of dquots and rehash stored structures */
+static void dquot_table_grow(struct dquot_table *t)
+{
+	struct dquot **old = t->slots;
+	uint oldsize = old ? 1 << t->bits : 0;
+	uint i, pos, mask;
+
+	t->bits = old ? t->bits + 1 : HASH_MIN_BITS;
+	t->slots = xmalloc(sizeof(struct dquot *) << t->bits);
+	mask = (1 << t->bits) - 1;
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i])
+			continue;
+		for (pos = hash_dquot(old[i]->dq_id, t->bits); t->slots[pos]; pos = (pos + 1) & mask);
+		t->slots[pos] = old[i];
+	}
+	if (old) {
+#ifdef DEBUG_MALLOC
+		free_mem += sizeof(struct dquot *) * oldsize;
+#endif
+		free(old);
+	}
+}
+
+/* Insert dquot into the table. There must not be dquot with the same id. */
+static void dquot_table_insert(struct dquot_table *t, struct dquot *dquot)
+{
+	uint pos, mask;
+
+	if (!t->slots || (t->used + 1) * 4 > (3U << t->bits))
+		dquot_table_grow(t);
+	mask = (1 << t->bits) - 1;
+	for (pos = hash_dquot(dquot->dq_id, t->bits); t->slots[pos]; pos = (pos + 1) & mask);
+	t->slots[pos] = dquot;
+	t->used++;
+}
+
+/* Find dquot with given id in the table */
+static struct dquot *dquot_table_lookup(struct dquot_table *t, qid_t id)
 {
 	struct dquot *lptr;
-	uint hash = hash_dquot(id);
+	uint pos, mask;
 
-	for (lptr = dquot_hash[type][hash]; lptr != NODQUOT; lptr = lptr->dq_next)
+	if (!t->slots)
+		return NODQUOT;
+	mask = (1 << t->bits) - 1;
+	for (pos = hash_dquot(id, t->bits); (lptr = t->slots[pos]) != NODQUOT; pos = (pos + 1) & mask)
 		if (lptr->dq_id == id)
 			return lptr;
 	return NODQUOT;
 }
 
+/* Allocate new dquot from the arena and add it to the table */
+static struct dquot *dquot_table_add(struct dquot_table *t, struct arena_chunk **arena, qid_t id)
+{
+	struct dquot *lptr = (struct dquot *)arena_alloc(arena, sizeof(struct dquot));
+
+	lptr->dq_id = id;
+	lptr->dq_dqb.dqb_btime = lptr->dq_dqb.dqb_itime = (time_t) 0;
+	dquot_table_insert(t, lptr);
+	return lptr;
+}
+
 /*
- * Add a new dquot for a new id to the list.
+ * Do a lookup of a type of quota for a specific id in the structures
+ * loaded from the old quota file.
+ */
+struct dquot *lookup_dquot(qid_t id, int type)
+{
+	return dquot_table_lookup(file_tables + type, id);
+}
+
+/*
+ * Add a new dquot loaded from the old quota file.
  */
 struct dquot *add_dquot(qid_t id, int type)
 {
-	struct dquot *lptr;
-	uint hash = hash_dquot(id);
+	debug(FL_DEBUG, _("Adding dquot structure type %s for %d\n"), type2name(type), (int)id);
+
+	return dquot_table_add(file_tables + type, &file_arena, id);
+}
+
+/* Lookup dquot with usage gathered by the scan */
+static struct dquot *lookup_scan_dquot(qid_t id, int type)
+{
+	return dquot_table_lookup(dquot_tables + type, id);
+}
 
+/* Add new dquot for usage gathered by the scan */
+static struct dquot *add_scan_dquot(qid_t id, int type)
+{
 	debug(FL_DEBUG, _("Adding dquot structure type %s for %d\n"), type2name(type), (int)id);
 
-	lptr = (struct dquot *)xmalloc(sizeof(struct dquot));
+	return dquot_table_add(dquot_tables + type, &dquot_arena, id);
+}
 
-	lptr->dq_id = id;
-	lptr->dq_next = dquot_hash[type][hash];
-	dquot_hash[type][hash] = lptr;
-	lptr->dq_dqb.dqb_btime = lptr->dq_dqb.dqb_itime = (time_t) 0;
+/*
+ * Merge limits and grace times loaded from the old quota file into the
+ * usage gathered by the scan.
+ */
+static void merge_file_dquots(int type)
+{
+	struct dquot_table *t = file_tables + type;
+	struct dquot *fd, *sd;
+	uint i;
 
-	return lptr;
+	for (i = 0; t->slots && i < (1U << t->bits); i++) {
+		if (!(fd = t->slots[i]))
+			continue;
+		if ((sd = lookup_scan_dquot(fd->dq_id, type)) == NODQUOT) {
+			dquot_table_insert(dquot_tables + type, fd);
+			continue;
+		}
+		sd->dq_dqb.dqb_bhardlimit = fd->dq_dqb.dqb_bhardlimit;
+		sd->dq_dqb.dqb_bsoftlimit = fd->dq_dqb.dqb_bsoftlimit;
+		sd->dq_dqb.dqb_ihardlimit = fd->dq_dqb.dqb_ihardlimit;
+		sd->dq_dqb.dqb_isoftlimit = fd->dq_dqb.dqb_isoftlimit;
+		sd->dq_dqb.dqb_btime = fd->dq_dqb.dqb_btime;
+		sd->dq_dqb.dqb_itime = fd->dq_dqb.dqb_itime;
+	}
+}
+
+/* Double the size of index of usage in the directory and reinsert stored structures */
+static void dir_acct_index_grow(void)
+{
+	uint oldsize = dir_acct_slots ? 1 << dir_acct_bits : 0;
+	uint pos, mask;
+	int i;
+
+	if (dir_acct_slots) {
+#ifdef DEBUG_MALLOC
+		free_mem += sizeof(int) * oldsize;
+#endif
+		free(dir_acct_slots);
+	}
+	dir_acct_bits = oldsize ? dir_acct_bits + 1 : DIR_ACCT_MIN_BITS;
+	dir_acct_slots = xmalloc(sizeof(int) << dir_acct_bits);
+	mask = (1 << dir_acct_bits) - 1;
+	for (i = 0; i < dir_accts_used; i++) {
+		for (pos = hash_dquot(dir_accts[i].id, dir_acct_bits); dir_acct_slots[pos]; pos = (pos + 1) & mask);
+		dir_acct_slots[pos] = i + 1;
+		dir_accts[i].slot = pos;
+	}
+}
+
+/* Account usage of an ID in the directory being scanned */
+static void account_dir_usage(int type, qid_t id, loff_t space)
+{
+	struct dir_acct *acct;
+	uint pos, mask;
+
+	if (!dir_acct_slots || (dir_accts_used + 1) * 2 > (1 << dir_acct_bits))
+		dir_acct_index_grow();
+	mask = (1 << dir_acct_bits) - 1;
+	for (pos = hash_dquot(id, dir_acct_bits); dir_acct_slots[pos]; pos = (pos + 1) & mask) {
+		acct = dir_accts + dir_acct_slots[pos] - 1;
+		if (acct->id == id && acct->type == type)
+			goto found;
+	}
+	if (dir_accts_used == dir_accts_size) {
+#ifdef DEBUG_MALLOC
+		malloc_mem += sizeof(struct dir_acct) * (dir_accts_size ? dir_accts_size : 16);
+#endif
+		dir_accts_size = dir_accts_size ? dir_accts_size * 2 : 16;
+		dir_accts = srealloc(dir_accts, sizeof(struct dir_acct) * dir_accts_size);
+	}
+	acct = dir_accts + dir_accts_used++;
+	acct->type = type;
+	acct->id = id;
+	acct->slot = pos;
+	acct->space = acct->inodes = 0;
+	dir_acct_slots[pos] = dir_accts_used;
+found:
+	acct->space += space;
+	acct->inodes++;
+}
+
+/* Forget usage gathered for the scanned directory */
+static void reset_dir_accts(void)
+{
+	int i;
+
+	for (i = 0; i < dir_accts_used; i++)
+		dir_acct_slots[dir_accts[i].slot] = 0;
+	dir_accts_used = 0;
+}
+
+/* Double the size of table of directory usage and rehash stored structures */
+static void id_dirs_table_grow(struct id_dirs_table *t)
+{
+	struct id_dirs **old = t->slots;
+	uint oldsize = old ? 1 << t->bits : 0;
+	uint i, pos, mask;
+
+	t->bits = old ? t->bits + 1 : HASH_MIN_BITS;
+	t->slots = xmalloc(sizeof(struct id_dirs *) << t->bits);
+	mask = (1 << t->bits) - 1;
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i])
+			continue;
+		for (pos = hash_dquot(old[i]->id, t->bits); t->slots[pos]; pos = (pos + 1) & mask);
+		t->slots[pos] = old[i];
+	}
+	if (old) {
+#ifdef DEBUG_MALLOC
+		free_mem += sizeof(struct id_dirs *) * oldsize;
+#endif
+		free(old);
+	}
+}
+
+/* Find directory usage of given ID, create it if it does not exist */
+static struct id_dirs *get_id_dirs(int type, qid_t id)
+{
+	struct id_dirs_table *t = id_dirs_tables + type;
+	struct id_dirs *idd;
+	uint pos, mask;
+
+	if (!t->slots || (t->used + 1) * 4 > (3U << t->bits))
+		id_dirs_table_grow(t);
+	mask = (1 << t->bits) - 1;
+	for (pos = hash_dquot(id, t->bits); (idd = t->slots[pos]); pos = (pos + 1) & mask)
+		if (idd->id == id)
+			return idd;
+	idd = arena_alloc(&dirs_arena, sizeof(struct id_dirs));
+	idd->id = id;
+	idd->space = arena_alloc(&dirs_arena, sizeof(struct dir_usage) * dir_report_top);
+	idd->inodes = arena_alloc(&dirs_arena, sizeof(struct dir_usage) * dir_report_top);
+	t->slots[pos] = idd;
+	t->used++;
+	return idd;
+}
+
+static inline qsize_t dir_usage_key(struct dir_usage *u, int by_inodes)
+{
+	return by_inodes ? u->inodes : u->space;
+}
+
+/*
+ * Offer usage of a directory to a min-heap of the largest usages. When the
+ * heap is full, the smallest entry is replaced if the new one is larger.
+ */
+static void dir_heap_offer(struct dir_usage *heap, uint *cnt, int by_inodes, const char *dir_name,
+			   qsize_t space, qsize_t inodes)
+{
+	struct dir_usage new;
+	uint pos, child;
+
+	new.space = space;
+	new.inodes = inodes;
+	if (*cnt < dir_report_top) {
+		new.dir_name = sstrdup(dir_name);
+		/* Sift the new entry up from the last position */
+		for (pos = (*cnt)++; pos && dir_usage_key(heap + (pos - 1) / 2, by_inodes) > dir_usage_key(&new, by_inodes); pos = (pos - 1) / 2)
+			heap[pos] = heap[(pos - 1) / 2];
+		heap[pos] = new;
+		return;
+	}
+	if (dir_usage_key(heap, by_inodes) >= dir_usage_key(&new, by_inodes))
+		return;
+	free(heap->dir_name);
+	new.dir_name = sstrdup(dir_name);
+	/* Sift the new entry down from the root */
+	for (pos = 0; (child = 2 * pos + 1) < *cnt; pos = child) {
+		if (child + 1 < *cnt && dir_usage_key(heap + child + 1, by_inodes) < dir_usage_key(heap + child, by_inodes))
+			child++;
+		if (dir_usage_key(heap + child, by_inodes) >= dir_usage_key(&new, by_inodes))
+			break;
+		heap[pos] = heap[child];
+	}
+	heap[pos] = new;
+}
+
+/* Add usage gathered for the scanned directory to the heaps of IDs */
+static void flush_dir_usage(const char *dir_name)
+{
+	struct id_dirs *idd;
+	int i;
+
+	for (i = 0; i < dir_accts_used; i++) {
+		idd = get_id_dirs(dir_accts[i].type, dir_accts[i].id);
+		dir_heap_offer(idd->space, &idd->nspace, 0, dir_name,
+			       dir_accts[i].space, dir_accts[i].inodes);
+		dir_heap_offer(idd->inodes, &idd->ninodes, 1, dir_name,
+			       dir_accts[i].space, dir_accts[i].inodes);
+	}
+	reset_dir_accts();
 }
 
 /*
@@ -194,14 +677,40 @@ static void add_to_quota(int type, ino_t i_num, uid_t i_uid, gid_t i_gid, mode_t
 	else
 		wanted = i_gid;
 
-	if ((lptr = lookup_dquot(wanted, type)) == NODQUOT)
-		lptr = add_dquot(wanted, type);
+	if ((lptr = lookup_scan_dquot(wanted, type)) == NODQUOT)
+		lptr = add_scan_dquot(wanted, type);
 
 	if (i_nlink != 1 && need_remember)
 		if (store_dlinks(type, i_num))	/* Did we already count this inode? */
 			return;
 	lptr->dq_dqb.dqb_curinodes++;
 	lptr->dq_dqb.dqb_curspace += i_space;;
+	if (dir_report)
+		account_dir_usage(type, wanted, i_space);
+}
+
+/* Free heaps of directories with the largest usage */
+static void free_id_dirs(int type)
+{
+	struct id_dirs_table *t = id_dirs_tables + type;
+	struct id_dirs *idd;
+	uint i, j;
+
+	for (i = 0; t->slots && i < (1U << t->bits); i++) {
+		if (!(idd = t->slots[i]))
+			continue;
+		for (j = 0; j < idd->nspace; j++)
+			free(idd->space[j].dir_name);
+		for (j = 0; j < idd->ninodes; j++)
+			free(idd->inodes[j].dir_name);
+	}
+	if (t->slots) {
+#ifdef DEBUG_MALLOC
+		free_mem += sizeof(struct id_dirs *) << t->bits;
+#endif
+		free(t->slots);
+	}
+	memset(t, 0, sizeof(struct id_dirs_table));
 }
 
 /*
@@ -210,38 +719,84 @@ static void add_to_quota(int type, ino_t i_num, uid_t i_uid, gid_t i_gid, mode_t
 static void remove_list(void)
 {
 	int cnt;
-	uint i;
-	struct dquot *dquot, *dquot_free;
-	struct dlinks *dlink, *dlink_free;
 
 	for (cnt = 0; cnt < MAXQUOTAS; cnt++) {
-		for (i = 0; i < DQUOTHASHSIZE; i++) {
-			dquot = dquot_hash[cnt][i];
-			while (dquot != NODQUOT) {
-				dquot_free = dquot;
-				dquot = dquot->dq_next;
+		if (dquot_tables[cnt].slots) {
 #ifdef DEBUG_MALLOC
-				free_mem += sizeof(struct dquot);
+			free_mem += sizeof(struct dquot *) << dquot_tables[cnt].bits;
 #endif
-				free(dquot_free);
-			}
-			dquot_hash[cnt][i] = NODQUOT;
+			free(dquot_tables[cnt].slots);
 		}
-		for (i = 0; i < LINKSHASHSIZE; i++) {
-			dlink = links_hash[cnt][i];
-			while (dlink) {
-				dlink_free = dlink;
-				dlink = dlink->next;
+		memset(dquot_tables + cnt, 0, sizeof(struct dquot_table));
+		if (file_tables[cnt].slots) {
 #ifdef DEBUG_MALLOC
-				free_mem += sizeof(struct dlinks);
+			free_mem += sizeof(struct dquot *) << file_tables[cnt].bits;
 #endif
-				free(dlink_free);
-			}
-			links_hash[cnt][i] = NULL;
+			free(file_tables[cnt].slots);
 		}
+		memset(file_tables + cnt, 0, sizeof(struct dquot_table));
+		if (links_tables[cnt].slots) {
+#ifdef DEBUG_MALLOC
+			free_mem += sizeof(ino_t) << links_tables[cnt].bits;
+#endif
+			free(links_tables[cnt].slots);
+		}
+		if (links_tables[cnt].bitmap) {
+#ifdef DEBUG_MALLOC
+			free_mem += (links_tables[cnt].bitmap_inodes + 7) >> 3;
+#endif
+			free(links_tables[cnt].bitmap);
+		}
+		memset(links_tables + cnt, 0, sizeof(struct links_table));
+		free_id_dirs(cnt);
+	}
+	arena_release(&dquot_arena);
+	arena_release(&file_arena);
+	arena_release(&dirs_arena);
+	dir_accts_used = 0;
+	if (dir_accts) {
+#ifdef DEBUG_MALLOC
+		free_mem += sizeof(struct dir_acct) * dir_accts_size;
+#endif
+		free(dir_accts);
+		dir_accts = NULL;
+		dir_accts_size = 0;
+	}
+	if (dir_acct_slots) {
+#ifdef DEBUG_MALLOC
+		free_mem += sizeof(int) << dir_acct_bits;
+#endif
+		free(dir_acct_slots);
+		dir_acct_slots = NULL;
 	}
 }
 
+/*
+ * Find out whether inode numbers on the filesystem are dense and bounded
+ * by the number of inodes. If so and the bitmap of hardlinked inodes fits
+ * into our memory budget, it is used instead of the hash table.
+ */
+static void setup_links_bitmap(struct mount_entry *mnt)
+{
+	struct statfs sfs;
+
+	cur_max_ino = 0;
+	if (strcmp(mnt->me_type, MNTTYPE_EXT2) && strcmp(mnt->me_type, MNTTYPE_EXT3) &&
+	    strcmp(mnt->me_type, MNTTYPE_EXT4) && strcmp(mnt->me_type, MNTTYPE_EXT4DEV) &&
+	    strcmp(mnt->me_type, MNTTYPE_NEXT3))
+		return;
+	if (statfs(mnt->me_dir, &sfs) < 0) {
+		debug(FL_DEBUG, _("Cannot statfs() %s: %s\n"), mnt->me_dir, strerror(errno));
+		return;
+	}
+	/* Inode numbers on ext? are 1..s_inodes_count */
+	if (!sfs.f_files || (sfs.f_files >> 3) >= LINKS_BITMAP_MAX_MEM)
+		return;
+	cur_max_ino = sfs.f_files + 1;
+	debug(FL_DEBUG, _("Using bitmap for hardlinks of up to %llu inodes.\n"),
+	      (unsigned long long)cur_max_ino);
+}
+
 /* Get size used by file */
 static loff_t getqsize(const char *fname, struct stat *st)
 {
@@ -297,7 +852,7 @@ static inline void blit(const char *msg)
 
 static void usage(void)
 {
-	printf(_("Utility for checking and repairing quota files.\n%s [-gucbfinvdmMR] [-F <quota-format>] filesystem|-a\n\n\
+	printf(_("Utility for checking and repairing quota files.\n%s [-gucbfinvdmMRG] [-F <quota-format>] [-j <jobs>] filesystem|-a\n\n\
 -u, --user                check user files\n\
 -g, --group               check group files\n\
 -c, --create-files        create new quota files\n\
@@ -313,6 +868,18 @@ static void usage(void)
 -R, --exclude-root        exclude root when checking all filesystems\n\
 -F, --format=formatname   check quota files of specific format\n\
 -a, --all                 check all filesystems\n\
+-j, --jobs=number         check up to given number of filesystems in parallel\n\
+-G, --group-by-disk       do not check filesystems on the same disk in parallel\n\
+    --checkpoint=seconds  periodically save state of the scan next to quota file\n\
+    --checkpoint-file=file\n\
+                          save checkpoint to file instead of next to quota file\n\
+    --resume              continue an interrupted scan from saved checkpoint\n\
+    --verify              only compare computed usage with the recorded one,\n\
+                          do not modify quota files\n\
+    --progress-fd=fd      report progress of the scan as JSON lines to fd\n\
+    --dir-report=file     write directories with the largest usage of each\n\
+                          user or group to file\n\
+    --dir-report-top=n    number of directories reported for each ID (default 10)\n\
 -h, --help                display this message and exit\n\
 -V, --version             display version information and exit\n\n"), progname);
 	printf(_("Bugs to %s\n"), MY_EMAIL);
@@ -339,10 +906,20 @@ static void parse_options(int argcnt, char **argstr)
 		{ "try-remount", 0, NULL, 'M' },
 		{ "exclude-root", 0, NULL, 'R' },
 		{ "all", 0, NULL, 'a' },
+		{ "jobs", 1, NULL, 'j' },
+		{ "group-by-disk", 0, NULL, 'G' },
+		{ "checkpoint", 1, NULL, 256 },
+		{ "resume", 0, NULL, 257 },
+		{ "verify", 0, NULL, 258 },
+		{ "progress-fd", 1, NULL, 259 },
+		{ "dir-report", 1, NULL, 260 },
+		{ "dir-report-top", 1, NULL, 261 },
+		{ "checkpoint-file", 1, NULL, 262 },
 		{ NULL, 0, NULL, 0 }
 	};
+	char *errch;
 
-	while ((ret = getopt_long(argcnt, argstr, "VhbcvugidnfF:mMRa", long_opts, NULL)) != -1) {
+	while ((ret = getopt_long(argcnt, argstr, "VhbcvugidnfF:mMRaj:G", long_opts, NULL)) != -1) {
   	        switch (ret) {
 		  case 'b':
   		          flags |= FL_BACKUPS;
@@ -394,6 +971,54 @@ static void parse_options(int argcnt, char **argstr)
 			  if ((fmt = name2fmt(optarg)) == QF_ERROR)
 				  exit(1);
 			  break;
+		  case 'j':
+			  jobs = strtol(optarg, &errch, 10);
+			  if (*errch || jobs < 1) {
+				  errstr(_("Bad number of jobs: %s\n"), optarg);
+				  usage();
+			  }
+			  break;
+		  case 'G':
+			  flags |= FL_DISKGROUPS;
+			  break;
+		  case 256:
+			  ckpt_interval = strtol(optarg, &errch, 10);
+			  if (*errch || ckpt_interval < 1) {
+				  errstr(_("Bad checkpoint interval: %s\n"), optarg);
+				  usage();
+			  }
+			  break;
+		  case 257:
+			  flags |= FL_RESUME;
+			  break;
+		  case 258:
+			  flags |= FL_VERIFY;
+			  break;
+		  case 259:
+			  ret = strtol(optarg, &errch, 10);
+			  if (*errch || ret < 0) {
+				  errstr(_("Bad file descriptor: %s\n"), optarg);
+				  usage();
+			  }
+			  if (!(progress_file = fdopen(ret, "w"))) {
+				  errstr(_("Cannot use file descriptor %d for progress reports: %s\n"),
+					 ret, strerror(errno));
+				  exit(1);
+			  }
+			  break;
+		  case 260:
+			  dir_report = optarg;
+			  break;
+		  case 261:
+			  dir_report_top = strtol(optarg, &errch, 10);
+			  if (*errch || dir_report_top < 1) {
+				  errstr(_("Bad number of directories: %s\n"), optarg);
+				  usage();
+			  }
+			  break;
+		  case 262:
+			  ckpt_file = optarg;
+			  break;
 		  default:
 			usage();
 		}
@@ -406,105 +1031,538 @@ static void parse_options(int argcnt, char **argstr)
 	}
 	if (flags & FL_VERBOSE && flags & FL_DEBUG)
 		flags &= ~FL_VERBOSE;
+	if (ckpt_file && flags & FL_ALL) {
+		fputs(_("Checkpoint file cannot be specified when checking all filesystems.\n"), stderr);
+		usage();
+	}
+	if (jobs > 1 && flags & (FL_INTERACTIVE | FL_VERYVERBOSE)) {
+		fputs(_("Parallel checking cannot be used in interactive mode or when printing directory names.\n"), stderr);
+		usage();
+	}
 	if (!(flags & FL_ALL))
 		mntpoint = argstr[optind];
 	else
 		mntpoint = NULL;
 }
 
+/* Get monotonic time in seconds */
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write string to progress file as JSON string */
+static void progress_string(const char *str)
+{
+	putc('"', progress_file);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(progress_file, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(progress_file, "\\u%04x", *str);
+		else
+			putc(*str, progress_file);
+	}
+	putc('"', progress_file);
+}
+
+/* Start measuring progress of the scan of given filesystem */
+static void start_progress(struct mount_entry *mnt)
+{
+	struct statfs sfs;
+
+	progress_mntdir = mnt->me_dir;
+	progress_start = get_time();
+	progress_next = progress_start + PROGRESS_INTERVAL;
+	progress_base = files_done + dirs_done;
+	progress_dirs_base = dirs_done;
+	scan_inodes = 0;
+	if (statfs(mnt->me_dir, &sfs) == 0 && sfs.f_files > sfs.f_ffree)
+		scan_inodes = sfs.f_files - sfs.f_ffree;
+}
+
+/* Write one line with current progress of the scan */
+static void report_progress(double now)
+{
+	double elapsed = now - progress_start;
+	u_int64_t done = files_done + dirs_done;
+	/* Rates count only what this scan did, not what was restored from a checkpoint */
+	u_int64_t scanned = done - progress_base;
+	u_int64_t dirs_scanned = dirs_done - progress_dirs_base;
+
+	fputs("{\"event\":\"progress\",\"mountpoint\":", progress_file);
+	progress_string(progress_mntdir);
+	fprintf(progress_file, ",\"elapsed\":%.3f,\"files\":%d,\"dirs\":%d,\"bytes\":%llu,\"queued\":%d,\"inodes_per_sec\":%.1f,\"dirs_per_sec\":%.1f",
+		elapsed, files_done, dirs_done, (unsigned long long)bytes_done, dirs_queued,
+		elapsed > 0 ? scanned / elapsed : 0, elapsed > 0 ? dirs_scanned / elapsed : 0);
+	if (scan_inodes) {
+		fprintf(progress_file, ",\"inodes_total\":%llu", (unsigned long long)scan_inodes);
+		if (scanned && done < scan_inodes)
+			fprintf(progress_file, ",\"eta\":%.0f", elapsed * (scan_inodes - done) / scanned);
+	}
+	fputs("}\n", progress_file);
+	fflush(progress_file);
+}
+
+/* Report progress of the scan if it is the time to do so */
+static inline void progress_tick(void)
+{
+	double now;
+
+	if (!progress_file)
+		return;
+	now = get_time();
+	if (now >= progress_next) {
+		report_progress(now);
+		progress_next = now + PROGRESS_INTERVAL;
+	}
+}
+
+/* Write summary of the check of a filesystem */
+static void report_summary(struct mount_entry *mnt, int failed)
+{
+	struct rusage ru;
+	int i;
+
+	if (!progress_file)
+		return;
+	getrusage(RUSAGE_SELF, &ru);
+	fputs("{\"event\":\"summary\",\"mountpoint\":", progress_file);
+	progress_string(mnt->me_dir);
+	fprintf(progress_file, ",\"status\":\"%s\",\"files\":%d,\"dirs\":%d,\"bytes\":%llu,\"phases\":{",
+		failed ? "failed" : "ok", files_done, dirs_done, (unsigned long long)bytes_done);
+	for (i = 0; i < PHASES; i++)
+		fprintf(progress_file, "%s\"%s\":%.3f", i ? "," : "", phase_names[i], phase_time[i]);
+	fprintf(progress_file, "},\"peak_rss_kb\":%ld}\n", ru.ru_maxrss);
+	fflush(progress_file);
+}
+
 #if defined(EXT2_DIRECT)
 static int ext2_direct_scan(const char *device)
 {
-	ext2_ino_t i_num;
-	ext2_filsys fs;
-	errcode_t error;
-	ext2_inode_scan scan;
-	struct ext2_inode inode;
-	int inode_buffer_blocks = 0;
-	ext2fs_inode_bitmap inode_used_map;
-	ext2fs_inode_bitmap inode_dir_map;
-	uid_t uid;
-	gid_t gid;
+	ext2_ino_t i_num;
+	ext2_filsys fs;
+	errcode_t error;
+	ext2_inode_scan scan;
+	struct ext2_inode inode;
+	int inode_buffer_blocks = 0;
+	ext2fs_inode_bitmap inode_used_map;
+	ext2fs_inode_bitmap inode_dir_map;
+	uid_t uid;
+	gid_t gid;
+
+	if ((error = ext2fs_open(device, 0, 0, 0, unix_io_manager, &fs))) {
+		errstr(_("error (%d) while opening %s\n"), (int)error, device);
+		return -1;
+	}
+
+	if ((error = ext2fs_allocate_inode_bitmap(fs, "in-use inode map", &inode_used_map))) {
+		errstr(_("error (%d) while allocating file inode bitmap\n"), (int)error);
+		return -1;
+	}
+
+	if ((error = ext2fs_allocate_inode_bitmap(fs, "directory inode map", &inode_dir_map))) {
+		errstr(_("errstr (%d) while allocating directory inode bitmap\n"), (int)error);
+		return -1;
+	}
+
+	if ((error = ext2fs_open_inode_scan(fs, inode_buffer_blocks, &scan))) {
+		errstr(_("error (%d) while opening inode scan\n"), (int)error);
+		return -1;
+	}
+
+	if ((error = ext2fs_get_next_inode(scan, &i_num, &inode))) {
+		errstr(_("error (%d) while starting inode scan\n"), (int)error);
+		return -1;
+	}
+
+	while (i_num) {
+		if ((i_num == EXT2_ROOT_INO ||
+		     i_num >= EXT2_FIRST_INO(fs->super)) &&
+		    inode.i_links_count) {
+			debug(FL_DEBUG, _("Found i_num %ld, blocks %ld\n"), (long)i_num, (long)inode.i_blocks);
+			if (flags & FL_VERBOSE)
+				blit(NULL);
+			uid = inode.i_uid | (inode.i_uid_high << 16);
+			gid = inode.i_gid | (inode.i_gid_high << 16);
+			if (inode.i_uid_high | inode.i_gid_high)
+				debug(FL_DEBUG, _("High uid detected.\n"));
+			if (ucheck)
+				add_to_quota(USRQUOTA, i_num, uid, gid,
+					     inode.i_mode, inode.i_links_count,
+					     ((loff_t)inode.i_blocks) << 9, 0);
+			if (gcheck)
+				add_to_quota(GRPQUOTA, i_num, uid, gid,
+					     inode.i_mode, inode.i_links_count,
+					     ((loff_t)inode.i_blocks) << 9, 0);
+			if (S_ISDIR(inode.i_mode))
+				dirs_done++;
+			else
+				files_done++;
+			bytes_done += ((loff_t)inode.i_blocks) << 9;
+			progress_tick();
+		}
+
+		if ((error = ext2fs_get_next_inode(scan, &i_num, &inode))) {
+			errstr(_("Something weird happened while scanning. Error %d\n"), (int)error);
+			return -1;
+		}
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Prepare checkpointing of the scan of given filesystem. Checkpoint is
+ * stored to the file given by user or next to the first quota file we check.
+ */
+static void setup_checkpoint(struct mount_entry *mnt)
+{
+	char *qfname, *slash;
+	struct stat st;
+
+	if (ckpt_file)
+		ckpt_name = sstrdup(ckpt_file);
+	else {
+		if (get_qf_name(mnt, ucheck ? USRQUOTA : GRPQUOTA, cfmt, 0, &qfname) < 0) {
+			errstr(_("Cannot get quotafile name for %s. Checkpointing disabled.\n"), mnt->me_devname);
+			return;
+		}
+		slash = strrchr(qfname, '/');
+		if (slash)
+			*slash = 0;
+		ckpt_name = smalloc(strlen(qfname) + strlen(CKPT_NAME) + 2);
+		sprintf(ckpt_name, "%s/%s", slash ? qfname : ".", CKPT_NAME);
+		free(qfname);
+	}
+	/* Find the directory with the checkpoint so that the scan can skip the file */
+	qfname = sstrdup(ckpt_name);
+	slash = strrchr(qfname, '/');
+	if (slash == qfname)
+		slash[1] = 0;	/* Checkpoint in the root directory */
+	else if (slash)
+		*slash = 0;
+	if (stat(slash ? qfname : ".", &st) < 0) {
+		ckpt_dir_dev = 0;
+		ckpt_dir_ino = 0;
+	}
+	else {
+		ckpt_dir_dev = st.st_dev;
+		ckpt_dir_ino = st.st_ino;
+	}
+	free(qfname);
+	ckpt_mntdir = mnt->me_dir;
+	ckpt_next = time(NULL) + ckpt_interval;
+	debug(FL_DEBUG, _("Using checkpoint file %s\n"), ckpt_name);
+}
+
+/* Fill in filesystem state and scan parameters into checkpoint header */
+static int get_ckpt_header(struct ckpt_header *h)
+{
+	struct statfs sfs;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, CKPT_MAGIC, sizeof(h->magic));
+	if (statfs(ckpt_mntdir, &sfs) < 0) {
+		errstr(_("Cannot statfs() %s: %s\n"), ckpt_mntdir, strerror(errno));
+		return -1;
+	}
+	h->dev = cur_dev;
+	h->blocks = sfs.f_blocks;
+	h->bfree = sfs.f_bfree;
+	h->files = sfs.f_files;
+	h->ffree = sfs.f_ffree;
+	h->bfree_valid = ckpt_dir_dev != cur_dev;
+	h->ucheck = ucheck;
+	h->gcheck = gcheck;
+	h->fmt = cfmt;
+	h->max_ino = cur_max_ino;
+	return 0;
+}
+
+/* Write usage and hardlinks of one quota type to checkpoint */
+static void write_ckpt_type(FILE *f, int type)
+{
+	struct dquot_table *dt = dquot_tables + type;
+	struct links_table *lt = links_tables + type;
+	struct ckpt_dquot cd;
+	u_int64_t cnt = 0, val;
+	uint i;
+
+	for (i = 0; dt->slots && i < (1U << dt->bits); i++)
+		if (dt->slots[i] && (dt->slots[i]->dq_dqb.dqb_curinodes || dt->slots[i]->dq_dqb.dqb_curspace))
+			cnt++;
+	fwrite(&cnt, sizeof(cnt), 1, f);
+	memset(&cd, 0, sizeof(cd));
+	for (i = 0; dt->slots && i < (1U << dt->bits); i++) {
+		struct dquot *d = dt->slots[i];
+
+		if (!d || (!d->dq_dqb.dqb_curinodes && !d->dq_dqb.dqb_curspace))
+			continue;
+		cd.id = d->dq_id;
+		cd.curinodes = d->dq_dqb.dqb_curinodes;
+		cd.curspace = d->dq_dqb.dqb_curspace;
+		fwrite(&cd, sizeof(cd), 1, f);
+	}
+
+	val = lt->have_zero;
+	fwrite(&val, sizeof(val), 1, f);
+	val = lt->bitmap ? lt->bitmap_inodes : 0;
+	fwrite(&val, sizeof(val), 1, f);
+	if (lt->bitmap)
+		fwrite(lt->bitmap, 1, (lt->bitmap_inodes + 7) >> 3, f);
+	val = lt->used;
+	fwrite(&val, sizeof(val), 1, f);
+	for (i = 0; lt->slots && i < (1U << lt->bits); i++)
+		if (lt->slots[i]) {
+			val = lt->slots[i];
+			fwrite(&val, sizeof(val), 1, f);
+		}
+}
+
+/*
+ * Save the state of the scan - usage gathered so far, counted hardlinks and
+ * directories still to scan. The scan can be resumed from this state if the
+ * filesystem does not change in the mean time.
+ */
+static void write_checkpoint(void)
+{
+	struct ckpt_header h;
+	struct stat st;
+	struct dirs *dir;
+	char tmpname[PATH_MAX];
+	u_int64_t cnt;
+	u_int32_t len;
+	FILE *f;
+	int type;
+
+	if (get_ckpt_header(&h) < 0)
+		return;
+	/* Creating the checkpoint consumes an inode on the checked filesystem */
+	if (!h.bfree_valid && stat(ckpt_name, &st) < 0)
+		h.ffree--;
+	h.files_done = files_done;
+	h.dirs_done = dirs_done;
+	h.bytes_done = bytes_done;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", ckpt_name);
+	if (!(f = fopen(tmpname, "w"))) {
+		errstr(_("Cannot create checkpoint file %s: %s. Checkpointing disabled.\n"),
+		       tmpname, strerror(errno));
+		ckpt_interval = 0;
+		return;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	for (type = 0; type < MAXQUOTAS; type++)
+		if ((type == USRQUOTA && ucheck) || (type == GRPQUOTA && gcheck))
+			write_ckpt_type(f, type);
+	for (cnt = 0, dir = dir_stack; dir; dir = dir->next)
+		cnt++;
+	fwrite(&cnt, sizeof(cnt), 1, f);
+	for (dir = dir_stack; dir; dir = dir->next) {
+		len = strlen(dir->dir_name);
+		fwrite(&len, sizeof(len), 1, f);
+		fwrite(dir->dir_name, 1, len, f);
+	}
+	if (ferror(f) || fflush(f) || fsync(fileno(f)) < 0) {
+		errstr(_("Cannot write checkpoint file %s: %s. Checkpointing disabled.\n"),
+		       tmpname, strerror(errno));
+		fclose(f);
+		unlink(tmpname);
+		ckpt_interval = 0;
+		return;
+	}
+	fclose(f);
+	if (rename(tmpname, ckpt_name) < 0) {
+		errstr(_("Cannot rename checkpoint file %s to %s: %s. Checkpointing disabled.\n"),
+		       tmpname, ckpt_name, strerror(errno));
+		unlink(tmpname);
+		ckpt_interval = 0;
+		return;
+	}
+	debug(FL_DEBUG, _("Checkpoint written to %s (%d directories and %d files done).\n"),
+	      ckpt_name, dirs_done, files_done);
+}
+
+static void read_ckpt(void *buf, size_t size, FILE *f)
+{
+	if (fread(buf, 1, size, f) != size)
+		die(2, _("Checkpoint file %s is truncated. Please remove it.\n"), ckpt_name);
+}
+
+/* Load usage and hardlinks of one quota type from checkpoint */
+static void read_ckpt_type(FILE *f, int type, ino_t max_ino)
+{
+	struct links_table *lt = links_tables + type;
+	struct ckpt_dquot cd;
+	struct dquot *d;
+	u_int64_t cnt, val, bitmap_inodes;
+	char *bitmap;
+
+	for (read_ckpt(&cnt, sizeof(cnt), f); cnt; cnt--) {
+		read_ckpt(&cd, sizeof(cd), f);
+		if ((d = lookup_scan_dquot(cd.id, type)) == NODQUOT)
+			d = add_scan_dquot(cd.id, type);
+		d->dq_dqb.dqb_curinodes = cd.curinodes;
+		d->dq_dqb.dqb_curspace = cd.curspace;
+	}
+
+	read_ckpt(&val, sizeof(val), f);
+	lt->have_zero = val;
+	read_ckpt(&bitmap_inodes, sizeof(bitmap_inodes), f);
+	if (bitmap_inodes) {
+		bitmap = xmalloc((bitmap_inodes + 7) >> 3);
+		read_ckpt(bitmap, (bitmap_inodes + 7) >> 3, f);
+		if (bitmap_inodes == max_ino) {
+			lt->bitmap = bitmap;
+			lt->bitmap_inodes = bitmap_inodes;
+		}
+		else {
+			for (val = 0; val < bitmap_inodes; val++)
+				if (bitmap[val >> 3] & (1 << (val & 7)))
+					store_dlinks(type, val);
+#ifdef DEBUG_MALLOC
+			free_mem += (bitmap_inodes + 7) >> 3;
+#endif
+			free(bitmap);
+		}
+	}
+	for (read_ckpt(&cnt, sizeof(cnt), f); cnt; cnt--) {
+		read_ckpt(&val, sizeof(val), f);
+		store_dlinks(type, val);
+	}
+}
+
+/*
+ * Load checkpoint of an interrupted scan. Return 1 when the scan can be
+ * resumed from the checkpoint, 0 when it has to start from the beginning.
+ */
+static int load_checkpoint(void)
+{
+	struct ckpt_header h, cur;
+	struct dirs *dir, **tail = &dir_stack;
+	u_int64_t cnt;
+	u_int32_t len;
+	FILE *f;
+	int type;
+
+	if (!(f = fopen(ckpt_name, "r"))) {
+		if (errno != ENOENT)
+			errstr(_("Cannot open checkpoint file %s: %s\n"), ckpt_name, strerror(errno));
+		else
+			debug(FL_DEBUG | FL_VERBOSE, _("No checkpoint found. Scanning from the beginning.\n"));
+		return 0;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, CKPT_MAGIC, sizeof(h.magic))) {
+		errstr(_("Checkpoint file %s is corrupted. Scanning from the beginning.\n"), ckpt_name);
+		fclose(f);
+		return 0;
+	}
+	if (get_ckpt_header(&cur) < 0) {
+		fclose(f);
+		return 0;
+	}
+	if (h.dev != cur.dev || h.ucheck != cur.ucheck || h.gcheck != cur.gcheck || h.fmt != cur.fmt ||
+	    h.blocks != cur.blocks || h.files != cur.files || h.ffree != cur.ffree ||
+	    (h.bfree_valid && cur.bfree_valid && h.bfree != cur.bfree)) {
+		errstr(_("Filesystem %s changed since checkpoint %s was written. Scanning from the beginning.\n"),
+		       ckpt_mntdir, ckpt_name);
+		fclose(f);
+		return 0;
+	}
+	for (type = 0; type < MAXQUOTAS; type++)
+		if ((type == USRQUOTA && ucheck) || (type == GRPQUOTA && gcheck))
+			read_ckpt_type(f, type, cur.max_ino);
+	for (read_ckpt(&cnt, sizeof(cnt), f); cnt; cnt--) {
+		read_ckpt(&len, sizeof(len), f);
+		dir = xmalloc(sizeof(struct dirs));
+		dir->dir_name = xmalloc(len + 1);
+		read_ckpt(dir->dir_name, len, f);
+		*tail = dir;
+		tail = &dir->next;
+		dirs_queued++;
+	}
+	fclose(f);
+	files_done = h.files_done;
+	dirs_done = h.dirs_done;
+	bytes_done = h.bytes_done;
+	debug(FL_DEBUG | FL_VERBOSE, _("Resuming scan from checkpoint %s (%d directories and %d files done).\n"),
+	      ckpt_name, dirs_done, files_done);
+	return 1;
+}
+
+/* Remove checkpoint of finished scan */
+static void remove_checkpoint(void)
+{
+	char tmpname[PATH_MAX];
 
-	if ((error = ext2fs_open(device, 0, 0, 0, unix_io_manager, &fs))) {
-		errstr(_("error (%d) while opening %s\n"), (int)error, device);
-		return -1;
-	}
+	if (unlink(ckpt_name) < 0 && errno != ENOENT)
+		errstr(_("Cannot remove checkpoint file %s: %s\n"), ckpt_name, strerror(errno));
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", ckpt_name);
+	unlink(tmpname);
+}
 
-	if ((error = ext2fs_allocate_inode_bitmap(fs, "in-use inode map", &inode_used_map))) {
-		errstr(_("error (%d) while allocating file inode bitmap\n"), (int)error);
-		return -1;
-	}
+/* Push directory to the stack of directories to scan */
+static void push_dir(const char *dir, const char *name)
+{
+	struct dirs *new_dir = xmalloc(sizeof(struct dirs));
 
-	if ((error = ext2fs_allocate_inode_bitmap(fs, "directory inode map", &inode_dir_map))) {
-		errstr(_("errstr (%d) while allocating directory inode bitmap\n"), (int)error);
-		return -1;
+	if (name) {
+		new_dir->dir_name = xmalloc(strlen(dir) + strlen(name) + 2);
+		sprintf(new_dir->dir_name, "%s/%s", dir, name);
 	}
-
-	if ((error = ext2fs_open_inode_scan(fs, inode_buffer_blocks, &scan))) {
-		errstr(_("error (%d) while opening inode scan\n"), (int)error);
-		return -1;
+	else {
+		new_dir->dir_name = xmalloc(strlen(dir) + 1);
+		strcpy(new_dir->dir_name, dir);
 	}
+	new_dir->next = dir_stack;
+	dir_stack = new_dir;
+	dirs_queued++;
+}
 
-	if ((error = ext2fs_get_next_inode(scan, &i_num, &inode))) {
-		errstr(_("error (%d) while starting inode scan\n"), (int)error);
-		return -1;
-	}
+static void free_dir(struct dirs *dir)
+{
+#ifdef DEBUG_MALLOC
+	free_mem += sizeof(struct dirs) + strlen(dir->dir_name) + 1;
+#endif
+	free(dir->dir_name);
+	free(dir);
+}
 
-	while (i_num) {
-		if ((i_num == EXT2_ROOT_INO ||
-		     i_num >= EXT2_FIRST_INO(fs->super)) &&
-		    inode.i_links_count) {
-			debug(FL_DEBUG, _("Found i_num %ld, blocks %ld\n"), (long)i_num, (long)inode.i_blocks);
-			if (flags & FL_VERBOSE)
-				blit(NULL);
-			uid = inode.i_uid | (inode.i_uid_high << 16);
-			gid = inode.i_gid | (inode.i_gid_high << 16);
-			if (inode.i_uid_high | inode.i_gid_high)
-				debug(FL_DEBUG, _("High uid detected.\n"));
-			if (ucheck)
-				add_to_quota(USRQUOTA, i_num, uid, gid,
-					     inode.i_mode, inode.i_links_count,
-					     ((loff_t)inode.i_blocks) << 9, 0);
-			if (gcheck)
-				add_to_quota(GRPQUOTA, i_num, uid, gid,
-					     inode.i_mode, inode.i_links_count,
-					     ((loff_t)inode.i_blocks) << 9, 0);
-			if (S_ISDIR(inode.i_mode))
-				dirs_done++;
-			else
-				files_done++;
-		}
+static void free_dir_stack(void)
+{
+	struct dirs *dir;
 
-		if ((error = ext2fs_get_next_inode(scan, &i_num, &inode))) {
-			errstr(_("Something weird happened while scanning. Error %d\n"), (int)error);
-			return -1;
-		}
+	while ((dir = dir_stack)) {
+		dir_stack = dir->next;
+		free_dir(dir);
 	}
-	return 0;
+	dirs_queued = 0;
 }
-#endif
 
 /*
  * Scan a directory with the readdir systemcall. Stat the files and add the sizes
- * of the files to the appropriate quotas. When we find a dir we recursivly call
- * ourself to scan that dir.
+ * of the files to the appropriate quotas. Found subdirectories are pushed to
+ * the directory stack.
  */
-static int scan_dir(const char *pathname)
+static int scan_one_dir(const char *pathname)
 {
-	struct dirs *dir_stack = NULL;
-	struct dirs *new_dir;
 	struct dirent *de;
 	struct stat st;
 	loff_t qspace;
 	DIR *dp;
-	int ret;
+	int skip_ckpt;
 
 	if (lstat(pathname, &st) == -1) {
 		errstr(_("Cannot stat directory %s: %s\n"), pathname, strerror(errno));
-		goto out;
+		return -1;
 	}
+	skip_ckpt = ckpt_name && st.st_dev == ckpt_dir_dev && st.st_ino == ckpt_dir_ino;
 	qspace = getqsize(pathname, &st);
+	bytes_done += qspace;
 	if (ucheck)
 		add_to_quota(USRQUOTA, st.st_ino, st.st_uid, st.st_gid, st.st_mode,
 			     st.st_nlink, qspace, 0);
@@ -521,13 +1579,17 @@ static int scan_dir(const char *pathname)
 	while ((de = readdir(dp)) != (struct dirent *)NULL) {
 		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
 			continue;
+		/* Our own checkpoint files must not be accounted */
+		if (skip_ckpt && (!strcmp(de->d_name, CKPT_NAME) || !strcmp(de->d_name, CKPT_NAME ".tmp")))
+			continue;
 		if (flags & FL_VERBOSE)
 			blit(NULL);
 
 		if ((lstat(de->d_name, &st)) == -1) {
 			errstr(_("lstat: Cannot stat `%s/%s': %s\nGuess you'd better run fsck first !\nexiting...\n"),
 				pathname, de->d_name, strerror(errno));
-			goto out;
+			closedir(dp);
+			return -1;
 		}
 
 		if (S_ISDIR(st.st_mode)) {
@@ -537,12 +1599,7 @@ static int scan_dir(const char *pathname)
 			 * Add this to the directory stack and check this later on.
 			 */
 			debug(FL_DEBUG, _("pushd %s/%s\n"), pathname, de->d_name);
-			new_dir = xmalloc(sizeof(struct dirs));
-
-			new_dir->dir_name = xmalloc(strlen(pathname) + strlen(de->d_name) + 2);
-			sprintf(new_dir->dir_name, "%s/%s", pathname, de->d_name);
-			new_dir->next = dir_stack;
-			dir_stack = new_dir;
+			push_dir(pathname, de->d_name);
 		}
 		else {
 			qspace = getqsize(de->d_name, &st);
@@ -555,40 +1612,52 @@ static int scan_dir(const char *pathname)
 			debug(FL_DEBUG, _("\tAdding %s size %lld ino %d links %d uid %u gid %u\n"), de->d_name,
 			      (long long)st.st_size, (int)st.st_ino, (int)st.st_nlink, (int)st.st_uid, (int)st.st_gid);
 			files_done++;
+			bytes_done += qspace;
 		}
+		progress_tick();
 	}
 	closedir(dp);
+	if (dir_report)
+		flush_dir_usage(pathname);
+	return 0;
+}
+
+/*
+ * Scan the whole directory tree. Directories are scanned in depth-first
+ * order using the directory stack. When resuming from a checkpoint, the
+ * stack is already filled and the root is not scanned again.
+ */
+static int scan_dir(const char *pathname, int resumed)
+{
+	struct dirs *dir;
+	time_t now;
 
+	if (!resumed && scan_one_dir(pathname) < 0)
+		goto out;
 	/*
 	 * Traverse the directory stack, and check it.
 	 */
 	debug(FL_DEBUG, _("Scanning stored directories from directory stack\n"));
-	while (dir_stack != (struct dirs *)NULL) {
-		new_dir = dir_stack;
-		dir_stack = dir_stack->next;
-		debug(FL_DEBUG, _("popd %s\nEntering directory %s\n"), new_dir->dir_name,
-		      new_dir->dir_name);
-		ret = scan_dir(new_dir->dir_name);
-		dirs_done++;
-#ifdef DEBUG_MALLOC
-		free_mem += sizeof(struct dirs) + strlen(new_dir->dir_name) + 1;
-#endif
-		free(new_dir->dir_name);
-		free(new_dir);
-		if (ret < 0)	/* Error while scanning? */
+	while ((dir = dir_stack) != (struct dirs *)NULL) {
+		dir_stack = dir->next;
+		dirs_queued--;
+		debug(FL_DEBUG, _("popd %s\nEntering directory %s\n"), dir->dir_name,
+		      dir->dir_name);
+		if (scan_one_dir(dir->dir_name) < 0) {
+			free_dir(dir);
 			goto out;
+		}
+		dirs_done++;
+		debug(FL_DEBUG, _("Leaving %s\n"), dir->dir_name);
+		free_dir(dir);
+		if (ckpt_interval && (now = time(NULL)) >= ckpt_next) {
+			write_checkpoint();
+			ckpt_next = now + ckpt_interval;
+		}
 	}
-	debug(FL_DEBUG, _("Leaving %s\n"), pathname);
 	return 0;
-      out:
-	for (new_dir = dir_stack; new_dir; new_dir = dir_stack) {
-		dir_stack = dir_stack->next;
-#ifdef DEBUG_MALLOC
-		free_mem += sizeof(struct dirs) + strlen(new_dir->dir_name) + 1;
-#endif
-		free(new_dir->dir_name);
-		free(new_dir);
-	}
+out:
+	free_dir_stack();
 	return -1;
 }
 
@@ -612,11 +1681,11 @@ int ask_yn(char *q, int def)
 	}
 }
 
-/* Do checks and buffer quota file into memory */
-static int process_file(struct mount_entry *mnt, int type)
+/* Do checks and open quota file so that it can be buffered into memory */
+static int open_quota_file(struct mount_entry *mnt, int type, struct qf_load *ql)
 {
 	char *qfname = NULL;
-	int fd = -1, ret;
+	int fd = -1;
 
 	debug(FL_DEBUG, _("Going to check %s quota file of %s\n"), _(type2name(type)),
 	      mnt->me_dir);
@@ -641,6 +1710,7 @@ Please turn quotas off or use -f to force checking.\n"),
 			die(4, _("Error while syncing quotas on %s: %s\n"), mnt->me_devname, strerror(errno));
 	}
 
+	ql->newfile = 0;
 	if (!(flags & FL_NEWFILE)) {	/* Need to buffer file? */
 		if (get_qf_name(mnt, type, cfmt, 0, &qfname) < 0) {
 			errstr(_("Cannot get quotafile name for %s\n"), mnt->me_devname);
@@ -654,22 +1724,77 @@ Please turn quotas off or use -f to force checking.\n"),
 				return -1;
 			}
 			/* When file was not found, just skip it */
-			flags |= FL_NEWFILE;
+			ql->newfile = 1;
 			free(qfname);
 			qfname = NULL;
 		}
 	}
 
-	ret = 0;
 	memset(old_info + type, 0, sizeof(old_info[type]));
+	ql->type = type;
+	ql->qfname = qfname;
+	ql->fd = fd;
+	ql->ret = 0;
+	return 0;
+}
+
+/* Buffer opened quota file into memory */
+static void load_quota_file(struct qf_load *ql)
+{
+	if (ql->fd < 0) {
+		/* Nothing to load, just set default grace times */
+		old_info[ql->type].dqi_bgrace = MAX_DQ_TIME;
+		old_info[ql->type].dqi_igrace = MAX_IQ_TIME;
+		ql->ret = 0;
+		return;
+	}
 	if (is_tree_qfmt(cfmt))
-		ret = v2_buffer_file(qfname, fd, type, cfmt);
+		ql->ret = v2_buffer_file(ql->qfname, ql->fd, ql->type, cfmt);
 	else
-		ret = v1_buffer_file(qfname, fd, type);
+		ql->ret = v1_buffer_file(ql->qfname, ql->fd, ql->type);
+	free(ql->qfname);
+	close(ql->fd);
+}
 
-	if (!(flags & FL_NEWFILE)) {
-		free(qfname);
-		close(fd);
+/*
+ * Buffer all opened quota files. This runs in a separate thread while the
+ * filesystem is scanned. Loaded structures go to file_tables which the scan
+ * does not touch so no locking is needed.
+ */
+static void *load_quota_files(void *arg)
+{
+	struct qf_load *qfl = arg;
+	double start = get_time();
+	int type;
+
+	for (type = 0; type < MAXQUOTAS; type++)
+		if (qfl[type].type >= 0)
+			load_quota_file(qfl + type);
+	phase_time[PHASE_LOAD] = get_time() - start;
+	return NULL;
+}
+
+/*
+ * Process results of loading of quota files. Returns -1 when some file
+ * could not be read and the check has to be aborted.
+ */
+static int end_load(struct qf_load *qfl)
+{
+	int type, ret = 0;
+
+	for (type = 0; type < MAXQUOTAS; type++) {
+		if (qfl[type].type < 0)
+			continue;
+		if (qfl[type].newfile)
+			flags |= FL_NEWFILE;
+		if (qfl[type].ret == BUFFER_ERROR)
+			ret = -1;
+		else if (qfl[type].ret < 0) {
+			if (type == USRQUOTA)
+				ucheck = 0;
+			else
+				gcheck = 0;
+		}
 	}
 	return ret;
 }
@@ -787,6 +1912,8 @@ static int dump_to_file(struct mount_entry *mnt, int type)
 	uint i;
 	struct quota_handle *h;
 	unsigned int commit = 0;
+	double start;
+	int ret;
 
 	debug(FL_DEBUG, _("Dumping gathered data for %ss.\n"), _(type2name(type)));
 	if (cfmt == QF_XFS) {
@@ -809,20 +1936,21 @@ static int dump_to_file(struct mount_entry *mnt, int type)
 			mark_quotafile_info_dirty(h);
 		}
 	}
-	for (i = 0; i < DQUOTHASHSIZE; i++)
-		for (dquot = dquot_hash[type][i]; dquot; dquot = dquot->dq_next) {
-			dquot->dq_h = h;
-			/* For XFS/GFS2, we don't bother with actually checking
-			 * what the usage value is in the internal quota file.
-			 * We simply attempt to update the usage for every quota
-			 * we find in the fs scan. The filesystem decides in the
-			 * quotactl handler whether to update the usage in the 
-			 * quota file or not.
-			 */
-			commit = cfmt == QF_XFS ? COMMIT_USAGE : COMMIT_ALL;
-			update_grace_times(dquot);
-			h->qh_ops->commit_dquot(dquot, commit);
-		}
+	for (i = 0; dquot_tables[type].slots && i < (1U << dquot_tables[type].bits); i++) {
+		if (!(dquot = dquot_tables[type].slots[i]))
+			continue;
+		dquot->dq_h = h;
+		/* For XFS/GFS2, we don't bother with actually checking
+		 * what the usage value is in the internal quota file.
+		 * We simply attempt to update the usage for every quota
+		 * we find in the fs scan. The filesystem decides in the
+		 * quotactl handler whether to update the usage in the 
+		 * quota file or not.
+		 */
+		commit = cfmt == QF_XFS ? COMMIT_USAGE : COMMIT_ALL;
+		update_grace_times(dquot);
+		h->qh_ops->commit_dquot(dquot, commit);
+	}
 	if (end_io(h) < 0) {
 		errstr(_("Cannot finish IO on new quotafile: %s\n"), strerror(errno));
 		return -1;
@@ -839,10 +1967,10 @@ static int dump_to_file(struct mount_entry *mnt, int type)
 				errstr(_("Cannot turn %s quotas off on %s: %s\nKernel won't know about changes quotacheck did.\n"),
 					_(type2name(type)), mnt->me_devname, strerror(errno));
 			else {
-				int ret;
-
 				/* Rename files - if it fails we cannot do anything better than just turn on quotas again */
+				start = get_time();
 				rename_files(mnt, type);
+				phase_time[PHASE_RENAME] += get_time() - start;
 
 				if (kernel_iface == IFACE_GENERIC)
 					ret = quotactl(QCMD(Q_QUOTAON, type), mnt->me_devname, util2kernfmt(cfmt), filename);
@@ -855,9 +1983,13 @@ static int dump_to_file(struct mount_entry *mnt, int type)
 			free(filename);
 		}
 	}
-	else
-		if (rename_files(mnt, type) < 0)
-		        return -1;
+	else {
+		start = get_time();
+		ret = rename_files(mnt, type);
+		phase_time[PHASE_RENAME] += get_time() - start;
+		if (ret < 0)
+			return -1;
+	}
 	return 0;
 }
 
@@ -889,7 +2021,7 @@ static int sub_quota_file(struct mount_entry *mnt, int qtype, int ftype)
 		id = st.st_uid;
 	else
 		id = st.st_gid;
-	if ((d = lookup_dquot(id, qtype)) == NODQUOT) {
+	if ((d = lookup_scan_dquot(id, qtype)) == NODQUOT) {
 		errstr(_("Quota structure for %s owning quota file not present! Something is really wrong...\n"), _(type2name(qtype)));
 		return -1;
 	}
@@ -899,6 +2031,209 @@ static int sub_quota_file(struct mount_entry *mnt, int qtype, int ftype)
     return 0;
 }
 
+/* Remember difference in usage of one ID */
+static void record_drift(qid_t id, qsize_t rspace, qsize_t rinodes, qsize_t cspace, qsize_t cinodes)
+{
+	qsize_t dspace = cspace > rspace ? cspace - rspace : rspace - cspace;
+	int i;
+
+	drift_compared++;
+	if (rspace == cspace && rinodes == cinodes)
+		return;
+	drift_ids++;
+	if (cspace > rspace)
+		drift_space[0] += cspace - rspace;
+	else
+		drift_space[1] += rspace - cspace;
+	if (cinodes > rinodes)
+		drift_inodes[0] += cinodes - rinodes;
+	else
+		drift_inodes[1] += rinodes - cinodes;
+	/* Keep IDs with the largest space difference sorted in drift_worst */
+	for (i = drift_ids <= VERIFY_WORST ? drift_ids - 1 : VERIFY_WORST; i > 0; i--) {
+		struct drift *d = drift_worst + i - 1;
+		qsize_t prev = d->cspace > d->rspace ? d->cspace - d->rspace : d->rspace - d->cspace;
+
+		if (prev >= dspace)
+			break;
+		if (i < VERIFY_WORST)
+			drift_worst[i] = *d;
+	}
+	if (i >= VERIFY_WORST)
+		return;
+	drift_worst[i].id = id;
+	drift_worst[i].rspace = rspace;
+	drift_worst[i].rinodes = rinodes;
+	drift_worst[i].cspace = cspace;
+	drift_worst[i].cinodes = cinodes;
+}
+
+/* Compare one recorded structure with computed usage */
+static int verify_dquot(struct dquot *dquot, char *dqname)
+{
+	struct dquot *c = lookup_scan_dquot(dquot->dq_id, verify_type);
+	qsize_t cspace = 0, cinodes = 0;
+
+	if (c != NODQUOT) {
+		c->dq_flags |= DQ_FOUND;
+		cspace = c->dq_dqb.dqb_curspace;
+		cinodes = c->dq_dqb.dqb_curinodes;
+	}
+	record_drift(dquot->dq_id, dquot->dq_dqb.dqb_curspace, dquot->dq_dqb.dqb_curinodes,
+		     cspace, cinodes);
+	return 0;
+}
+
+/*
+ * Compare usage computed by the scan with usage recorded in the kernel or
+ * in the quota file and print a summary of differences.
+ */
+static int verify_usage(struct mount_entry *mnt, int type)
+{
+	struct dquot_table *t = dquot_tables + type;
+	struct quota_handle *h;
+	char name[MAXNAMELEN];
+	uint i;
+
+	debug(FL_DEBUG, _("Verifying %s usage.\n"), _(type2name(type)));
+	if (!(h = init_io(mnt, type, cfmt, IOI_READONLY | IOI_INITSCAN))) {
+		errstr(_("Cannot initialize IO on %s quotafile: %s\n"), _(type2name(type)),
+		       strerror(errno));
+		return -1;
+	}
+	verify_type = type;
+	drift_compared = drift_ids = 0;
+	drift_space[0] = drift_space[1] = drift_inodes[0] = drift_inodes[1] = 0;
+	if (h->qh_ops->scan_dquots(h, verify_dquot) < 0) {
+		errstr(_("Cannot read %s quota usage on %s: %s\n"), _(type2name(type)),
+		       mnt->me_devname, strerror(errno));
+		end_io(h);
+		return -1;
+	}
+	end_io(h);
+	/* IDs which have usage but no structure recorded */
+	for (i = 0; t->slots && i < (1U << t->bits); i++)
+		if (t->slots[i] && !(t->slots[i]->dq_flags & DQ_FOUND) &&
+		    (t->slots[i]->dq_dqb.dqb_curspace || t->slots[i]->dq_dqb.dqb_curinodes))
+			record_drift(t->slots[i]->dq_id, 0, 0, t->slots[i]->dq_dqb.dqb_curspace,
+				     t->slots[i]->dq_dqb.dqb_curinodes);
+
+	printf(_("Usage of %s quota on %s [%s]: %d IDs compared, %d IDs differ.\n"),
+	       _(type2name(type)), mnt->me_devname, mnt->me_dir, drift_compared, drift_ids);
+	if (!drift_ids)
+		return 0;
+	drift_found = 1;
+	printf(_("Space: %lld bytes more and %lld bytes less than recorded. Inodes: %lld more and %lld less than recorded.\n"),
+	       (long long)drift_space[0], (long long)drift_space[1],
+	       (long long)drift_inodes[0], (long long)drift_inodes[1]);
+	printf(_("%-20s %16s %16s %12s %12s\n"), _("Largest differences:"),
+	       _("recorded space"), _("computed space"), _("rec. inodes"), _("comp. inodes"));
+	for (i = 0; i < drift_ids && i < VERIFY_WORST; i++) {
+		id2name(drift_worst[i].id, type, name);
+		printf("%-20s %16lld %16lld %12lld %12lld\n", name,
+		       (long long)drift_worst[i].rspace, (long long)drift_worst[i].cspace,
+		       (long long)drift_worst[i].rinodes, (long long)drift_worst[i].cinodes);
+	}
+	return 0;
+}
+
+/* Compute exit status of check */
+static int exit_status(int failed)
+{
+	if (flags & FL_VERIFY) {
+		if (failed)
+			return VERIFY_EXIT_ERROR;
+		return drift_found ? VERIFY_EXIT_DRIFT : EXIT_SUCCESS;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int cmp_dir_space(const void *a, const void *b)
+{
+	const struct dir_usage *ua = a, *ub = b;
+
+	if (ua->space != ub->space)
+		return ua->space < ub->space ? 1 : -1;
+	return strcmp(ua->dir_name, ub->dir_name);
+}
+
+static int cmp_dir_inodes(const void *a, const void *b)
+{
+	const struct dir_usage *ua = a, *ub = b;
+
+	if (ua->inodes != ub->inodes)
+		return ua->inodes < ub->inodes ? 1 : -1;
+	return strcmp(ua->dir_name, ub->dir_name);
+}
+
+/* Write directories with the largest usage of each ID into the report file */
+static int write_dir_report(struct mount_entry *mnt)
+{
+	char name[MAXNAMELEN];
+	struct id_dirs *idd;
+	FILE *f;
+	uint i, j;
+	int type;
+
+	if (!(f = fopen(dir_report, "a"))) {
+		errstr(_("Cannot open directory report %s: %s\n"), dir_report, strerror(errno));
+		return -1;
+	}
+	/* Filesystems checked in parallel append to the same file */
+	flock(fileno(f), LOCK_EX);
+	fprintf(f, "# %s (%s)\n", mnt->me_dir, mnt->me_devname);
+	for (type = 0; type < MAXQUOTAS; type++) {
+		struct id_dirs_table *t = id_dirs_tables + type;
+
+		for (i = 0; t->slots && i < (1U << t->bits); i++) {
+			if (!(idd = t->slots[i]))
+				continue;
+			id2name(idd->id, type, name);
+			qsort(idd->space, idd->nspace, sizeof(struct dir_usage), cmp_dir_space);
+			for (j = 0; j < idd->nspace; j++)
+				fprintf(f, "%s\t%s\tspace\t%llu\t%llu\t%s\n", type2name(type), name,
+					(unsigned long long)idd->space[j].space,
+					(unsigned long long)idd->space[j].inodes, idd->space[j].dir_name);
+			qsort(idd->inodes, idd->ninodes, sizeof(struct dir_usage), cmp_dir_inodes);
+			for (j = 0; j < idd->ninodes; j++)
+				fprintf(f, "%s\t%s\tinodes\t%llu\t%llu\t%s\n", type2name(type), name,
+					(unsigned long long)idd->inodes[j].space,
+					(unsigned long long)idd->inodes[j].inodes, idd->inodes[j].dir_name);
+		}
+	}
+	fflush(f);
+	flock(fileno(f), LOCK_UN);
+	if (ferror(f) | fclose(f)) {
+		errstr(_("Cannot write directory report %s: %s\n"), dir_report, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Return filesystem remounted read-only for the scan back to read-write mode */
+static void remount_rw(struct mount_entry *mnt)
+{
+	if (mount(NULL, mnt->me_dir, mnt->me_type, MS_MGC_VAL | MS_REMOUNT, NULL) < 0)
+		die(4, _("Cannot remount filesystem %s read-write. cannot write new quota files.\n"), mnt->me_dir);
+	debug(FL_DEBUG, _("Filesystem remounted RW.\n"));
+}
+
+/*
+ * Is the filesystem scanned by reading its inode table? Such scan does not
+ * know directories of inodes so it is not used when directory report is wanted.
+ */
+static int direct_scan(struct mount_entry *mnt)
+{
+#if defined(EXT2_DIRECT)
+	if (dir_report)
+		return 0;
+	return !strcmp(mnt->me_type, MNTTYPE_EXT2) || !strcmp(mnt->me_type, MNTTYPE_EXT3) ||
+		!strcmp(mnt->me_type, MNTTYPE_NEXT3);
+#else
+	return 0;
+#endif
+}
+
 /* Buffer quotafile, run filesystem scan, dump quotafiles.
  * Return non-zero value in case of failure, zero otherwise. */
 static int check_dir(struct mount_entry *mnt)
@@ -906,29 +2241,59 @@ static int check_dir(struct mount_entry *mnt)
 	struct stat st;
 	int remounted = 0;
 	int failed = 0;
+	int resumed = 0;
+	int loading = 0, type;
+	struct qf_load qfl[MAXQUOTAS];
+	pthread_t loader;
+	double start;
 
 	if (lstat(mnt->me_dir, &st) < 0)
 		die(2, _("Cannot stat mountpoint %s: %s\n"), mnt->me_dir, strerror(errno));
 	if (!S_ISDIR(st.st_mode))
 		die(2, _("Mountpoint %s is not a directory?!\n"), mnt->me_dir);
+	if ((ckpt_interval || flags & FL_RESUME) && direct_scan(mnt)) {
+		errstr(_("Checkpointing is not supported for %s which is scanned directly by libext2fs.\n"),
+		       mnt->me_dir);
+		return -1;
+	}
 	cur_dev = st.st_dev;
+	setup_links_bitmap(mnt);
 	files_done = dirs_done = 0;
+	bytes_done = 0;
+	memset(phase_time, 0, sizeof(phase_time));
+	for (type = 0; type < MAXQUOTAS; type++)
+		qfl[type].type = -1;
 	/*
 	 * For gfs2, we scan the fs first and then tell the kernel about the new usage.
 	 * So, there's no need to load any information. We also don't remount the
 	 * filesystem read-only because for a clustering filesystem it won't stop
 	 * modifications from other nodes anyway.
 	 */
-	if (cfmt == QF_XFS)
+	if (cfmt == QF_XFS || flags & FL_VERIFY)
 		goto start_scan;
 	if (ucheck)
-		if (process_file(mnt, USRQUOTA) < 0)
+		if (open_quota_file(mnt, USRQUOTA, qfl + USRQUOTA) < 0)
 			ucheck = 0;
 	if (gcheck)
-		if (process_file(mnt, GRPQUOTA) < 0)
+		if (open_quota_file(mnt, GRPQUOTA, qfl + GRPQUOTA) < 0)
 			gcheck = 0;
 	if (!ucheck && !gcheck)	/* Nothing to check? */
 		return 0;
+	/*
+	 * Old files are loaded while we scan the filesystem. In interactive mode
+	 * questions about damaged files would mix with the scan so load them now.
+	 */
+	if (flags & FL_INTERACTIVE || pthread_create(&loader, NULL, load_quota_files, qfl)) {
+		load_quota_files(qfl);
+		if (end_load(qfl) < 0) {
+			failed = -1;
+			goto out;
+		}
+		if (!ucheck && !gcheck)
+			return 0;
+	}
+	else
+		loading = 1;
 	if (!(flags & FL_NOREMOUNT)) {
 		/* Now we try to remount fs read-only to prevent races when scanning filesystem */
 		if (mount
@@ -955,8 +2320,10 @@ Please stop all programs writing to filesystem or use -m flag to force checking.
 	}
 start_scan:
 	debug(FL_VERBOSE, _("Scanning %s [%s] "), mnt->me_devname, mnt->me_dir);
+	start = get_time();
 #if defined(EXT2_DIRECT)
-	if (!strcmp(mnt->me_type, MNTTYPE_EXT2) || !strcmp(mnt->me_type, MNTTYPE_EXT3) || !strcmp(mnt->me_type, MNTTYPE_NEXT3)) {
+	if (direct_scan(mnt)) {
+		start_progress(mnt);
 		if ((failed = ext2_direct_scan(mnt->me_devname)) < 0)
 			goto out;
 	}
@@ -964,14 +2331,36 @@ start_scan:
 #else
 	if (mnt->me_dir) {
 #endif
+		if (ckpt_interval || flags & FL_RESUME)
+			setup_checkpoint(mnt);
+		if (ckpt_name && flags & FL_RESUME)
+			resumed = load_checkpoint();
 		if (flags & FL_VERYVERBOSE)
 			putchar('\n');
-		if ((failed = scan_dir(mnt->me_dir)) < 0)
+		start_progress(mnt);
+		if ((failed = scan_dir(mnt->me_dir, resumed)) < 0)
 			goto out;
 	}
 	dirs_done++;
+	phase_time[PHASE_SCAN] = get_time() - start;
 	if (flags & FL_VERBOSE || flags & FL_VERYVERBOSE)
 		fputs(_("done\n"), stdout);
+	if (loading) {
+		debug(FL_DEBUG, _("Waiting for old quota files to be loaded.\n"));
+		pthread_join(loader, NULL);
+		loading = 0;
+		/* Errors of the loader are handled here so that the filesystem can be made RW again */
+		if (end_load(qfl) < 0) {
+			if (remounted)
+				remount_rw(mnt);
+			failed = -1;
+			goto out;
+		}
+	}
+	if (ucheck)
+		merge_file_dquots(USRQUOTA);
+	if (gcheck)
+		merge_file_dquots(GRPQUOTA);
 	if (ucheck) {
 		failed |= sub_quota_file(mnt, USRQUOTA, USRQUOTA);
 		failed |= sub_quota_file(mnt, USRQUOTA, GRPQUOTA);
@@ -982,17 +2371,37 @@ start_scan:
 	}
 	debug(FL_DEBUG | FL_VERBOSE, _("Checked %d directories and %d files\n"), dirs_done,
 	      files_done);
-	if (remounted) {
-		if (mount(NULL, mnt->me_dir, mnt->me_type, MS_MGC_VAL | MS_REMOUNT, NULL) < 0)
-			die(4, _("Cannot remount filesystem %s read-write. cannot write new quota files.\n"), mnt->me_dir);
-		debug(FL_DEBUG, _("Filesystem remounted RW.\n"));
+	if (remounted)
+		remount_rw(mnt);
+	/* The report may live on the checked filesystem so write it only after it is RW again */
+	if (dir_report)
+		failed |= write_dir_report(mnt);
+	if (ckpt_name)
+		remove_checkpoint();
+	start = get_time();
+	if (flags & FL_VERIFY) {
+		if (ucheck)
+			failed |= verify_usage(mnt, USRQUOTA);
+		if (gcheck)
+			failed |= verify_usage(mnt, GRPQUOTA);
+		phase_time[PHASE_VERIFY] = get_time() - start;
+		goto out;
 	}
 	if (ucheck)
 		failed |= dump_to_file(mnt, USRQUOTA);
 	if (gcheck)
 		failed |= dump_to_file(mnt, GRPQUOTA);
+	/* Renaming is reported separately */
+	phase_time[PHASE_DUMP] = get_time() - start - phase_time[PHASE_RENAME];
 out:
+	if (loading)
+		pthread_join(loader, NULL);
+	report_summary(mnt, failed);
 	remove_list();
+	if (ckpt_name) {
+		free(ckpt_name);
+		ckpt_name = NULL;
+	}
 	return failed;
 }
 
@@ -1125,6 +2534,146 @@ warn:
 		 " running quotacheck after an unclean shutdown.\n"));
 }
 
+/*
+ * Find the disk the filesystem lives on so that we can avoid checking
+ * several partitions of one disk at once. Return 0 when we don't know.
+ */
+static dev_t get_disk_dev(struct mount_entry *mnt)
+{
+	struct stat st;
+	char path[PATH_MAX];
+	unsigned int maj, min;
+	FILE *f;
+	int ret;
+
+	if (stat(mnt->me_devname, &st) < 0 || !S_ISBLK(st.st_mode))
+		return 0;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+		 major(st.st_rdev), minor(st.st_rdev));
+	if (access(path, F_OK) < 0)
+		return st.st_rdev;
+	/* Directory of a partition is a subdirectory of the disk */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+		 major(st.st_rdev), minor(st.st_rdev));
+	if (!(f = fopen(path, "r")))
+		return st.st_rdev;
+	ret = fscanf(f, "%u:%u", &maj, &min);
+	fclose(f);
+	if (ret != 2)
+		return st.st_rdev;
+	return makedev(maj, min);
+}
+
+/* Start check of a filesystem in a child process */
+static int start_job(struct check_job *job)
+{
+	if (!(job->out = tmpfile()) || !(job->err = tmpfile())) {
+		errstr(_("Cannot create temporary file: %s\n"), strerror(errno));
+		goto err;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	if (job->pid < 0) {
+		errstr(_("Cannot fork: %s\n"), strerror(errno));
+		goto err;
+	}
+	if (!job->pid) {
+		if (dup2(fileno(job->out), STDOUT_FILENO) < 0 ||
+		    dup2(fileno(job->err), STDERR_FILENO) < 0)
+			die(2, _("Cannot redirect output: %s\n"), strerror(errno));
+		ucheck = job->ucheck;
+		gcheck = job->gcheck;
+		cfmt = job->cfmt;
+		exit(exit_status(check_dir(job->mnt)));
+	}
+	debug(FL_DEBUG, _("Started check of %s [%s] as process %d\n"),
+	      job->mnt->me_devname, job->mnt->me_dir, (int)job->pid);
+	return 0;
+err:
+	if (job->out)
+		fclose(job->out);
+	if (job->err)
+		fclose(job->err);
+	job->out = job->err = NULL;
+	job->pid = -1;
+	return -1;
+}
+
+/* Copy buffered output of a finished check */
+static void flush_job_output(FILE *from, FILE *to)
+{
+	char buf[BUFSIZ];
+	size_t len;
+
+	rewind(from);
+	while ((len = fread(buf, 1, sizeof(buf), from)) > 0)
+		fwrite(buf, 1, len, to);
+	fflush(to);
+	fclose(from);
+}
+
+/* Wait for one check to finish. Return non-zero if the check failed. */
+static int wait_job(struct check_job *jobs_list, int njobs)
+{
+	pid_t pid;
+	int status, i;
+
+	while ((pid = wait(&status)) < 0)
+		if (errno != EINTR)
+			die(2, _("Cannot wait for checking process: %s\n"), strerror(errno));
+	for (i = 0; i < njobs && jobs_list[i].pid != pid; i++);
+	if (i == njobs)
+		return 0;
+	jobs_list[i].pid = -1;
+	flush_job_output(jobs_list[i].out, stdout);
+	flush_job_output(jobs_list[i].err, stderr);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+		return 0;
+	if (flags & FL_VERIFY && WIFEXITED(status) && WEXITSTATUS(status) == VERIFY_EXIT_DRIFT) {
+		drift_found = 1;
+		return 0;
+	}
+	if (WIFSIGNALED(status))
+		errstr(_("Check of %s [%s] killed by signal %d.\n"), jobs_list[i].mnt->me_devname,
+		       jobs_list[i].mnt->me_dir, WTERMSIG(status));
+	return -1;
+}
+
+/*
+ * Check all filesystems in the list with at most 'jobs' checks running at
+ * once. Output of each check is printed when the check finishes.
+ */
+static int run_jobs(struct check_job *jobs_list, int njobs)
+{
+	int running = 0, started = 0, failed = 0;
+	int i, j;
+
+	while (started < njobs || running) {
+		for (i = 0; i < njobs && running < jobs; i++) {
+			if (jobs_list[i].pid)
+				continue;
+			if (flags & FL_DISKGROUPS && jobs_list[i].disk) {
+				for (j = 0; j < njobs; j++)
+					if (jobs_list[j].pid > 0 && jobs_list[j].disk == jobs_list[i].disk)
+						break;
+				if (j < njobs)
+					continue;
+			}
+			started++;
+			if (start_job(jobs_list + i) < 0)
+				failed = -1;
+			else
+				running++;
+		}
+		if (!running)
+			continue;
+		failed |= wait_job(jobs_list, njobs);
+		running--;
+	}
+	return failed;
+}
+
 /* Return 0 in case of success, non-zero otherwise. */
 static int check_all(void)
 {
@@ -1132,6 +2681,8 @@ static int check_all(void)
 	int checked = 0;
 	static int warned;
 	int failed = 0;
+	struct check_job *jobs_list = NULL;
+	int njobs = 0;
 
 	if (init_mounts_scan((flags & FL_ALL) ? 0 : 1, &mntpoint, 0) < 0)
 		die(2, _("Cannot initialize mountpoint scan.\n"));
@@ -1178,7 +2729,23 @@ static int check_all(void)
 		}
 
 		checked++;
-		failed |= check_dir(mnt);
+		if (jobs > 1) {
+			jobs_list = srealloc(jobs_list, sizeof(struct check_job) * (njobs + 1));
+			memset(jobs_list + njobs, 0, sizeof(struct check_job));
+			jobs_list[njobs].mnt = mnt;
+			jobs_list[njobs].ucheck = ucheck;
+			jobs_list[njobs].gcheck = gcheck;
+			jobs_list[njobs].cfmt = cfmt;
+			if (flags & FL_DISKGROUPS)
+				jobs_list[njobs].disk = get_disk_dev(mnt);
+			njobs++;
+		}
+		else
+			failed |= check_dir(mnt);
+	}
+	if (njobs) {
+		failed |= run_jobs(jobs_list, njobs);
+		free(jobs_list);
 	}
 	end_mounts_scan();
 	if (!checked && (!(flags & FL_ALL) || flags & (FL_VERBOSE | FL_DEBUG))) {
@@ -1197,11 +2764,18 @@ int main(int argc, char **argv)
 
 	parse_options(argc, argv);
 	init_kernel_interface();
+	if (dir_report) {
+		FILE *f = fopen(dir_report, "w");
+
+		if (!f)
+			die(1, _("Cannot create directory report %s: %s\n"), dir_report, strerror(errno));
+		fclose(f);
+	}
 
 	failed = check_all();
 #ifdef DEBUG_MALLOC
 	errstr(_("Allocated %d bytes memory\nFree'd %d bytes\nLost %d bytes\n"),
 		malloc_mem, free_mem, malloc_mem - free_mem);
 #endif
-	return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+	return exit_status(failed);
 }
@@ -26,6 +26,12 @@
 #define FL_NOROOT 512		/* Scan all mountpoints except root */
 #define FL_BACKUPS 1024		/* Create backup of old quota file? */
 #define FL_VERYVERBOSE 2048	/* Print directory names when checking */
+#define FL_DISKGROUPS 4096	/* Don't check filesystems on the same disk in parallel */
+#define FL_RESUME 8192		/* Resume scan from checkpoint if possible */
+#define FL_VERIFY 16384		/* Only compare computed usage with the recorded one */
+
+/* Returned by v?_buffer_file() when the file cannot be read and the check has to be aborted */
+#define BUFFER_ERROR -2
 
 extern int flags;		/* Options from command line */
 extern struct util_dqinfo old_info[MAXQUOTAS];	/* Loaded info from file */
@@ -18,7 +18,7 @@
 #include "quotacheck.h"
 
 /* Load all other dquot structures */
-static void load_dquots(char *filename, int fd, int type)
+static int load_dquots(char *filename, int fd, int type)
 {
 	struct v1_disk_dqblk ddqblk;
 	struct util_dqblk *udq;
@@ -28,9 +28,11 @@ static void load_dquots(char *filename, int fd, int type)
 
 	lseek(fd, 0, SEEK_SET);
 	while ((err = read(fd, &ddqblk, sizeof(ddqblk)))) {
-		if (err < 0)
-			die(1, _("Cannot read entry for id %u from quotafile %s: %s\n"), (uint) id,
-			    filename, strerror(errno));
+		if (err < 0) {
+			errstr(_("Cannot read entry for id %u from quotafile %s: %s\n"), (uint) id,
+			       filename, strerror(errno));
+			return BUFFER_ERROR;
+		}
 		if (err != sizeof(ddqblk)) {
 			errstr(_("Entry for id %u is truncated.\n"),
 				(uint) id);
@@ -53,6 +55,7 @@ static void load_dquots(char *filename, int fd, int type)
 		udq->dqb_itime = ddqblk.dqb_itime;
 		id++;
 	}
+	return 0;
 }
 
 /* Load first structure - get grace times */
@@ -64,9 +67,11 @@ static int check_info(char *filename, int fd, int type)
 	debug(FL_DEBUG, _("Loading first quota entry with grace times.\n"));
 	lseek(fd, 0, SEEK_SET);
 	err = read(fd, &ddqblk, sizeof(ddqblk));
-	if (err < 0)
-		die(1, _("Cannot read first entry from quotafile %s: %s\n"), filename,
-		    strerror(errno));
+	if (err < 0) {
+		errstr(_("Cannot read first entry from quotafile %s: %s\n"), filename,
+		       strerror(errno));
+		return BUFFER_ERROR;
+	}
 	if (err != sizeof(ddqblk)) {
 		errstr(
 			_("WARNING - Quotafile %s was probably truncated. Cannot save quota settings...\n"),
@@ -81,12 +86,14 @@ static int check_info(char *filename, int fd, int type)
 
 int v1_buffer_file(char *filename, int fd, int type)
 {
+	int ret;
+
 	old_info[type].dqi_bgrace = MAX_DQ_TIME;
 	old_info[type].dqi_igrace = MAX_IQ_TIME;
 	if (flags & FL_NEWFILE)
 		return 0;
-	if (check_info(filename, fd, type) < 0)
-		return 0;
-	load_dquots(filename, fd, type);
-	return 0;
+	/* Damaged file just means default grace times */
+	if ((ret = check_info(filename, fd, type)) < 0)
+		return ret == BUFFER_ERROR ? BUFFER_ERROR : 0;
+	return load_dquots(filename, fd, type);
 }
@@ -22,17 +22,21 @@
 #include "quotacheck.h"
 #include "quota_tree.h"
 
-#define getdqbuf() smalloc(QT_BLKSIZE)
-#define freedqbuf(buf) free(buf)
+#define getdqbuf(blk) (filebuf + ((size_t)(blk) << QT_BLKSIZE_BITS))
 
 #define SET_BLK(blk) (blkbmp[(blk) >> 3] |= 1 << ((blk) & 7))
 #define GET_BLK(blk) (blkbmp[(blk) >> 3] & (1 << ((blk) & 7)))
+#define SET_FREE(blk) (freebmp[(blk) >> 3] |= 1 << ((blk) & 7))
+#define GET_FREE(blk) (freebmp[(blk) >> 3] & (1 << ((blk) & 7)))
 
 typedef char *dqbuf_t;
 
 static const int magics[MAXQUOTAS] = INITQMAGICS;	/* Magics we should look for */
 static const int known_versions[MAXQUOTAS] = INIT_V2_VERSIONS;	/* Versions we accept */
 static char *blkbmp;		/* Bitmap of checked blocks */
+static char *freebmp;		/* Bitmap of blocks in free lists */
+static char *filebuf;		/* Contents of the quota file */
+static uint free_blk, free_entry;	/* Heads of free lists (0 if info is corrupted) */
 static int detected_versions[MAXQUOTAS];
 
 static int check_blkref(uint blk, uint blocks)
@@ -84,12 +88,15 @@ static int check_info(char *filename, int fd, int type)
 		old_info[type].u.v2_mdqi.dqi_flags = 0;
 		printf(_("Setting grace times and other flags to default values.\nAssuming number of blocks is %u.\n"),
 		       old_info[type].u.v2_mdqi.dqi_qtree.dqi_blocks);
+		free_blk = free_entry = 0;
 	}
 	else {
 		old_info[type].dqi_bgrace = __le32_to_cpu(dinfo.dqi_bgrace);
 		old_info[type].dqi_igrace = __le32_to_cpu(dinfo.dqi_igrace);
 		old_info[type].u.v2_mdqi.dqi_qtree.dqi_blocks = blocks;
 		old_info[type].u.v2_mdqi.dqi_flags = dflags;
+		free_blk = freeblk;
+		free_entry = freeent;
 	}
 	if (detected_versions[type] == 0)
 		old_info[type].u.v2_mdqi.dqi_qtree.dqi_entry_size = sizeof(struct v2r0_disk_dqblk);
@@ -231,18 +238,35 @@ static int buffer_entry(dqbuf_t buf, uint blk, int *corrupted, uint * lblk, int
 	return 0;
 }
 
-static void check_read_blk(int fd, uint blk, dqbuf_t buf)
+/* Read whole quota file into memory */
+static int read_quota_file(char *filename, int fd, uint blocks)
 {
-	size_t rd;
-
-	lseek(fd, blk << QT_BLKSIZE_BITS, SEEK_SET);
-	rd = read(fd, buf, QT_BLKSIZE);
-	if (rd < 0)
-		die(2, _("Cannot read block %u: %s\n"), blk, strerror(errno));
-	if (rd != QT_BLKSIZE) {
-		debug(FL_VERBOSE | FL_DEBUG, _("Block %u is truncated.\n"), blk);
-		memset(buf + rd, 0, QT_BLKSIZE - rd);
+	size_t size = (size_t)blocks << QT_BLKSIZE_BITS, done = 0;
+	ssize_t rd;
+
+	filebuf = xmalloc(size);
+	while (done < size) {
+		rd = pread(fd, filebuf + done, size - done, done);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			errstr(_("Cannot read quota file %s: %s\n"), filename, strerror(errno));
+#ifdef DEBUG_MALLOC
+			free_mem += size;
+#endif
+			free(filebuf);
+			return BUFFER_ERROR;
+		}
+		if (!rd)
+			break;
+		done += rd;
 	}
+	if (done != size) {
+		debug(FL_VERBOSE | FL_DEBUG, _("Block %u is truncated.\n"),
+		      (uint)(done >> QT_BLKSIZE_BITS));
+		memset(filebuf + done, 0, size - done);
+	}
+	return 0;
 }
 
 static int check_tree_ref(uint blk, uint ref, uint blocks, int check_use, int * corrupted,
@@ -261,16 +285,15 @@ static int check_tree_ref(uint blk, uint ref, uint blocks, int check_use, int *
 }
 
 /* Check block with structures */
-static int check_data_blk(int fd, uint blk, int type, uint blocks, int * corrupted, uint * lblk)
+static int check_data_blk(uint blk, int type, uint blocks, int * corrupted, uint * lblk)
 {
-	dqbuf_t buf = getdqbuf();
+	dqbuf_t buf = getdqbuf(blk);
 	struct qt_disk_dqdbheader *head = (struct qt_disk_dqdbheader *)buf;
 	int i;
 	char *dd = (char *)(head + 1);
 	struct qtree_mem_dqinfo *info = &old_info[type].u.v2_mdqi.dqi_qtree;
 
 	SET_BLK(blk);
-	check_read_blk(fd, blk, buf);
 	if (check_blkref(__le32_to_cpu(head->dqdh_next_free), blocks) < 0)
 		blk_corrupted(corrupted, lblk, blk, _("Illegal free block reference to block %u"),
 			      __le32_to_cpu(head->dqdh_next_free));
@@ -279,42 +302,101 @@ static int check_data_blk(int fd, uint blk, int type, uint blocks, int * corrupt
 			      (uint) __le16_to_cpu(head->dqdh_entries));
 	for (i = 0; i < qtree_dqstr_in_blk(info); i++)
 		if (!qtree_entry_unused(info, dd + i * info->dqi_entry_size))
-			if (buffer_entry(buf, blk, corrupted, lblk, i, type) < 0) {
-				freedqbuf(buf);
+			if (buffer_entry(buf, blk, corrupted, lblk, i, type) < 0)
 				return -1;
-			}
-	freedqbuf(buf);
 	return 0;
 }
 
 /* Check one tree block */
-static int check_tree_blk(int fd, uint blk, int depth, int type, uint blocks, int * corrupted,
+static int check_tree_blk(uint blk, int depth, int type, uint blocks, int * corrupted,
 			  uint * lblk)
 {
-	dqbuf_t buf = getdqbuf();
-	u_int32_t *r = (u_int32_t *) buf;
+	u_int32_t *r = (u_int32_t *) getdqbuf(blk);
 	int i;
 
 	SET_BLK(blk);
-	check_read_blk(fd, blk, buf);
 	for (i = 0; i < QT_BLKSIZE >> 2; i++)
 		if (depth < QT_TREEDEPTH - 1) {
 			if (check_tree_ref(blk, __le32_to_cpu(r[i]), blocks, 1, corrupted, lblk) >= 0 &&
 			    __le32_to_cpu(r[i]))	/* Isn't block OK? */
-				if (check_tree_blk(fd, __le32_to_cpu(r[i]), depth + 1, type, blocks, corrupted, lblk) < 0) {
-					freedqbuf(buf);
+				if (check_tree_blk(__le32_to_cpu(r[i]), depth + 1, type, blocks, corrupted, lblk) < 0)
 					return -1;
-				}
 		}
 		else if (check_tree_ref(blk, __le32_to_cpu(r[i]), blocks, 0, corrupted, lblk) >= 0 && __le32_to_cpu(r[i]))
-			if (!GET_BLK(__le32_to_cpu(r[i])) && check_data_blk(fd, __le32_to_cpu(r[i]), type, blocks, corrupted, lblk) < 0) {
-				freedqbuf(buf);
+			if (!GET_BLK(__le32_to_cpu(r[i])) && check_data_blk(__le32_to_cpu(r[i]), type, blocks, corrupted, lblk) < 0)
 				return -1;
-			}
-	freedqbuf(buf);
 	return 0;
 }
 
+/*
+ * Check that free lists are consistent with the tree. The new quota file gets
+ * fresh free lists so damage here is only reported.
+ */
+static void check_free_lists(char *filename, int type, uint blocks)
+{
+	struct qtree_mem_dqinfo *info = &old_info[type].u.v2_mdqi.dqi_qtree;
+	struct qt_disk_dqdbheader *head;
+	uint blk, prev, unused = 0;
+	int damaged = 0;
+
+	freebmp = xmalloc((blocks + 7) >> 3);
+	memset(freebmp, 0, (blocks + 7) >> 3);
+	for (blk = free_blk; blk; blk = __le32_to_cpu(head->dqdh_next_free)) {
+		if (check_blkref(blk, blocks) < 0) {
+			debug(FL_VERBOSE | FL_DEBUG, _("Reference to illegal block %u in list of free blocks.\n"), blk);
+			damaged = 1;
+			break;
+		}
+		if (GET_FREE(blk)) {
+			debug(FL_VERBOSE | FL_DEBUG, _("Block %u is in list of free blocks twice.\n"), blk);
+			damaged = 1;
+			break;
+		}
+		if (GET_BLK(blk)) {
+			debug(FL_VERBOSE | FL_DEBUG, _("Block %u in list of free blocks is used.\n"), blk);
+			damaged = 1;
+		}
+		SET_FREE(blk);
+		head = (struct qt_disk_dqdbheader *)getdqbuf(blk);
+	}
+	prev = 0;
+	for (blk = free_entry; blk; blk = __le32_to_cpu(head->dqdh_next_free)) {
+		if (check_blkref(blk, blocks) < 0) {
+			debug(FL_VERBOSE | FL_DEBUG, _("Reference to illegal block %u in list of blocks with free entries.\n"), blk);
+			damaged = 1;
+			break;
+		}
+		if (GET_FREE(blk)) {
+			debug(FL_VERBOSE | FL_DEBUG, _("Block %u is in free lists twice.\n"), blk);
+			damaged = 1;
+			break;
+		}
+		head = (struct qt_disk_dqdbheader *)getdqbuf(blk);
+		if (!GET_BLK(blk) || __le16_to_cpu(head->dqdh_entries) >= qtree_dqstr_in_blk(info)) {
+			debug(FL_VERBOSE | FL_DEBUG, _("Block %u in list of blocks with free entries has no free entry.\n"), blk);
+			damaged = 1;
+		}
+		if (__le32_to_cpu(head->dqdh_prev_free) != prev) {
+			debug(FL_VERBOSE | FL_DEBUG, _("Block %u has wrong reference to previous block with free entries.\n"), blk);
+			damaged = 1;
+		}
+		SET_FREE(blk);
+		prev = blk;
+	}
+	for (blk = QT_TREEOFF; blk < blocks; blk++)
+		if (!GET_BLK(blk) && !GET_FREE(blk))
+			unused++;
+	if (unused)
+		debug(FL_VERBOSE | FL_DEBUG, _("%u blocks are neither used nor free.\n"), unused);
+	if (damaged)
+		errstr(_("WARNING - Lists of free blocks in quota file %s are corrupted. They will be rebuilt.\n"),
+			filename);
+#ifdef DEBUG_MALLOC
+	free_mem += (blocks + 7) >> 3;
+#endif
+	free(freebmp);
+}
+
 int v2_detect_version(char *filename, int fd, int type)
 {
 	struct v2_disk_dqheader head;
@@ -346,8 +428,10 @@ static int check_header(char *filename, int fd, int type, int version)
 	debug(FL_DEBUG, _("Checking quotafile headers...\n"));
 	lseek(fd, 0, SEEK_SET);
 	err = read(fd, &head, sizeof(head));
-	if (err < 0)
-		die(1, _("Cannot read header from quotafile %s: %s\n"), filename, strerror(errno));
+	if (err < 0) {
+		errstr(_("Cannot read header from quotafile %s: %s\n"), filename, strerror(errno));
+		return BUFFER_ERROR;
+	}
 	if (err != sizeof(head)) {
 		errstr(_("WARNING -  Quotafile %s was probably truncated. Cannot save quota settings...\n"),
 			filename);
@@ -384,30 +468,39 @@ int v2_buffer_file(char *filename, int fd, int type, int fmt)
 		version = 0;
 	else if (fmt == QF_VFSV1)
 		version = 1;
-	else
-		die(3, _("Do not know how to buffer format %d\n"), fmt);
+	else {
+		errstr(_("Do not know how to buffer format %d\n"), fmt);
+		return BUFFER_ERROR;
+	}
 
 	old_info[type].dqi_bgrace = MAX_DQ_TIME;
 	old_info[type].dqi_igrace = MAX_IQ_TIME;
 	if (flags & FL_NEWFILE)
 		return 0;
-	if (check_header(filename, fd, type, version) < 0)
-		return -1;
+	if ((ret = check_header(filename, fd, type, version)) < 0)
+		return ret;
 	if (check_info(filename, fd, type) < 0)
 		return -1;
 	debug(FL_DEBUG, _("Headers of file %s checked. Going to load data...\n"),
 	      filename);
 	blocks = old_info[type].u.v2_mdqi.dqi_qtree.dqi_blocks;
+	/* Read the file sequentially and check it in memory to avoid seeking */
+	if (read_quota_file(filename, fd, blocks) < 0)
+		return BUFFER_ERROR;
 	blkbmp = xmalloc((blocks + 7) >> 3);
 	memset(blkbmp, 0, (blocks + 7) >> 3);
-	if (check_tree_ref(0, QT_TREEOFF, blocks, 1, &corrupted, &lastblk) >= 0)
-		ret = check_tree_blk(fd, QT_TREEOFF, 0, type, blocks, &corrupted, &lastblk);
+	if (check_tree_ref(0, QT_TREEOFF, blocks, 1, &corrupted, &lastblk) >= 0) {
+		ret = check_tree_blk(QT_TREEOFF, 0, type, blocks, &corrupted, &lastblk);
+		if (ret >= 0)
+			check_free_lists(filename, type, blocks);
+	}
 	else
 		errstr(_("Cannot gather quota data. Tree root node corrupted.\n"));
 #ifdef DEBUG_MALLOC
-	free_mem += (blocks + 7) >> 3;
+	free_mem += ((blocks + 7) >> 3) + ((size_t)blocks << QT_BLKSIZE_BITS);
 #endif
 	free(blkbmp);
+	free(filebuf);
 	if (corrupted) {
 		if (!(flags & (FL_VERBOSE | FL_DEBUG)))
 			fputc('\n', stderr);
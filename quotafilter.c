@@ -0,0 +1,255 @@
+/*
+ *
+ *	Compilation and evaluation of filters of dquots
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "pot.h"
+#include "common.h"
+#include "quotafilter.h"
+
+#define QFC_ID 0		/* Id in range */
+#define QFC_OVERSOFT 1		/* Usage exceeds softlimit */
+#define QFC_OVERHARD 2		/* Usage exceeds hardlimit */
+#define QFC_GRACE 3		/* Grace period expired */
+#define QFC_SPACE 4		/* Space usage compared with a number */
+#define QFC_INODES 5		/* Inode usage compared with a number */
+
+#define QFO_LT 0
+#define QFO_LE 1
+#define QFO_GT 2
+#define QFO_GE 3
+#define QFO_EQ 4
+
+struct qf_cond {
+	int what;
+	int op;
+	int negate;
+	int last;		/* Last condition of an alternative */
+	qsize_t lo, hi;		/* Range of ids or compared number */
+};
+
+struct quota_filter {
+	int count;
+	struct qf_cond *cond;
+};
+
+static const char *skip_space(const char *p)
+{
+	while (isspace(*p))
+		p++;
+	return p;
+}
+
+/* Parse number with optional size suffix */
+static const char *parse_num(const char *p, qsize_t *num, int size)
+{
+	char *end;
+	unsigned long long val;
+
+	if (!isdigit(*p))
+		return NULL;
+	val = strtoull(p, &end, 10);
+	if (size) {
+		switch (*end) {
+			case 'T': case 't':
+				val <<= 10;
+				/* Fall through */
+			case 'G': case 'g':
+				val <<= 10;
+				/* Fall through */
+			case 'M': case 'm':
+				val <<= 10;
+				/* Fall through */
+			case 'K': case 'k':
+				val <<= 10;
+				end++;
+		}
+	}
+	*num = val;
+	return end;
+}
+
+static const char *parse_op(const char *p, int *op)
+{
+	if (p[0] == '<' && p[1] == '=') {
+		*op = QFO_LE;
+		return p + 2;
+	}
+	if (p[0] == '>' && p[1] == '=') {
+		*op = QFO_GE;
+		return p + 2;
+	}
+	if (*p == '<')
+		*op = QFO_LT;
+	else if (*p == '>')
+		*op = QFO_GT;
+	else if (*p == '=')
+		*op = QFO_EQ;
+	else
+		return NULL;
+	return p + 1;
+}
+
+static int keyword(const char **p, const char *word)
+{
+	int len = strlen(word);
+
+	if (strncmp(*p, word, len) || isalnum((*p)[len]) || (*p)[len] == '-')
+		return 0;
+	*p += len;
+	return 1;
+}
+
+static const char *parse_cond(const char *p, struct qf_cond *c)
+{
+	memset(c, 0, sizeof(*c));
+	p = skip_space(p);
+	if (*p == '!') {
+		c->negate = 1;
+		p = skip_space(p + 1);
+	}
+	if (keyword(&p, "over-soft"))
+		c->what = QFC_OVERSOFT;
+	else if (keyword(&p, "over-hard"))
+		c->what = QFC_OVERHARD;
+	else if (keyword(&p, "grace-expired"))
+		c->what = QFC_GRACE;
+	else if (keyword(&p, "id")) {
+		c->what = QFC_ID;
+		p = skip_space(p);
+		if (*p++ != '=')
+			return NULL;
+		if (!(p = parse_num(skip_space(p), &c->lo, 0)))
+			return NULL;
+		c->hi = c->lo;
+		p = skip_space(p);
+		if (*p == '-') {
+			if (!(p = parse_num(skip_space(p + 1), &c->hi, 0)) || c->hi < c->lo)
+				return NULL;
+		}
+	}
+	else {
+		if (keyword(&p, "space"))
+			c->what = QFC_SPACE;
+		else if (keyword(&p, "inodes"))
+			c->what = QFC_INODES;
+		else
+			return NULL;
+		if (!(p = parse_op(skip_space(p), &c->op)))
+			return NULL;
+		if (!(p = parse_num(skip_space(p), &c->lo, c->what == QFC_SPACE)))
+			return NULL;
+	}
+	return skip_space(p);
+}
+
+struct quota_filter *compile_quota_filter(const char *expr)
+{
+	struct quota_filter *filter = smalloc(sizeof(struct quota_filter));
+	const char *p = expr;
+	int alloc = 0;
+
+	filter->count = 0;
+	filter->cond = NULL;
+	while (1) {
+		const char *start = skip_space(p);
+
+		if (filter->count == alloc) {
+			alloc = alloc ? alloc * 2 : 8;
+			filter->cond = srealloc(filter->cond, alloc * sizeof(struct qf_cond));
+		}
+		if (!(p = parse_cond(start, filter->cond + filter->count))) {
+			errstr(_("Bad filter condition at '%s'.\n"), start);
+			free_quota_filter(filter);
+			return NULL;
+		}
+		filter->count++;
+		if (*p == ',') {
+			p++;
+			continue;
+		}
+		filter->cond[filter->count - 1].last = 1;
+		if (*p == '|') {
+			p++;
+			continue;
+		}
+		if (*p) {
+			errstr(_("Bad filter condition at '%s'.\n"), p);
+			free_quota_filter(filter);
+			return NULL;
+		}
+		break;
+	}
+	return filter;
+}
+
+static int compare(qsize_t val, int op, qsize_t num)
+{
+	switch (op) {
+		case QFO_LT:
+			return val < num;
+		case QFO_LE:
+			return val <= num;
+		case QFO_GT:
+			return val > num;
+		case QFO_GE:
+			return val >= num;
+	}
+	return val == num;
+}
+
+static int cond_match(struct qf_cond *c, struct util_dqblk *d, qid_t id, time_t now)
+{
+	qsize_t space = toqb(d->dqb_curspace);
+
+	switch (c->what) {
+		case QFC_ID:
+			return id >= c->lo && id <= c->hi;
+		/* Limits are exceeded only above them, as the kernel and repquota flags see it */
+		case QFC_OVERSOFT:
+			return (d->dqb_bsoftlimit && space > d->dqb_bsoftlimit) ||
+				(d->dqb_isoftlimit && d->dqb_curinodes > d->dqb_isoftlimit);
+		case QFC_OVERHARD:
+			return (d->dqb_bhardlimit && space > d->dqb_bhardlimit) ||
+				(d->dqb_ihardlimit && d->dqb_curinodes > d->dqb_ihardlimit);
+		case QFC_GRACE:
+			return (d->dqb_bsoftlimit && space > d->dqb_bsoftlimit &&
+				d->dqb_btime && d->dqb_btime <= now) ||
+				(d->dqb_isoftlimit && d->dqb_curinodes > d->dqb_isoftlimit &&
+				d->dqb_itime && d->dqb_itime <= now);
+		case QFC_SPACE:
+			return compare(d->dqb_curspace, c->op, c->lo);
+	}
+	return compare(d->dqb_curinodes, c->op, c->lo);
+}
+
+int quota_filter_match(struct quota_filter *filter, struct dquot *dquot, time_t now)
+{
+	int i, match = 1;
+
+	for (i = 0; i < filter->count; i++) {
+		/* Skip rest of the alternative once it has failed */
+		if (match && cond_match(filter->cond + i, &dquot->dq_dqb, dquot->dq_id, now) == filter->cond[i].negate)
+			match = 0;
+		if (filter->cond[i].last) {
+			if (match)
+				return 1;
+			match = 1;
+		}
+	}
+	return 0;
+}
+
+void free_quota_filter(struct quota_filter *filter)
+{
+	free(filter->cond);
+	free(filter);
+}
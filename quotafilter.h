@@ -0,0 +1,32 @@
+#ifndef GUARD_QUOTAFILTER_H
+#define GUARD_QUOTAFILTER_H
+
+#include <time.h>
+
+#include "quotaio.h"
+
+/*
+ * Filter selecting dquots to process. The expression consists of
+ * alternatives separated by '|'. Each alternative is a list of conditions
+ * separated by ',' which all have to hold:
+ *
+ *   id=N, id=N-M      id equals N or is in range N to M
+ *   over-soft         space or inode usage exceeds the softlimit
+ *   over-hard         space or inode usage exceeds the hardlimit
+ *   grace-expired     grace period of space or inodes has expired
+ *   space OP SIZE     space usage compared with SIZE (suffixes K, M, G, T)
+ *   inodes OP N       inode usage compared with N
+ *
+ * OP is one of <, <=, >, >=, =. A condition is negated by '!' in front of it.
+ */
+struct quota_filter;
+
+/* Compile filter expression, print error and return NULL when it is invalid */
+struct quota_filter *compile_quota_filter(const char *expr);
+
+/* Does dquot match the filter? now is used for checking of grace times. */
+int quota_filter_match(struct quota_filter *filter, struct dquot *dquot, time_t now);
+
+void free_quota_filter(struct quota_filter *filter);
+
+#endif /* GUARD_QUOTAFILTER_H */
@@ -250,6 +250,28 @@ out_fd:
 	return NULL;
 }
 
+/*
+ *	Create another handle for the same quotafile. The file is opened again
+ *	so that the handle has its own file position. It is protected by the
+ *	lock of the original handle.
+ */
+struct quota_handle *clone_io(struct quota_handle *h)
+{
+	struct quota_handle *c = smalloc(sizeof(struct quota_handle));
+	char fdname[64];
+
+	memcpy(c, h, sizeof(struct quota_handle));
+	if (h->qh_fd != -1) {
+		snprintf(fdname, sizeof(fdname), "/proc/self/fd/%d", h->qh_fd);
+		if ((c->qh_fd = open(fdname, QIO_RO(h) ? O_RDONLY : O_RDWR)) < 0) {
+			errstr(_("Cannot reopen quotafile for %s: %s\n"), h->qh_quotadev, strerror(errno));
+			free(c);
+			return NULL;
+		}
+	}
+	return c;
+}
+
 /*
  *	Close quotafile and release handle
  */
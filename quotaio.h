@@ -173,6 +173,9 @@ struct quota_handle *init_io(struct mount_entry *mnt, int type, int fmt, int fla
 /* Create new quotafile of specified format on given filesystem */
 struct quota_handle *new_io(struct mount_entry *mnt, int type, int fmt);
 
+/* Create another handle for quotafile of given handle */
+struct quota_handle *clone_io(struct quota_handle *h);
+
 /* Close quotafile */
 int end_io(struct quota_handle *h);
 
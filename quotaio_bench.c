@@ -0,0 +1,385 @@
+/*
+ *
+ *	Benchmark and self-test of quota file IO
+ *
+ *	Creates quota files with IDs of different distributions on plain
+ *	files (no mounted filesystem or privileges are needed), measures
+ *	speed of insertion, lookup, scanning, update and deletion of
+ *	structures and verifies that the file contains what was written.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pot.h"
+#include "common.h"
+#include "quotaio.h"
+#include "quotasys.h"
+
+#define V1_MAX_ID (1 << 20)	/* Old format stores structures in an array indexed by ID */
+
+/* Distributions of IDs */
+enum { DIST_DENSE, DIST_SPARSE, DIST_CLUSTERED, DIST_RANDOM, DISTS };
+static const char *dist_names[DISTS] = { "dense", "sparse", "clustered", "random" };
+
+char *progname;
+
+static int nids = 10000;		/* Number of IDs in a file */
+static int lookups = 100000;		/* Number of lookups to measure */
+static char *tmpdir = "/tmp";		/* Where to create quota files */
+static unsigned long long seed = 1;	/* Seed of the generator */
+static int formats[] = { QF_VFSOLD, QF_VFSV0, QF_VFSV1, -1 };
+static int want_fmt = -1;		/* Benchmark only this format (-1 = all) */
+static int want_dist = -1;		/* Benchmark only this distribution (-1 = all) */
+static int failed;			/* Did some verification fail? */
+
+static qid_t *ids;			/* IDs stored in the file */
+static int scanned;			/* Number of structures found by scan */
+
+static void usage(void)
+{
+	errstr(_("Benchmark of quota file IO.\n\
+Usage: %s [options]\n\n\
+-n, --ids=n            number of IDs in each file (default 10000)\n\
+-l, --lookups=n        number of lookups to measure (default 100000)\n\
+-F, --format=name      measure only given quota format\n\
+-D, --distribution=d   measure only given distribution of IDs\n\
+                       (dense, sparse, clustered, random)\n\
+-t, --tmpdir=dir       directory to create quota files in (default /tmp)\n\
+-s, --seed=n           seed of the generator (default 1)\n\n\
+Results are printed as lines 'format distribution metric value unit'.\n"), progname);
+	exit(1);
+}
+
+/* xorshift64* - fast and reproducible across platforms */
+static unsigned long long rnd(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ULL;
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int get_num(const char *arg)
+{
+	char *end;
+	long val = strtol(arg, &end, 10);
+
+	if (*end || val < 1 || val > (1 << 30)) {
+		errstr(_("Bad number: %s\n"), arg);
+		usage();
+	}
+	return val;
+}
+
+static void parse_options(int argc, char **argv)
+{
+	struct option long_opts[] = {
+		{ "ids", 1, NULL, 'n' },
+		{ "lookups", 1, NULL, 'l' },
+		{ "format", 1, NULL, 'F' },
+		{ "distribution", 1, NULL, 'D' },
+		{ "tmpdir", 1, NULL, 't' },
+		{ "seed", 1, NULL, 's' },
+		{ "help", 0, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int ret;
+
+	while ((ret = getopt_long(argc, argv, "n:l:F:D:t:s:h", long_opts, NULL)) != -1) {
+		switch (ret) {
+			case 'n':
+				nids = get_num(optarg);
+				break;
+			case 'l':
+				lookups = get_num(optarg);
+				break;
+			case 'F':
+				if ((want_fmt = name2fmt(optarg)) == QF_ERROR)
+					exit(1);
+				break;
+			case 'D':
+				for (want_dist = 0; want_dist < DISTS && strcmp(dist_names[want_dist], optarg); want_dist++);
+				if (want_dist == DISTS) {
+					errstr(_("Unknown distribution %s.\n"), optarg);
+					usage();
+				}
+				break;
+			case 't':
+				tmpdir = optarg;
+				break;
+			case 's':
+				seed = get_num(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+}
+
+/*
+ * Generate nids distinct IDs of given distribution. Random IDs use
+ * multiplication by an odd constant which is a bijection on 32-bit numbers.
+ */
+static qid_t gen_ids(int dist)
+{
+	qid_t max = 0;
+	uint off = rnd();
+	int i;
+
+	for (i = 0; i < nids; i++) {
+		switch (dist) {
+			/* ID 0 is avoided as the old format keeps grace times in it */
+			case DIST_DENSE:
+				ids[i] = i + 1;
+				break;
+			case DIST_SPARSE:
+				ids[i] = i * 100 + 1 + rnd() % 99;
+				break;
+			case DIST_CLUSTERED:
+				/* Clusters of 64 consecutive IDs spread over 32-bit space */
+				ids[i] = (((i / 64) * 0x9e3779b9U + off) & ~63U) + i % 64;
+				break;
+			default:
+				ids[i] = (i + off) * 0x9e3779b1U;
+				/* Avoid -1 which is not a valid ID */
+				if (ids[i] == (qid_t)-1)
+					ids[i] = 0x7fffffff;
+				break;
+		}
+		if (ids[i] > max)
+			max = ids[i];
+	}
+	/* Shuffle IDs so that inserts and lookups happen in random order */
+	for (i = nids - 1; i > 0; i--) {
+		int j = rnd() % (i + 1);
+		qid_t tmp = ids[i];
+
+		ids[i] = ids[j];
+		ids[j] = tmp;
+	}
+	return max;
+}
+
+/* Usage we store for an ID - values fit into all formats */
+static void fill_dquot(struct dquot *dquot, int gen)
+{
+	dquot->dq_dqb.dqb_curinodes = (dquot->dq_id & 0xffff) + gen + 1;
+	dquot->dq_dqb.dqb_curspace = ((qsize_t)(dquot->dq_id & 0xffff) + gen + 1) << 10;
+	dquot->dq_dqb.dqb_bsoftlimit = 1000 + gen;
+	dquot->dq_dqb.dqb_bhardlimit = 2000 + gen;
+}
+
+static int check_dquot(struct dquot *dquot, int gen)
+{
+	return dquot->dq_dqb.dqb_curinodes == (dquot->dq_id & 0xffff) + gen + 1 &&
+	       dquot->dq_dqb.dqb_curspace == ((qsize_t)(dquot->dq_id & 0xffff) + gen + 1) << 10 &&
+	       dquot->dq_dqb.dqb_bsoftlimit == 1000 + gen &&
+	       dquot->dq_dqb.dqb_bhardlimit == 2000 + gen;
+}
+
+/* Open quota file without a mounted filesystem */
+static struct quota_handle *open_file(const char *name, int fmt, int create)
+{
+	struct quota_handle *h = smalloc(sizeof(struct quota_handle));
+
+	memset(h, 0, sizeof(struct quota_handle));
+	if ((h->qh_fd = open(name, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), S_IRUSR | S_IWUSR)) < 0)
+		die(1, _("Cannot open %s: %s\n"), name, strerror(errno));
+	h->qh_type = USRQUOTA;
+	h->qh_fmt = fmt;
+	sstrncpy(h->qh_quotadev, name, sizeof(h->qh_quotadev));
+	sstrncpy(h->qh_dir, tmpdir, sizeof(h->qh_dir));
+	h->qh_ops = fmt == QF_VFSOLD ? &quotafile_ops_1 : &quotafile_ops_2;
+	if (create) {
+		if (h->qh_ops->new_io(h) < 0)
+			die(1, _("Cannot initialize %s: %s\n"), name, strerror(errno));
+	}
+	else if (h->qh_ops->init_io(h) < 0)
+		die(1, _("Cannot initialize %s: %s\n"), name, strerror(errno));
+	return h;
+}
+
+static void close_file(struct quota_handle *h)
+{
+	mark_quotafile_info_dirty(h);
+	if (end_io(h) < 0)
+		die(1, _("Cannot finish IO on %s: %s\n"), h->qh_quotadev, strerror(errno));
+}
+
+static void result(int fmt, int dist, const char *metric, double value, const char *unit)
+{
+	printf("%s %s %s %.0f %s\n", fmt2name(fmt), dist_names[dist], metric, value, unit);
+}
+
+static void verify(int fmt, int dist, const char *what, int ok)
+{
+	if (!ok) {
+		errstr(_("Verification of %s failed for format %s and distribution %s.\n"),
+		       what, fmt2name(fmt), dist_names[dist]);
+		failed = 1;
+	}
+}
+
+static int count_dquot(struct dquot *dquot, char *name)
+{
+	/* Grace times of the old format appear as a structure for ID 0 */
+	if (dquot->dq_id)
+		scanned++;
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+static void bench(int fmt, int dist)
+{
+	char name[PATH_MAX];
+	struct quota_handle *h;
+	struct dquot *dquot;
+	struct stat st;
+	double start, t, *lat;
+	int i, ok;
+
+	if (gen_ids(dist) >= V1_MAX_ID && fmt == QF_VFSOLD) {
+		printf("%s %s skipped - IDs too large\n", fmt2name(fmt), dist_names[dist]);
+		return;
+	}
+	snprintf(name, sizeof(name), "%s/quotaio_bench.%d", tmpdir, (int)getpid());
+
+	/* Insertion of new structures */
+	h = open_file(name, fmt, 1);
+	start = get_time();
+	for (i = 0; i < nids; i++) {
+		dquot = get_empty_dquot();
+		dquot->dq_id = ids[i];
+		dquot->dq_h = h;
+		fill_dquot(dquot, 0);
+		if (h->qh_ops->commit_dquot(dquot, COMMIT_ALL) < 0)
+			die(1, _("Cannot write structure for id %u: %s\n"), ids[i], strerror(errno));
+		free(dquot);
+	}
+	result(fmt, dist, "insert", nids / (get_time() - start), "ops/s");
+	close_file(h);
+	if (stat(name, &st) < 0)
+		die(1, _("Cannot stat %s: %s\n"), name, strerror(errno));
+	result(fmt, dist, "size", st.st_size, "bytes");
+
+	/* Lookups of random existing IDs */
+	h = open_file(name, fmt, 0);
+	lat = smalloc(sizeof(double) * lookups);
+	ok = 1;
+	start = get_time();
+	for (i = 0; i < lookups; i++) {
+		t = get_time();
+		dquot = h->qh_ops->read_dquot(h, ids[rnd() % nids]);
+		lat[i] = get_time() - t;
+		if (!dquot)
+			die(1, _("Cannot read structure: %s\n"), strerror(errno));
+		ok &= check_dquot(dquot, 0);
+		free(dquot);
+	}
+	t = get_time() - start;
+	verify(fmt, dist, "lookups", ok);
+	qsort(lat, lookups, sizeof(double), cmp_double);
+	result(fmt, dist, "lookup_avg", t / lookups * 1e9, "ns");
+	result(fmt, dist, "lookup_p99", lat[(int)(lookups * 0.99)] * 1e9, "ns");
+	free(lat);
+
+	/* Full scan */
+	scanned = 0;
+	start = get_time();
+	if (h->qh_ops->scan_dquots(h, count_dquot) < 0)
+		die(1, _("Cannot scan %s: %s\n"), name, strerror(errno));
+	result(fmt, dist, "scan", scanned / (get_time() - start), "dquots/s");
+	verify(fmt, dist, "scan", scanned == nids);
+
+	/* Update of existing structures */
+	start = get_time();
+	for (i = 0; i < nids; i++) {
+		dquot = h->qh_ops->read_dquot(h, ids[i]);
+		fill_dquot(dquot, 1);
+		if (h->qh_ops->commit_dquot(dquot, COMMIT_ALL) < 0)
+			die(1, _("Cannot write structure for id %u: %s\n"), ids[i], strerror(errno));
+		free(dquot);
+	}
+	result(fmt, dist, "update", nids / (get_time() - start), "ops/s");
+
+	/* Deletion of half of structures */
+	start = get_time();
+	for (i = 0; i < nids / 2; i++) {
+		dquot = h->qh_ops->read_dquot(h, ids[i]);
+		memset(&dquot->dq_dqb, 0, sizeof(dquot->dq_dqb) - sizeof(dquot->dq_dqb.u));
+		if (h->qh_ops->commit_dquot(dquot, COMMIT_ALL) < 0)
+			die(1, _("Cannot delete structure for id %u: %s\n"), ids[i], strerror(errno));
+		free(dquot);
+	}
+	result(fmt, dist, "delete", (nids / 2) / (get_time() - start), "ops/s");
+	close_file(h);
+
+	/* Check the file after all changes */
+	h = open_file(name, fmt, 0);
+	ok = 1;
+	for (i = 0; i < nids; i++) {
+		dquot = h->qh_ops->read_dquot(h, ids[i]);
+		if (i < nids / 2)
+			ok &= !dquot->dq_dqb.dqb_curinodes && !dquot->dq_dqb.dqb_bhardlimit;
+		else
+			ok &= check_dquot(dquot, 1);
+		free(dquot);
+	}
+	verify(fmt, dist, "updates", ok);
+	scanned = 0;
+	h->qh_ops->scan_dquots(h, count_dquot);
+	verify(fmt, dist, "deletes", scanned == nids - nids / 2);
+	close_file(h);
+	if (stat(name, &st) < 0)
+		die(1, _("Cannot stat %s: %s\n"), name, strerror(errno));
+	result(fmt, dist, "size_after_delete", st.st_size, "bytes");
+	unlink(name);
+}
+
+int main(int argc, char **argv)
+{
+	int f, dist;
+
+	gettexton();
+	progname = basename(argv[0]);
+	parse_options(argc, argv);
+
+	ids = smalloc(sizeof(qid_t) * nids);
+	for (f = 0; formats[f] >= 0; f++) {
+		if (want_fmt >= 0 && formats[f] != want_fmt)
+			continue;
+		for (dist = 0; dist < DISTS; dist++)
+			if (want_dist < 0 || dist == want_dist)
+				bench(formats[f], dist);
+	}
+	free(ids);
+	return failed;
+}
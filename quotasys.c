@@ -23,6 +23,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "pot.h"
 #include "bylabel.h"
@@ -143,37 +147,435 @@ int name2id(char *name, int qtype, int flag, int *err)
 }
 
 /*
- *	Convert uid to name
+ *	Cache of id -> name translations
+ *
+ *	Found translations are cached in memory for QUOTA_NAMECACHE_TTL seconds,
+ *	ids without a name for at most NAMECACHE_MISS_TTL seconds.
+ *	When QUOTA_NAMECACHE environment variable names a file, the whole
+ *	passwd and group databases are dumped into it and later lookups (also
+ *	from other processes) are answered from the mapped file until it is
+ *	older than QUOTA_NAMECACHE_TTL seconds. The file is used only when it
+ *	is owned by root or by us and nobody else can write it.
  */
-int uid2user(uid_t id, char *buf)
+
+#define NAMECACHE_MAGIC 0x514e4331	/* "QNC1" */
+#define NAMECACHE_VERSION 1
+#define NAMECACHE_TTL 600	/* Default validity of the cache file in seconds */
+#define NAMECACHE_MISS_TTL 60	/* Validity of remembered missing name in seconds */
+
+/* Header of the cache file; sorted arrays of entries for each type and names follow */
+struct namecache_header {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int64_t created;		/* Time the databases were dumped */
+	u_int32_t entries[MAXQUOTAS];	/* Number of entries of each type */
+	u_int32_t namesize;		/* Size of the name area */
+};
+
+struct namecache_entry {
+	u_int32_t id;
+	u_int32_t name;		/* Offset of the name in the name area */
+};
+
+/* Translation cached in the memory of the process */
+struct name_entry {
+	qid_t id;
+	char *name;		/* NULL if the id has no name */
+	time_t added;		/* Time the translation was looked up */
+	int used;
+};
+
+static struct {
+	struct name_entry *table;
+	unsigned int size, used;
+} name_table[MAXQUOTAS];
+
+static int namecache_state;	/* 0 - not opened yet, 1 - opened, -1 - not used */
+static char *namecache_image;	/* Contents of the cache file */
+static size_t namecache_size;
+static int namecache_mapped;	/* Is the image mapped or built in memory? */
+static time_t namecache_ttl;
+
+/* Validity of cached translations in seconds */
+static time_t name_ttl(void)
 {
-	struct passwd *entry;
+	char *ttlstr, *end;
+	long val;
+
+	if (namecache_ttl)
+		return namecache_ttl;
+	namecache_ttl = NAMECACHE_TTL;
+	if ((ttlstr = getenv("QUOTA_NAMECACHE_TTL"))) {
+		val = strtol(ttlstr, &end, 10);
+		if (!*end && val > 0)
+			namecache_ttl = val;
+	}
+	return namecache_ttl;
+}
 
-	if (!(entry = getpwuid(id))) {
-		snprintf(buf, MAXNAMELEN, "#%u", (uint) id);
-		return 1;
+static inline unsigned int hash_id(qid_t id)
+{
+	return id * 2654435761U;
+}
+
+static struct name_entry *name_table_find(int type, qid_t id)
+{
+	unsigned int h, mask = name_table[type].size - 1;
+
+	if (!name_table[type].size)
+		return NULL;
+	for (h = hash_id(id) & mask; name_table[type].table[h].used; h = (h + 1) & mask)
+		if (name_table[type].table[h].id == id)
+			return name_table[type].table + h;
+	return NULL;
+}
+
+static void name_table_add(int type, qid_t id, const char *name, time_t now)
+{
+	struct name_entry *old = name_table[type].table;
+	unsigned int h, i, mask, oldsize = name_table[type].size;
+
+	if ((name_table[type].used + 1) * 2 > oldsize) {
+		name_table[type].size = oldsize ? oldsize * 2 : 256;
+		name_table[type].table = smalloc(name_table[type].size * sizeof(struct name_entry));
+		memset(name_table[type].table, 0, name_table[type].size * sizeof(struct name_entry));
+		mask = name_table[type].size - 1;
+		for (i = 0; i < oldsize; i++) {
+			if (!old[i].used)
+				continue;
+			for (h = hash_id(old[i].id) & mask; name_table[type].table[h].used; h = (h + 1) & mask);
+			name_table[type].table[h] = old[i];
+		}
+		free(old);
+	}
+	mask = name_table[type].size - 1;
+	for (h = hash_id(id) & mask; name_table[type].table[h].used; h = (h + 1) & mask);
+	name_table[type].table[h].id = id;
+	name_table[type].table[h].name = name ? sstrdup(name) : NULL;
+	name_table[type].table[h].added = now;
+	name_table[type].table[h].used = 1;
+	name_table[type].used++;
+}
+
+static struct namecache_entry *namecache_entries(int type)
+{
+	struct namecache_header *hdr = (struct namecache_header *)namecache_image;
+	struct namecache_entry *ent = (struct namecache_entry *)(hdr + 1);
+	int i;
+
+	for (i = 0; i < type; i++)
+		ent += hdr->entries[i];
+	return ent;
+}
+
+/* Check that the image is complete and all names are inside of it */
+static int namecache_valid(char *image, size_t size, time_t ttl)
+{
+	struct namecache_header *hdr = (struct namecache_header *)image;
+	struct namecache_entry *ent = (struct namecache_entry *)(hdr + 1);
+	size_t count = 0, i;
+	time_t now = time(NULL);
+
+	if (size < sizeof(*hdr) || hdr->magic != NAMECACHE_MAGIC || hdr->version != NAMECACHE_VERSION)
+		return 0;
+	if (hdr->created > now || now - hdr->created >= ttl)
+		return 0;
+	for (i = 0; i < MAXQUOTAS; i++)
+		count += hdr->entries[i];
+	if (count > size / sizeof(*ent) ||
+	    sizeof(*hdr) + count * sizeof(*ent) + hdr->namesize != size ||
+	    !hdr->namesize || image[size - 1])
+		return 0;
+	for (i = 0; i < count; i++)
+		if (ent[i].name >= hdr->namesize)
+			return 0;
+	return 1;
+}
+
+static int cmp_namecache_entry(const void *a, const void *b)
+{
+	u_int32_t ida = ((struct namecache_entry *)a)->id, idb = ((struct namecache_entry *)b)->id;
+
+	if (ida != idb)
+		return ida < idb ? -1 : 1;
+	/* Keep the first name the database returned for the id */
+	return ((struct namecache_entry *)a)->name < ((struct namecache_entry *)b)->name ? -1 : 1;
+}
+
+/* Dump passwd and group databases into an image of the cache file */
+static char *namecache_build(size_t *sizep)
+{
+	struct namecache_entry *ent[MAXQUOTAS] = { NULL, NULL };
+	u_int32_t cnt[MAXQUOTAS] = { 0, 0 }, alloc[MAXQUOTAS] = { 0, 0 };
+	char *names = NULL, *image;
+	size_t namesize = 1, namealloc = 0, off;
+	struct namecache_header *hdr;
+	struct passwd *pwent;
+	struct group *grent;
+	int type;
+
+	for (type = 0; type < MAXQUOTAS; type++) {
+		if (type == USRQUOTA)
+			setpwent();
+		else
+			setgrent();
+		while (1) {
+			qid_t id;
+			char *name;
+			size_t len;
+
+			if (type == USRQUOTA) {
+				if (!(pwent = getpwent()))
+					break;
+				id = pwent->pw_uid;
+				name = pwent->pw_name;
+			}
+			else {
+				if (!(grent = getgrent()))
+					break;
+				id = grent->gr_gid;
+				name = grent->gr_name;
+			}
+			len = strnlen(name, MAXNAMELEN - 1) + 1;
+			if (namesize + len > namealloc) {
+				namealloc = namealloc ? namealloc * 2 : 65536;
+				names = srealloc(names, namealloc);
+			}
+			if (cnt[type] == alloc[type]) {
+				alloc[type] = alloc[type] ? alloc[type] * 2 : 1024;
+				ent[type] = srealloc(ent[type], alloc[type] * sizeof(struct namecache_entry));
+			}
+			ent[type][cnt[type]].id = id;
+			ent[type][cnt[type]++].name = namesize;
+			memcpy(names + namesize, name, len - 1);
+			names[namesize + len - 1] = 0;
+			namesize += len;
+		}
+		if (type == USRQUOTA)
+			endpwent();
+		else
+			endgrent();
+	}
+
+	*sizep = sizeof(*hdr) + (cnt[USRQUOTA] + cnt[GRPQUOTA]) * sizeof(struct namecache_entry) + namesize;
+	image = smalloc(*sizep);
+	hdr = (struct namecache_header *)image;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = NAMECACHE_MAGIC;
+	hdr->version = NAMECACHE_VERSION;
+	hdr->created = time(NULL);
+	hdr->namesize = namesize;
+	off = sizeof(*hdr);
+	for (type = 0; type < MAXQUOTAS; type++) {
+		u_int32_t i, j;
+
+		/* Sort and drop later entries with the same id */
+		if (cnt[type])
+			qsort(ent[type], cnt[type], sizeof(struct namecache_entry), cmp_namecache_entry);
+		for (i = j = 0; i < cnt[type]; i++)
+			if (!j || ent[type][j - 1].id != ent[type][i].id)
+				ent[type][j++] = ent[type][i];
+		hdr->entries[type] = j;
+		memcpy(image + off, ent[type], j * sizeof(struct namecache_entry));
+		off += j * sizeof(struct namecache_entry);
+		free(ent[type]);
+	}
+	/* Name area goes right after the entries, first byte is unused */
+	if (names)
+		memcpy(image + off, names, namesize);
+	image[off] = 0;
+	free(names);
+	*sizep = off + namesize;
+	return image;
+}
+
+/* Atomically replace the cache file. Failure just means other processes won't benefit. */
+static void namecache_write(const char *path, char *image, size_t size)
+{
+	char *tmpname = smalloc(strlen(path) + 8);
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	sprintf(tmpname, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmpname)) < 0) {
+		free(tmpname);
+		return;
+	}
+	fchmod(fd, 0644);
+	while (done < size) {
+		ret = write(fd, image + done, size - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	if (close(fd) < 0 || done < size || rename(tmpname, path) < 0)
+		unlink(tmpname);
+	free(tmpname);
+}
+
+/* Map the cache file, refresh it from NSS if it is missing or stale */
+static void namecache_open(void)
+{
+	char *path = getenv("QUOTA_NAMECACHE");
+	struct stat st;
+	int fd;
+
+	namecache_state = -1;
+	if (!path || !*path)
+		return;
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		/* Names from a file others could have written must not be trusted */
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+		    (st.st_uid == 0 || st.st_uid == geteuid()) &&
+		    !(st.st_mode & (S_IWGRP | S_IWOTH))) {
+			namecache_image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (namecache_image == MAP_FAILED)
+				namecache_image = NULL;
+			else if (!namecache_valid(namecache_image, st.st_size, name_ttl())) {
+				munmap(namecache_image, st.st_size);
+				namecache_image = NULL;
+			}
+			else {
+				namecache_size = st.st_size;
+				namecache_mapped = 1;
+			}
+		}
+		close(fd);
 	}
+	if (!namecache_image) {
+		namecache_image = namecache_build(&namecache_size);
+		namecache_mapped = 0;
+		namecache_write(path, namecache_image, namecache_size);
+	}
+	namecache_state = 1;
+}
+
+/* Drop the image so that the next lookup reopens the cache file */
+static void namecache_close(void)
+{
+	if (namecache_mapped)
+		munmap(namecache_image, namecache_size);
 	else
-		sstrncpy(buf, entry->pw_name, MAXNAMELEN);
+		free(namecache_image);
+	namecache_image = NULL;
+	namecache_size = 0;
+	namecache_mapped = 0;
+	namecache_state = 0;
+}
+
+/* Find name in the cache file. Return 1 if found, 0 if the id isn't there, -1 if there's no file. */
+static int namecache_lookup(int type, qid_t id, char *buf, time_t now)
+{
+	struct namecache_header *hdr;
+	struct namecache_entry *ent;
+	char *names;
+	u_int32_t lo, hi, mid;
+
+	if (namecache_state > 0) {
+		hdr = (struct namecache_header *)namecache_image;
+		if (hdr->created > now || now - hdr->created >= name_ttl())
+			namecache_close();
+	}
+	if (!namecache_state)
+		namecache_open();
+	if (namecache_state < 0)
+		return -1;
+	hdr = (struct namecache_header *)namecache_image;
+	ent = namecache_entries(type);
+	names = (char *)(namecache_entries(MAXQUOTAS - 1) + hdr->entries[MAXQUOTAS - 1]);
+	for (lo = 0, hi = hdr->entries[type]; lo < hi;) {
+		mid = (lo + hi) / 2;
+		if (ent[mid].id == id) {
+			sstrncpy(buf, names + ent[mid].name, MAXNAMELEN);
+			return 1;
+		}
+		if (ent[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 	return 0;
 }
 
+/* Is the translation remembered in memory still valid? */
+static int name_entry_valid(struct name_entry *entry, time_t now)
+{
+	time_t ttl = name_ttl();
+
+	/* Missing names expire sooner so that new users show up quickly */
+	if (!entry->name && ttl > NAMECACHE_MISS_TTL)
+		ttl = NAMECACHE_MISS_TTL;
+	return entry->added <= now && now - entry->added < ttl;
+}
+
 /*
- *	Convert gid to name
+ *	Translate id to name using caches. Returns 0 if the name was found,
+ *	otherwise 1 and "#id" in buf.
  */
-int gid2group(gid_t id, char *buf)
+static int cached_id2name(qid_t id, int type, char *buf)
 {
-	struct group *entry;
+	struct name_entry *entry = name_table_find(type, id);
+	time_t now = time(NULL);
+	char *name = NULL;
+
+	if (entry && name_entry_valid(entry, now))
+		goto out;
+	if (namecache_lookup(type, id, buf, now) > 0) {
+		name = buf;
+		goto found;
+	}
+	/* Not in the dump (new entry or database which can't be enumerated) */
+	if (type == USRQUOTA) {
+		struct passwd *pwent = getpwuid(id);
+
+		if (pwent)
+			name = pwent->pw_name;
+	}
+	else {
+		struct group *grent = getgrgid(id);
 
-	if (!(entry = getgrgid(id))) {
+		if (grent)
+			name = grent->gr_name;
+	}
+found:
+	if (entry) {
+		/* Refresh expired translation, the user may have been renamed or created */
+		free(entry->name);
+		entry->name = name ? sstrdup(name) : NULL;
+		entry->added = now;
+	}
+	else {
+		name_table_add(type, id, name, now);
+		entry = name_table_find(type, id);
+	}
+out:
+	if (!entry->name) {
 		snprintf(buf, MAXNAMELEN, "#%u", (uint) id);
 		return 1;
 	}
-	else
-		sstrncpy(buf, entry->gr_name, MAXNAMELEN);
+	sstrncpy(buf, entry->name, MAXNAMELEN);
 	return 0;
 }
 
+/*
+ *	Convert uid to name
+ */
+int uid2user(uid_t id, char *buf)
+{
+	return cached_id2name(id, USRQUOTA, buf);
+}
+
+/*
+ *	Convert gid to name
+ */
+int gid2group(gid_t id, char *buf)
+{
+	return cached_id2name(id, GRPQUOTA, buf);
+}
+
 /*
  *	Convert id to user/groupname
  */
@@ -616,28 +1018,205 @@ int get_qf_name(struct mount_entry *mnt, int type, int fmt, int flags, char **fi
 }
 
 #define START_MNT_POINTS 256	/* The number of mount points we start with... */
+#define HANDLE_INIT_THREADS 16	/* Maximal number of threads initializing handles */
+#define HANDLE_INIT_TIMEOUT 30	/* Seconds to wait for initialization of one handle */
+
+#define HI_QUEUED 0
+#define HI_RUNNING 1
+#define HI_DONE 2
+#define HI_ABANDONED 3
+
+/* Initialization of handle for one mountpoint */
+struct handle_init {
+	struct mount_entry mnt;	/* Copy of the entry with own strings */
+	int dup;		/* Initialization of the same device or -1 */
+	int state;
+	time_t started;
+	struct quota_handle *h;
+};
+
+/*
+ * State shared with the threads initializing handles. A thread stuck on
+ * a dead filesystem can outlive create_handle_list() so the state is freed
+ * by whoever drops the last reference.
+ */
+struct handle_init_set {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int refs;		/* Running threads and the caller */
+	int stuck;		/* Threads whose initialization was abandoned */
+	int type, fmt, ioflags;
+	int count, next;
+	struct handle_init *init;
+};
+
+static void free_handle_init_set(struct handle_init_set *set)
+{
+	int i;
+
+	for (i = 0; i < set->count; i++) {
+		free(set->init[i].mnt.me_type);
+		free(set->init[i].mnt.me_opts);
+		free((char *)set->init[i].mnt.me_devname);
+		free((char *)set->init[i].mnt.me__dir);
+		free((char *)set->init[i].mnt.me_dir);
+	}
+	free(set->init);
+	pthread_mutex_destroy(&set->lock);
+	pthread_cond_destroy(&set->done);
+	free(set);
+}
+
+static void *handle_init_worker(void *arg)
+{
+	struct handle_init_set *set = arg;
+	struct handle_init *hi;
+	struct quota_handle *h;
+
+	pthread_mutex_lock(&set->lock);
+	while (1) {
+		while (set->next < set->count && (set->init[set->next].dup >= 0 ||
+		       set->init[set->next].state != HI_QUEUED))
+			set->next++;
+		if (set->next == set->count)
+			break;
+		hi = set->init + set->next++;
+		hi->state = HI_RUNNING;
+		hi->started = time(NULL);
+		pthread_mutex_unlock(&set->lock);
+		h = init_io(&hi->mnt, set->type, set->fmt, set->ioflags);
+		pthread_mutex_lock(&set->lock);
+		if (hi->state == HI_ABANDONED) {
+			/* Nobody waits for the handle anymore */
+			if (h)
+				end_io(h);
+			continue;
+		}
+		hi->h = h;
+		hi->state = HI_DONE;
+		pthread_cond_broadcast(&set->done);
+	}
+	if (!--set->refs) {
+		pthread_mutex_unlock(&set->lock);
+		free_handle_init_set(set);
+		return NULL;
+	}
+	pthread_mutex_unlock(&set->lock);
+	return NULL;
+}
+
+/* Start new thread initializing handles, called with set->lock held */
+static int start_handle_init_worker(struct handle_init_set *set)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, handle_init_worker, set);
+	pthread_attr_destroy(&attr);
+	if (ret)
+		return -1;
+	set->refs++;
+	return 0;
+}
+
+/*
+ * Wait for initialization of handle, called with set->lock held. When it
+ * takes too long, the initialization is abandoned and another thread is
+ * started instead of the stuck one.
+ */
+static struct quota_handle *wait_handle_init(struct handle_init_set *set, struct handle_init *hi)
+{
+	struct timespec ts;
+	time_t now;
+
+	while (hi->state != HI_DONE) {
+		now = time(NULL);
+		if (hi->state == HI_RUNNING && now >= hi->started + HANDLE_INIT_TIMEOUT) {
+			errstr(_("Initialization of quota on %s timed out. Skipping.\n"), hi->mnt.me_dir);
+			hi->state = HI_ABANDONED;
+			set->stuck++;
+			start_handle_init_worker(set);
+			return NULL;
+		}
+		/* No thread left to do the work? Do it ourselves. */
+		if (hi->state == HI_QUEUED && set->refs - set->stuck <= 1) {
+			set->next = hi - set->init + 1;
+			hi->state = HI_RUNNING;
+			pthread_mutex_unlock(&set->lock);
+			hi->h = init_io(&hi->mnt, set->type, set->fmt, set->ioflags);
+			pthread_mutex_lock(&set->lock);
+			hi->state = HI_DONE;
+			break;
+		}
+		ts.tv_sec = hi->state == HI_RUNNING ? hi->started + HANDLE_INIT_TIMEOUT : now + 1;
+		ts.tv_nsec = 0;
+		pthread_cond_timedwait(&set->done, &set->lock, &ts);
+	}
+	return hi->h;
+}
+
+/* Add mountpoint to the set of handles to initialize */
+static void add_handle_init(struct handle_init_set *set, struct mount_entry *mnt, int *allocated)
+{
+	struct handle_init *hi;
+	int i;
+
+	if (set->count == *allocated) {
+		*allocated += START_MNT_POINTS;
+		set->init = srealloc(set->init, *allocated * sizeof(struct handle_init));
+	}
+	hi = set->init + set->count;
+	hi->mnt = *mnt;
+	hi->mnt.me_type = sstrdup(mnt->me_type);
+	hi->mnt.me_opts = sstrdup(mnt->me_opts);
+	hi->mnt.me_devname = sstrdup(mnt->me_devname);
+	hi->mnt.me__dir = sstrdup(mnt->me__dir);
+	hi->mnt.me_dir = sstrdup(mnt->me_dir);
+	hi->state = HI_QUEUED;
+	hi->h = NULL;
+	/* Quotafiles of the same device are opened just once */
+	hi->dup = -1;
+	if (!nfs_fstype(mnt->me_type))
+		for (i = 0; i < set->count; i++)
+			if (set->init[i].dup < 0 && set->init[i].mnt.me_dev == mnt->me_dev &&
+			    !nfs_fstype(set->init[i].mnt.me_type)) {
+				hi->dup = i;
+				break;
+			}
+	set->count++;
+}
 
 /*
  *	Create NULL terminated list of quotafile handles from given list of mountpoints
  *	List of zero length means scan all entries in /etc/mtab
+ *	The list is allocated for the caller and freed by dispose_handle_list()
  */
 struct quota_handle **create_handle_list(int count, char **mntpoints, int type, int fmt,
 					 int ioflags, int mntflags)
 {
 	struct mount_entry *mnt;
 	int gotmnt = 0;
-	static int hlist_allocated = 0;
-	static struct quota_handle **hlist = NULL;
-
-	if (!hlist_allocated) {
-		hlist = smalloc(START_MNT_POINTS * sizeof(struct quota_handle *));
-		hlist_allocated = START_MNT_POINTS;
-	}
+	int hlist_allocated = START_MNT_POINTS;
+	struct quota_handle **hlist = smalloc(hlist_allocated * sizeof(struct quota_handle *));
+	struct handle_init_set *set;
+	int i, allocated = 0, threads = 0;
 
 	/* If directories are specified, cache all NFS mountpoints */
 	if (count && !(mntflags & MS_LOCALONLY))
 		mntflags |= MS_NFS_ALL;
 
+	set = smalloc(sizeof(struct handle_init_set));
+	memset(set, 0, sizeof(struct handle_init_set));
+	set->type = type;
+	set->fmt = fmt;
+	set->ioflags = ioflags;
+	set->refs = 1;
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->done, NULL);
+
 	if (init_mounts_scan(count, mntpoints, mntflags) < 0)
 		die(2, _("Cannot initialize mountpoint scan.\n"));
 	while ((mnt = get_next_mount())) {
@@ -647,13 +1226,7 @@ struct quota_handle **create_handle_list(int count, char **mntpoints, int type,
 #endif
 		if (fmt == -1 || count) {
 add_entry:
-			if (gotmnt+1 >= hlist_allocated) {
-				hlist_allocated += START_MNT_POINTS;
-				hlist = srealloc(hlist, hlist_allocated * sizeof(struct quota_handle *));
-			}
-			if (!(hlist[gotmnt] = init_io(mnt, type, fmt, ioflags)))
-				continue;
-			gotmnt++;
+			add_handle_init(set, mnt, &allocated);
 		}
 		else {
 			switch (fmt) {
@@ -676,6 +1249,46 @@ add_entry:
 		}
 	}
 	end_mounts_scan();
+
+	/* Initialize handles in parallel so that one slow filesystem does not delay the others */
+	pthread_mutex_lock(&set->lock);
+	for (i = 0; i < set->count; i++)
+		if (set->init[i].dup < 0 && threads < HANDLE_INIT_THREADS &&
+		    start_handle_init_worker(set) == 0)
+			threads++;
+	for (i = 0; i < set->count; i++) {
+		struct handle_init *hi = set->init + i;
+
+		/*
+		 * Read-only handles are cloned so that they can be used from
+		 * different threads, writers have to share the handle to keep
+		 * the quotafile consistent.
+		 */
+		if (hi->dup >= 0) {
+			hi->h = set->init[hi->dup].h;
+			if (hi->h && ioflags & IOI_READONLY)
+				hi->h = clone_io(hi->h);
+		}
+		else
+			wait_handle_init(set, hi);
+		if (!hi->h)
+			continue;
+		if (gotmnt+1 >= hlist_allocated) {
+			hlist_allocated += START_MNT_POINTS;
+			hlist = srealloc(hlist, hlist_allocated * sizeof(struct quota_handle *));
+		}
+		/* Mountpoint of the clone could differ */
+		if (hi->dup >= 0 && hi->h != set->init[hi->dup].h)
+			sstrncpy(hi->h->qh_dir, hi->mnt.me_dir, PATH_MAX);
+		hlist[gotmnt++] = hi->h;
+	}
+	if (!--set->refs) {
+		pthread_mutex_unlock(&set->lock);
+		free_handle_init_set(set);
+	}
+	else
+		pthread_mutex_unlock(&set->lock);
+
 	hlist[gotmnt] = NULL;
 	if (count && gotmnt != count)
 		die(1, _("Not all specified mountpoints are using quota.\n"));
@@ -683,19 +1296,25 @@ add_entry:
 }
 
 /*
- *	Free given list of handles
+ *	Release handles in the given list and free the list
  */
 int dispose_handle_list(struct quota_handle **hlist)
 {
-	int i;
+	int i, j;
 	int ret = 0;
 
-	for (i = 0; hlist[i]; i++)
+	for (i = 0; hlist[i]; i++) {
+		/* Handle can be shared by several mountpoints */
+		for (j = 0; j < i && hlist[j] != hlist[i]; j++);
+		if (j < i)
+			continue;
 		if (end_io(hlist[i]) < 0) {
 			errstr(_("Error while releasing file on %s\n"),
 				hlist[i]->qh_quotadev);
 			ret = -1;
 		}
+	}
+	free(hlist);
 	return ret;
 }
 
@@ -913,114 +1532,482 @@ struct searched_dir {
 	int sd_dir;		/* Is searched dir mountpoint or in fact device? */
 	dev_t sd_dev;		/* Device mountpoint lies on */
 	ino_t sd_ino;		/* Inode number of mountpoint */
+	int sd_mnt;		/* Index of mount entry if already known, -1 otherwise */
 	const char *sd_name;	/* Name of given dir/device */
 };
 
 #define ALLOC_ENTRIES_NUM 16	/* Allocate entries by this number */
+#define PROC_MOUNTINFO "/proc/self/mountinfo"
+/* Flags of init_mounts_scan() influencing contents of the mount table */
+#define MS_TABLE_FLAGS (MS_NO_AUTOFS | MS_LOCALONLY | MS_XFS_DISABLED | MS_NFS_ALL)
+#define MNT_NOENTRY -2		/* Mountpoint of filesystem which is not in the table */
+
+/* Hash of paths with values being indices, keys are owned by the hash */
+struct path_hash {
+	const char **key;
+	int *val;
+	unsigned int size, used;
+};
 
 static int mnt_entries_cnt;	/* Number of cached mountpoint entries */
+static int mnt_entries_allocated;
 static struct mount_entry *mnt_entries;	/* Cached mounted filesystems */
 static int check_dirs_cnt, act_checked;	/* Number of dirs to check; Actual checked dir/(mountpoint in case of -a) */
 static struct searched_dir *check_dirs;	/* Directories to check */
 
+/*
+ * The mount table is kept between scans and built again only when flags
+ * of the scan differ or the set of mounts has changed.
+ */
+static int mnt_table_flags = -1;	/* Flags the table was built with */
+static const char *mnt_table_file;	/* File the table was read from */
+static struct stat mnt_table_stat;	/* Its stat at the time of reading */
+static int mountinfo_fd = -1;	/* Polled for changes of mounts */
+static unsigned long mnt_table_gen;	/* Changed whenever the table is found stale */
+static int *mnt_dev_hash;	/* Indices of entries hashed by device */
+static unsigned int mnt_dev_hash_size;
+static struct path_hash mnt_dir_hash;	/* Indices of entries hashed by mountpoints of all mounts */
+
+static inline unsigned int hash_dev(dev_t dev)
+{
+	return ((unsigned long long)dev * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static unsigned int hash_path(const char *path, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--)
+		h = (h ^ (unsigned char)*path++) * 16777619U;
+	return h;
+}
+
+static int path_hash_find(struct path_hash *ph, const char *path, size_t len)
+{
+	unsigned int h, mask = ph->size - 1;
+
+	if (!ph->size)
+		return -1;
+	for (h = hash_path(path, len) & mask; ph->key[h]; h = (h + 1) & mask)
+		if (!strncmp(ph->key[h], path, len) && !ph->key[h][len])
+			return ph->val[h];
+	return -1;
+}
+
+/* Set value for path */
+static void path_hash_set(struct path_hash *ph, const char *path, int val)
+{
+	unsigned int h, i, mask, oldsize = ph->size;
+	size_t len = strlen(path);
+
+	if ((ph->used + 1) * 2 > oldsize) {
+		const char **oldkey = ph->key;
+		int *oldval = ph->val;
+
+		ph->size = oldsize ? oldsize * 2 : 64;
+		ph->key = smalloc(ph->size * sizeof(char *));
+		memset(ph->key, 0, ph->size * sizeof(char *));
+		ph->val = smalloc(ph->size * sizeof(int));
+		mask = ph->size - 1;
+		for (i = 0; i < oldsize; i++) {
+			if (!oldkey[i])
+				continue;
+			for (h = hash_path(oldkey[i], strlen(oldkey[i])) & mask; ph->key[h]; h = (h + 1) & mask);
+			ph->key[h] = oldkey[i];
+			ph->val[h] = oldval[i];
+		}
+		free(oldkey);
+		free(oldval);
+	}
+	mask = ph->size - 1;
+	for (h = hash_path(path, len) & mask; ph->key[h]; h = (h + 1) & mask)
+		if (!strcmp(ph->key[h], path)) {
+			ph->val[h] = val;
+			return;
+		}
+	ph->key[h] = sstrdup(path);
+	ph->val[h] = val;
+	ph->used++;
+}
+
+static void path_hash_free(struct path_hash *ph)
+{
+	unsigned int i;
+
+	for (i = 0; i < ph->size; i++)
+		free((char *)ph->key[i]);
+	free(ph->key);
+	free(ph->val);
+	memset(ph, 0, sizeof(*ph));
+}
+
+static void mnt_dev_hash_insert(int idx)
+{
+	unsigned int h, mask = mnt_dev_hash_size - 1;
+
+	for (h = hash_dev(mnt_entries[idx].me_dev) & mask; mnt_dev_hash[h] >= 0; h = (h + 1) & mask);
+	mnt_dev_hash[h] = idx;
+}
+
+/* Add last cached entry to the hashes */
+static void mnt_hash_add(void)
+{
+	int i;
+
+	if (mnt_entries_cnt * 2 > mnt_dev_hash_size) {
+		free(mnt_dev_hash);
+		mnt_dev_hash_size = mnt_dev_hash_size ? mnt_dev_hash_size * 2 : 64;
+		mnt_dev_hash = smalloc(mnt_dev_hash_size * sizeof(int));
+		memset(mnt_dev_hash, 0xff, mnt_dev_hash_size * sizeof(int));
+		for (i = 0; i < mnt_entries_cnt; i++)
+			mnt_dev_hash_insert(i);
+	}
+	else
+		mnt_dev_hash_insert(mnt_entries_cnt - 1);
+	/* When mountpoint is overmounted, the last mount is the visible one */
+	path_hash_set(&mnt_dir_hash, mnt_entries[mnt_entries_cnt - 1].me__dir, mnt_entries_cnt - 1);
+}
+
+/* Return root inode of cached entry, stat() its mountpoint only when the inode is not known yet */
+static ino_t mnt_entry_ino(int i)
+{
+	struct stat st;
+
+	if (!mnt_entries[i].me_ino && stat(mnt_entries[i].me__dir, &st) == 0)
+		mnt_entries[i].me_ino = st.st_ino;
+	return mnt_entries[i].me_ino;
+}
+
+/*
+ * Find first cached entry with given device (and root inode if checkino is
+ * set). Entries with the same device are found in the order they were added.
+ */
+static int mnt_find_dev(dev_t dev, ino_t ino, int checkino)
+{
+	unsigned int h, mask = mnt_dev_hash_size - 1;
+	int i;
+
+	if (!mnt_dev_hash_size)
+		return -1;
+	for (h = hash_dev(dev) & mask; (i = mnt_dev_hash[h]) >= 0; h = (h + 1) & mask)
+		if (mnt_entries[i].me_dev == dev && (!checkino || mnt_entry_ino(i) == ino))
+			return i;
+	return -1;
+}
+
+/* Is there autofs mountpoint above dir? */
+static int under_autofs(struct path_hash *autofsdir, const char *dir)
+{
+	const char *p;
+
+	if (!autofsdir->used)
+		return 0;
+	for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/'))
+		if (path_hash_find(autofsdir, dir, p - dir) >= 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Find entry of filesystem mounted on path (or on its longest prefix when
+ * prefix is set). Path has to be absolute and without '.' and '..'
+ * components, it is resolved purely lexically. Returns index of the entry,
+ * MNT_NOENTRY when the filesystem is not in the table or -1 when the path
+ * is not covered by the index. Sets exact when the path is the mountpoint.
+ */
+static int mnt_find_path(const char *path, int prefix, int *exact)
+{
+	size_t len = strlen(path);
+	const char *p;
+	int i;
+
+	if (path[0] != '/')
+		return -1;
+	for (p = path; *p; p++)
+		if (p[0] == '/' && p[1] == '.' && (!p[2] || p[2] == '/' || (p[2] == '.' && (!p[3] || p[3] == '/'))))
+			return -1;
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	*exact = 1;
+	while (1) {
+		if ((i = path_hash_find(&mnt_dir_hash, path, len)) != -1)
+			return i;
+		if (!prefix || len == 1)
+			return -1;
+		while (len > 1 && path[len - 1] != '/')
+			len--;
+		while (len > 1 && path[len - 1] == '/')
+			len--;
+		*exact = 0;
+	}
+}
+
+static void free_mnt_table(void)
+{
+	int i;
+
+	for (i = 0; i < mnt_entries_cnt; i++) {
+		free(mnt_entries[i].me_type);
+		free(mnt_entries[i].me_opts);
+		free((char *)mnt_entries[i].me_devname);
+		free((char *)mnt_entries[i].me__dir);
+	}
+	free(mnt_entries);
+	mnt_entries = NULL;
+	mnt_entries_cnt = mnt_entries_allocated = 0;
+	free(mnt_dev_hash);
+	mnt_dev_hash = NULL;
+	mnt_dev_hash_size = 0;
+	path_hash_free(&mnt_dir_hash);
+	mnt_table_flags = -1;
+}
+
+/* Can the cached mount table be used for scan with given flags? */
+static int mnt_table_valid(int flags)
+{
+	struct pollfd pfd;
+	struct stat st;
+
+	if (!mnt_entries || (flags & MS_TABLE_FLAGS) != mnt_table_flags)
+		return 0;
+	/* The kernel signals change of mounts by POLLPRI on mountinfo */
+	if (mountinfo_fd >= 0) {
+		pfd.fd = mountinfo_fd;
+		pfd.events = POLLPRI;
+		if (poll(&pfd, 1, 0) > 0 && pfd.revents & (POLLPRI | POLLERR))
+			return 0;
+	}
+	if (stat(mnt_table_file, &st) < 0 || st.st_dev != mnt_table_stat.st_dev ||
+	    st.st_ino != mnt_table_stat.st_ino || st.st_size != mnt_table_stat.st_size ||
+	    st.st_mtim.tv_sec != mnt_table_stat.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != mnt_table_stat.st_mtim.tv_nsec)
+		return 0;
+	return 1;
+}
+
+/*
+ * Check whether mount entry should be cached. Return name of its device
+ * and detected quota formats in qfmt if so, NULL otherwise.
+ */
+static const char *mnt_entry_quota_dev(struct mntent *mnt, struct path_hash *autofsdir, int flags, int *qfmt)
+{
+	const char *devname;
+	char *opt;
+
+	if (!(devname = get_device_name(mnt->mnt_fsname))) {
+		errstr(_("Cannot get device name for %s\n"), mnt->mnt_fsname);
+		return NULL;
+	}
+
+	/* Check for mountpoints under autofs and skip them*/
+	if (under_autofs(autofsdir, mnt->mnt_dir)) {
+		free((char *)devname);
+		return NULL;
+	}
+
+	if (flags & MS_NO_AUTOFS && !strcmp(mnt->mnt_type, MNTTYPE_AUTOFS)) {	/* Autofs dir to remember? */
+		path_hash_set(autofsdir, mnt->mnt_dir, 0);
+		free((char *)devname);
+		return NULL;
+	}
+
+	if (flags & MS_LOCALONLY && nfs_fstype(mnt->mnt_type)) {
+		free((char *)devname);
+		return NULL;
+	}
+	if (hasmntopt(mnt, MNTOPT_NOQUOTA)) {
+		free((char *)devname);
+		return NULL;
+	}
+	if (hasmntopt(mnt, MNTOPT_BIND)) {
+		free((char *)devname);
+		return NULL;	/* We just ignore bind mounts... */
+	}
+	if ((opt = hasmntoptarg(mnt->mnt_opts, MNTOPT_LOOP))) {
+		char loopdev[PATH_MAX];
+
+		copy_mntoptarg(opt, loopdev, PATH_MAX);
+		free((char *)devname);
+		devname = sstrdup(loopdev);
+	}
+
+	/* Further we are not interested in mountpoints without quotas and
+	   we don't want to touch them */
+	qfmt[USRQUOTA] = hasquota(devname, mnt, USRQUOTA, flags);
+	qfmt[GRPQUOTA] = hasquota(devname, mnt, GRPQUOTA, flags);
+	if (qfmt[USRQUOTA] < 0 && qfmt[GRPQUOTA] < 0) {
+		free((char *)devname);
+		return NULL;
+	}
+	return devname;
+}
+
+/* Add new entry to the table, devname is consumed */
+static void mnt_entry_append(struct mntent *mnt, const char *devname, const char *dir,
+			     dev_t dev, ino_t ino, int *qfmt)
+{
+	int i = mnt_entries_cnt;
+
+	if (mnt_entries_allocated == mnt_entries_cnt) {
+		mnt_entries_allocated += ALLOC_ENTRIES_NUM;
+		mnt_entries = srealloc(mnt_entries, mnt_entries_allocated * sizeof(struct mount_entry));
+	}
+	mnt_entries[i].me_type = sstrdup(mnt->mnt_type);
+	mnt_entries[i].me_opts = sstrdup(mnt->mnt_opts);
+	mnt_entries[i].me_dev = dev;
+	mnt_entries[i].me_ino = ino;
+	mnt_entries[i].me_devname = devname;
+	mnt_entries[i].me__dir = sstrdup(dir);
+	mnt_entries[i].me_dir = NULL;
+	memcpy(&mnt_entries[i].me_qfmt, qfmt, sizeof(int) * MAXQUOTAS);
+	mnt_entries_cnt++;
+	mnt_hash_add();
+}
+
+/* Decode octal escapes the kernel uses for spaces and such in mountinfo */
+static void unescape_mountinfo(char *s)
+{
+	char *d = s;
+
+	for (; *s; s++, d++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' &&
+		    s[3] >= '0' && s[3] <= '7') {
+			*d = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+			s += 3;
+		}
+		else
+			*d = *s;
+	}
+	*d = 0;
+}
+
+/*
+ * Cache mounted filesystems from /proc/self/mountinfo. The file carries
+ * device numbers of all mounts so neither mountpoints nor devices need
+ * to be stat()ed.
+ */
+static int read_mountinfo(int flags, struct path_hash *autofsdir)
+{
+	FILE *f;
+	char *line = NULL, *p, *field[10];
+	size_t linesize = 0;
+	unsigned int maj, mnr;
+	struct mntent mnt;
+	int i, qfmt[MAXQUOTAS];
+
+	if (!(f = fopen(PROC_MOUNTINFO, "r")))
+		return -1;
+	mnt_table_file = PROC_MOUNTINFO;
+	if (fstat(fileno(f), &mnt_table_stat) < 0)
+		memset(&mnt_table_stat, 0, sizeof(mnt_table_stat));
+	while (getline(&line, &linesize, f) >= 0) {
+		const char *devname;
+		char *opts, *sbopts;
+		dev_t dev;
+
+		/*
+		 * Format: mount ID, parent ID, major:minor, root, mountpoint,
+		 * mount options, optional fields, "-", fs type, source, superblock options
+		 */
+		for (i = 0, p = strtok(line, " \n"); p && i < 6; p = strtok(NULL, " \n"))
+			field[i++] = p;
+		while (p && strcmp(p, "-"))
+			p = strtok(NULL, " \n");
+		for (p = p ? strtok(NULL, " \n") : NULL; p && i < 9; p = strtok(NULL, " \n"))
+			field[i++] = p;
+		if (i < 9 || sscanf(field[2], "%u:%u", &maj, &mnr) != 2)
+			continue;
+		unescape_mountinfo(field[4]);
+		unescape_mountinfo(field[7]);
+
+		/* Options as shown in /proc/mounts - superblock ro/rw is already among mount options */
+		sbopts = field[8];
+		if ((sbopts[0] == 'r' && (sbopts[1] == 'w' || sbopts[1] == 'o')) &&
+		    (sbopts[2] == ',' || !sbopts[2]))
+			sbopts += sbopts[2] ? 3 : 2;
+		opts = smalloc(strlen(field[5]) + strlen(sbopts) + 2);
+		strcpy(opts, field[5]);
+		if (*sbopts) {
+			strcat(opts, ",");
+			strcat(opts, sbopts);
+		}
+
+		mnt.mnt_fsname = field[7];
+		mnt.mnt_dir = field[4];
+		mnt.mnt_type = field[6];
+		mnt.mnt_opts = opts;
+		mnt.mnt_freq = mnt.mnt_passno = 0;
+		if (!(devname = mnt_entry_quota_dev(&mnt, autofsdir, flags, qfmt))) {
+			path_hash_set(&mnt_dir_hash, mnt.mnt_dir, MNT_NOENTRY);
+			free(opts);
+			continue;
+		}
+		dev = makedev(maj, mnr);
+		if (!nfs_fstype(mnt.mnt_type)) {
+			/* Filesystems without block device cannot have quota files */
+			if (!maj) {
+				errstr(_("Device (%s) filesystem is mounted on unsupported device type. Skipping.\n"), devname);
+				path_hash_set(&mnt_dir_hash, mnt.mnt_dir, MNT_NOENTRY);
+				free((char *)devname);
+				free(opts);
+				continue;
+			}
+			i = mnt_find_dev(dev, 0, 0);
+		}
+		else if (!(flags & MS_NFS_ALL))
+			i = mnt_find_dev(dev, 0, 0);
+		else	/* Always behave as if the device was unique */
+			i = -1;
+		if (i < 0)	/* New mounted device? */
+			mnt_entry_append(&mnt, devname, mnt.mnt_dir, dev, 0, qfmt);
+		else {
+			/* Another mount of already cached filesystem (bind mounts of subtrees are not indexed) */
+			path_hash_set(&mnt_dir_hash, mnt.mnt_dir, strcmp(field[3], "/") ? MNT_NOENTRY : i);
+			free((char *)devname);
+		}
+		free(opts);
+	}
+	free(line);
+	fclose(f);
+	return 0;
+}
+
 /* Cache mtab/fstab */
-static int cache_mnt_table(int flags)
+static int read_mtab(int flags, struct path_hash *autofsdir)
 {
 	FILE *mntf;
 	struct mntent *mnt;
 	struct stat st;
 	struct statfs fsstat;
-	int allocated = 0, i = 0;
+	int i = 0;
 	dev_t dev = 0;
 	char mntpointbuf[PATH_MAX];
-	int autofsdircnt, autofsdir_allocated;
-	char **autofsdir;
 
 #ifdef ALT_MTAB
+	mnt_table_file = ALT_MTAB;
 	mntf = setmntent(ALT_MTAB, "r");
 	if (mntf)
 		goto alloc;
 #endif
+	mnt_table_file = _PATH_MOUNTED;
 	mntf = setmntent(_PATH_MOUNTED, "r");
 	if (mntf)
 		goto alloc;
 	/* Fallback to fstab when mtab not available */
+	mnt_table_file = _PATH_MNTTAB;
 	if (!(mntf = setmntent(_PATH_MNTTAB, "r"))) {
 		errstr(_("Cannot open any file with mount points.\n"));
 		return -1;
 	}
 alloc:
-	/* Prepare table of mount entries */
-	mnt_entries = smalloc(sizeof(struct mount_entry) * ALLOC_ENTRIES_NUM);
-	mnt_entries_cnt = 0;
-	allocated += ALLOC_ENTRIES_NUM;
-	/* Prepare table of autofs mountpoints */
-	autofsdir = smalloc(sizeof(char *) * ALLOC_ENTRIES_NUM);
-	autofsdircnt = 0;
-	autofsdir_allocated = ALLOC_ENTRIES_NUM;
+	if (fstat(fileno(mntf), &mnt_table_stat) < 0)
+		memset(&mnt_table_stat, 0, sizeof(mnt_table_stat));
 	while ((mnt = getmntent(mntf))) {
 		const char *devname;
-		char *opt;
 		int qfmt[MAXQUOTAS];
 
-		if (!(devname = get_device_name(mnt->mnt_fsname))) {
-			errstr(_("Cannot get device name for %s\n"), mnt->mnt_fsname);
-			continue;
-		}
-
-		/* Check for mountpoints under autofs and skip them*/
-		for (i = 0; i < autofsdircnt; i++) {
-			int slen = strlen(autofsdir[i]);
-
-			if (slen <= strlen(mnt->mnt_dir) && !strncmp(autofsdir[i], mnt->mnt_dir, slen))
-				break;
-		}
-		if (i < autofsdircnt) {
-			free((char *)devname);
+		if (!(devname = mnt_entry_quota_dev(mnt, autofsdir, flags, qfmt)))
 			continue;
-		}
-				
-		if (flags & MS_NO_AUTOFS && !strcmp(mnt->mnt_type, MNTTYPE_AUTOFS)) {	/* Autofs dir to remember? */
-			if (autofsdircnt == autofsdir_allocated) {
-				autofsdir_allocated += ALLOC_ENTRIES_NUM;
-				autofsdir = srealloc(autofsdir, autofsdir_allocated * sizeof(char *));
-			}
-			autofsdir[autofsdircnt] = smalloc(strlen(mnt->mnt_dir) + 2);
-			strcpy(autofsdir[autofsdircnt], mnt->mnt_dir);
-			strcat(autofsdir[autofsdircnt], "/");
-			autofsdircnt++;
-			free((char *)devname);
-			continue;
-		}
-		
-		if (flags & MS_LOCALONLY && nfs_fstype(mnt->mnt_type)) {
-			free((char *)devname);
-			continue;
-		}
-		if (hasmntopt(mnt, MNTOPT_NOQUOTA)) {
-			free((char *)devname);
-			continue;
-		}
-		if (hasmntopt(mnt, MNTOPT_BIND)) {
-			free((char *)devname);
-			continue;	/* We just ignore bind mounts... */
-		}
-		if ((opt = hasmntoptarg(mnt->mnt_opts, MNTOPT_LOOP))) {
-			char loopdev[PATH_MAX];
-
-			copy_mntoptarg(opt, loopdev, PATH_MAX);
-			free((char *)devname);
-			devname = sstrdup(loopdev);
-		}
-
-		/* Further we are not interested in mountpoints without quotas and
-		   we don't want to touch them */
-		qfmt[USRQUOTA] = hasquota(devname, mnt, USRQUOTA, flags);
-		qfmt[GRPQUOTA] = hasquota(devname, mnt, GRPQUOTA, flags);
-		if (qfmt[USRQUOTA] < 0 && qfmt[GRPQUOTA] < 0) {
-			free((char *)devname);
-			continue;
-		}
 			
 		if (!realpath(mnt->mnt_dir, mntpointbuf)) {
 			errstr(_("Cannot resolve mountpoint path %s: %s\n"), mnt->mnt_dir, strerror(errno));
@@ -1051,10 +2038,10 @@ alloc:
 				continue;
 			}
 			dev = st.st_rdev;
-			for (i = 0; i < mnt_entries_cnt && mnt_entries[i].me_dev != dev; i++);
+			i = mnt_find_dev(dev, 0, 0);
 		}
 		/* Cope with network filesystems or new mountpoint */
-		if (nfs_fstype(mnt->mnt_type) || i == mnt_entries_cnt) {
+		if (nfs_fstype(mnt->mnt_type) || i < 0) {
 			if (stat(mnt->mnt_dir, &st) < 0) {	/* Can't stat mountpoint? We have better ignore it... */
 				errstr(_("Cannot stat() mountpoint %s: %s\n"), mnt->mnt_dir, strerror(errno));
 				free((char *)devname);
@@ -1063,50 +2050,60 @@ alloc:
 			if (nfs_fstype(mnt->mnt_type)) {
 				/* For network filesystems we must get device from root */
 				dev = st.st_dev;
-				if (!(flags & MS_NFS_ALL)) {
-					for (i = 0; i < mnt_entries_cnt && mnt_entries[i].me_dev != dev; i++);
-				}
+				if (!(flags & MS_NFS_ALL))
+					i = mnt_find_dev(dev, 0, 0);
 				else	/* Always behave as if the device was unique */
-					i = mnt_entries_cnt;
+					i = -1;
 			}
 		}
-		if (i == mnt_entries_cnt) {	/* New mounted device? */
-			if (allocated == mnt_entries_cnt) {
-				allocated += ALLOC_ENTRIES_NUM;
-				mnt_entries = srealloc(mnt_entries, allocated * sizeof(struct mount_entry));
-			}
-			mnt_entries[i].me_type = sstrdup(mnt->mnt_type);
-			mnt_entries[i].me_opts = sstrdup(mnt->mnt_opts);
-			mnt_entries[i].me_dev = dev;
-			mnt_entries[i].me_ino = st.st_ino;
-			mnt_entries[i].me_devname = devname;
-			mnt_entries[i].me__dir = sstrdup(mntpointbuf);
-			mnt_entries[i].me_dir = NULL;
-			memcpy(&mnt_entries[i].me_qfmt, qfmt, sizeof(qfmt));
-			mnt_entries_cnt++;
-		}
+		if (i < 0)	/* New mounted device? */
+			mnt_entry_append(mnt, devname, mntpointbuf, dev, st.st_ino, qfmt);
 		else 
 			free((char *)devname);	/* We don't need it any more */
 	}
 	endmntent(mntf);
+	return 0;
+}
+
+/* Cache mounted filesystems */
+static int cache_mnt_table(int flags)
+{
+	struct path_hash autofsdir;
+	int ret = 0;
+
+	if (mnt_table_valid(flags))
+		return 0;
+	free_mnt_table();
+	/* Open mountinfo before reading the table so that no change is missed */
+	if (mountinfo_fd < 0)
+		mountinfo_fd = open(PROC_MOUNTINFO, O_RDONLY | O_CLOEXEC);
 
-	for (i = 0; i < autofsdircnt; i++)
-		free(autofsdir[i]);
-	free(autofsdir);
+	/* Prepare table of mount entries */
+	mnt_entries = smalloc(sizeof(struct mount_entry) * ALLOC_ENTRIES_NUM);
+	mnt_entries_allocated = ALLOC_ENTRIES_NUM;
+	/* Prepare table of autofs mountpoints */
+	memset(&autofsdir, 0, sizeof(autofsdir));
+	if (read_mountinfo(flags, &autofsdir) < 0 && read_mtab(flags, &autofsdir) < 0)
+		ret = -1;
+	path_hash_free(&autofsdir);
+	if (ret < 0) {
+		free_mnt_table();
+		return -1;
+	}
+	mnt_table_flags = flags & MS_TABLE_FLAGS;
+	mnt_table_gen++;
 	return 0;
 }
 
 /* Find mountpoint of filesystem hosting dir in 'st'; Store it in 'st' */
 static const char *find_dir_mntpoint(struct stat *st)
 {
-	int i;
+	int i = mnt_find_dev(st->st_dev, 0, 0);
 
-	for (i = 0; i < mnt_entries_cnt; i++)
-		if (mnt_entries[i].me_dev == st->st_dev) {
-			st->st_ino = mnt_entries[i].me_ino;
-			return mnt_entries[i].me__dir;
-		}
-	return NULL;
+	if (i < 0)
+		return NULL;
+	st->st_ino = mnt_entry_ino(i);
+	return mnt_entries[i].me__dir;
 }
 
 /* Process and store given paths */
@@ -1121,6 +2118,24 @@ static int process_dirs(int dcnt, char **dirs, int flags)
 	if (dcnt) {
 		check_dirs = smalloc(sizeof(struct searched_dir) * dcnt);
 		for (i = 0; i < dcnt; i++) {
+			int mentry, exact;
+
+			/*
+			 * Look the path up in the index of mountpoints first. A mountpoint
+			 * needs no stat(), for a directory below it we just verify it is
+			 * really on that filesystem (there could be symlinks on the way).
+			 */
+			check_dirs[check_dirs_cnt].sd_mnt = -1;
+			mentry = mnt_find_path(dirs[i], flags & MS_NO_MNTPOINT, &exact);
+			if (mentry >= 0 && (exact || (stat(dirs[i], &st) == 0 && S_ISDIR(st.st_mode) &&
+			    st.st_dev == mnt_entries[mentry].me_dev))) {
+				check_dirs[check_dirs_cnt].sd_dir = 1;
+				check_dirs[check_dirs_cnt].sd_dev = mnt_entries[mentry].me_dev;
+				check_dirs[check_dirs_cnt].sd_mnt = mentry;
+				check_dirs[check_dirs_cnt].sd_name = sstrdup(mnt_entries[mentry].me__dir);
+				check_dirs_cnt++;
+				continue;
+			}
 			if (!strncmp(dirs[i], "UUID=", 5) || !strncmp(dirs[i], "LABEL=", 6)) {
 				char *devname = (char *)get_device_name(dirs[i]);
 
@@ -1158,11 +2173,8 @@ static int process_dirs(int dcnt, char **dirs, int flags)
 				}
 			}
 			else if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
-				int mentry;
-
 				check_dirs[check_dirs_cnt].sd_dev = st.st_rdev;
-				for (mentry = 0; mentry < mnt_entries_cnt && mnt_entries[mentry].me_dev != st.st_rdev; mentry++);
-				if (mentry == mnt_entries_cnt) {
+				if ((mentry = mnt_find_dev(st.st_rdev, 0, 0)) < 0) {
 					if (!(flags & MS_QUIET))
 						errstr(_("Cannot find mountpoint for device %s\n"), dirs[i]);
 					continue;
@@ -1180,6 +2192,7 @@ static int process_dirs(int dcnt, char **dirs, int flags)
 			if (!(flags & MS_QUIET))
 				errstr(_("No correct mountpoint specified.\n"));
 			free(check_dirs);
+			check_dirs = NULL;
 			return -1;
 		}
 	}
@@ -1223,16 +2236,9 @@ restart:
 	if (++act_checked == check_dirs_cnt)
 		return 0;
 	sd = check_dirs + act_checked;
-	for (i = 0; i < mnt_entries_cnt; i++) {
-		if (sd->sd_dir) {
-			if (sd->sd_dev == mnt_entries[i].me_dev && sd->sd_ino == mnt_entries[i].me_ino)
-				break;
-		}
-		else
-			if (sd->sd_dev == mnt_entries[i].me_dev)
-				break;
-	}
-	if (i == mnt_entries_cnt) {
+	if (sd->sd_mnt >= 0)
+		i = sd->sd_mnt;
+	else if ((i = mnt_find_dev(sd->sd_dev, sd->sd_ino, sd->sd_dir)) < 0) {
 		errstr(_("Mountpoint (or device) %s not found or has no quota enabled.\n"), sd->sd_name);
 		goto restart;
 	}
@@ -1261,21 +2267,13 @@ struct mount_entry *get_next_mount(void)
 }
 
 /*
- *	Free all structures allocated for mountpoint scan
+ *	Free all structures allocated for mountpoint scan. The mount table
+ *	itself is kept for following scans.
  */
 void end_mounts_scan(void)
 {
 	int i;
 
-	for (i = 0; i < mnt_entries_cnt; i++) {
-		free(mnt_entries[i].me_type);
-		free(mnt_entries[i].me_opts);
-		free((char *)mnt_entries[i].me_devname);
-		free((char *)mnt_entries[i].me__dir);
-	}
-	free(mnt_entries);
-	mnt_entries = NULL;
-	mnt_entries_cnt = 0;
 	if (check_dirs_cnt) {
 		for (i = 0; i < check_dirs_cnt; i++)
 			free((char *)check_dirs[i].sd_name);
@@ -1284,3 +2282,16 @@ void end_mounts_scan(void)
 	check_dirs = NULL;
 	check_dirs_cnt = 0;
 }
+
+/*
+ *	Return generation of the mount table. It changes whenever mounts
+ *	change so users can tell when information derived from it is stale.
+ */
+unsigned long mount_table_generation(void)
+{
+	if (mnt_entries && !mnt_table_valid(mnt_table_flags)) {
+		free_mnt_table();
+		mnt_table_gen++;
+	}
+	return mnt_table_gen;
+}
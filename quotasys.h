@@ -40,7 +40,7 @@ struct mount_entry {
 	char *me_type;		/* Type of filesystem for given entry */
 	char *me_opts;		/* Options of filesystem */
 	dev_t me_dev;		/* Device filesystem is mounted on */
-	ino_t me_ino;		/* Inode number of root of filesystem */
+	ino_t me_ino;		/* Inode number of root of filesystem (0 if not known yet) */
 	const char *me_devname;	/* Name of device (after pass through get_device_name()) */
 	const char *me__dir;	/* One mountpoint of a filesystem (strdup()ed) */
 	const char *me_dir;	/* Current mountpoint of a filesystem to process */
@@ -162,4 +162,7 @@ struct mount_entry *get_next_mount(void);
 /* Free all structures associated with mountpoints scan */
 void end_mounts_scan(void);
 
+/* Return number which changes whenever mounted filesystems change */
+unsigned long mount_table_generation(void);
+
 #endif /* GUARD_QUOTASYS_H */
@@ -18,14 +18,21 @@
 #include <pwd.h>
 #include <grp.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "pot.h"
 #include "common.h"
 #include "quotasys.h"
 #include "quotaio.h"
+#include "quotafilter.h"
 
 #define PRINTNAMELEN 9	/* Number of characters to be reserved for name on screen */
 #define MAX_CACHE_DQUOTS 1024	/* Number of dquots in cache */
+#define CACHE_HASH_SIZE (2*MAX_CACHE_DQUOTS)	/* Size of hash of cached dquots (power of two) */
+#define RESOLVE_RATIO 16	/* Resolve ids one by one when database is this many times larger than cache */
+#define RESOLVE_THREADS 8	/* Number of threads resolving ids */
+#define REPORT_THREADS 8	/* Number of quota files scanned in parallel */
 
 #define FL_USER 1
 #define FL_GROUP 2
@@ -37,17 +44,151 @@
 #define FL_NOCACHE 128	/* Don't cache dquots before resolving */
 #define FL_NOAUTOFS 256	/* Ignore autofs mountpoints */
 #define FL_RAWGRACE 512	/* Print grace times in seconds since epoch */
+#define FL_AGGREGATE 1024	/* Sum usage of each id over all filesystems */
+#define FL_AGGRDETAIL 2048	/* Print also usage on each filesystem in aggregated report */
+
+#define SORT_NONE 0	/* Print entries in the order of the quota file */
+#define SORT_SPACE 1	/* Largest space usage first */
+#define SORT_INODES 2	/* Largest inode usage first */
+#define SORT_PERCENT 3	/* Largest usage relative to a limit first */
+#define SORT_GRACE 4	/* Least grace time remaining first */
+
+#define OUT_DEFAULT 0	/* Human readable report */
+#define OUT_CSV 1	/* Comma separated values */
+#define OUT_JSON 2	/* One JSON object per line */
+#define OUT_BINARY 3	/* Fixed size records */
+
+#define OUTPUT_BUFSIZE (1 << 20)	/* Size of stdout buffer for machine readable output */
+#define OUTPUT_LINELEN (256 + 6 * MAXNAMELEN)	/* Maximal length of the line without device */
+
+#define RQ_BIN_MAGIC 0x52514231	/* "RQB1" */
+#define RQ_BIN_VERSION 1
+#define RQ_BIN_FILE 1	/* Tag of record starting report for one quota file */
+#define RQ_BIN_ENTRY 2	/* Tag of record with one entry */
+
+/* Header of binary output. All numbers are in host byte order. */
+struct rq_bin_header {
+	u_int32_t magic;
+	u_int32_t version;
+};
+
+/* Report for one quota file, devlen bytes of device name follow */
+struct rq_bin_file {
+	u_int32_t tag;
+	u_int32_t type;
+	u_int32_t devlen;
+	u_int32_t pad;
+	u_int64_t bgrace;	/* Grace periods in seconds */
+	u_int64_t igrace;
+};
+
+/* One entry. Space is in bytes, grace expiry in seconds since epoch (0 if not running). */
+struct rq_bin_entry {
+	u_int32_t tag;
+	u_int32_t id;
+	u_int64_t curspace;
+	u_int64_t bsoftlimit;
+	u_int64_t bhardlimit;
+	u_int64_t btime;
+	u_int64_t curinodes;
+	u_int64_t isoftlimit;
+	u_int64_t ihardlimit;
+	u_int64_t itime;
+};
 
 static int flags, fmt = -1;
+static int ofmt = OUT_DEFAULT;
+static int sort_key = SORT_NONE;
+static int top_count;		/* Report only this many entries with the highest sort key (0 = all) */
+static time_t report_time;	/* Current time for checking grace times */
+static struct quota_filter *filter;	/* Report only entries matching the filter */
 static char **mnt;
 static int mntcnt;
-static int cached_dquots;
-static struct dquot dquot_cache[MAX_CACHE_DQUOTS];
+
+/* Report of one quota file. Reports are built in parallel and printed in the order of handles. */
+struct report {
+	struct quota_handle *h;
+	int type;
+	FILE *out;		/* Stream the report is buffered in */
+	char *buf;		/* Buffer of the stream */
+	size_t len;
+	int failed;		/* Scanning of the quota file failed */
+	int done;		/* Report is complete */
+	char *row_prefix;	/* Start of each line with type and device in machine readable output */
+	int row_prefix_len;
+	int cached_dquots;
+	struct dquot dquot_cache[MAX_CACHE_DQUOTS];
+	int cache_hash[CACHE_HASH_SIZE];	/* Index + 1 of cached dquot, 0 for free slot */
+	char cache_names[MAX_CACHE_DQUOTS][MAXNAMELEN];	/* Names of directly resolved dquots */
+	struct selected *sel;	/* Entries selected for sorted report (a min-heap with --top) */
+	int sel_cnt, sel_alloc;
+};
+
+/* Entry kept for sorted report */
+struct selected {
+	struct dquot dquot;
+	char *name;		/* Name passed by scan_dquots() or NULL */
+};
+
+/* Usage of an id on one filesystem in detailed aggregated report */
+struct agg_detail {
+	struct quota_handle *h;
+	struct util_dqblk dqb;
+	struct agg_detail *next;
+};
+
+/* Usage of an id summed over all filesystems */
+struct aggregate {
+	qid_t id;
+	int used;
+	char *name;		/* Name passed by scan_dquots() or NULL */
+	qsize_t space, inodes;
+	int fs;			/* Number of filesystems the id has entry on */
+	int over_soft, over_hard;	/* Number of filesystems with exceeded limit */
+	time_t grace;		/* Earliest grace expiry, 0 if no grace period is running */
+	double ratio;		/* Maximal usage relative to a limit */
+	struct agg_detail *detail, **detail_tail;
+};
+
+static struct aggregate *agg_table;	/* Hash of aggregates by id */
+static unsigned int agg_size, agg_used;
+
+static __thread struct report *cur_report;	/* Report the thread is building, for output() */
+/* Serializes use of passwd and group databases and id_index */
+static pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Protects done flags of reports and next_report */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t report_done = PTHREAD_COND_INITIALIZER;
+static struct report **reports;
+static int next_report;		/* First report no worker has started yet */
+
+/* Position of an id in the passwd / group database */
+struct id_pos {
+	qid_t id;
+	long pos;	/* Position + 1, 0 for free slot */
+};
+
+/* Positions of ids in the database so that directly resolved ids can be printed in its order */
+struct id_index {
+	struct id_pos *table;
+	long size;	/* Size of the table (power of two) */
+	long used;	/* Number of used slots */
+	long entries;	/* Number of entries in the database */
+	int built;	/* Was the database enumerated? */
+};
+static struct id_index id_index[MAXQUOTAS];
+
+/* Arguments of a thread resolving ids */
+struct resolve_arg {
+	pthread_t thread;
+	struct report *r;
+	int first;	/* First dquot to resolve, the thread handles every RESOLVE_THREADS-th one */
+};
 char *progname;
 
 static void usage(void)
 {
-	errstr(_("Utility for reporting quotas.\nUsage:\n%s [-vugsi] [-c|C] [-t|n] [-F quotaformat] (-a | mntpoint)\n\n\
+	errstr(_("Utility for reporting quotas.\nUsage:\n%s [-vugsi] [-c|C] [-t|n] [-F quotaformat] [-O format] [--sort=key] [--top=n] [--filter=expr] [--aggregate[=detail]] (-a | mntpoint)\n\n\
 -v, --verbose               display also users/groups without any usage\n\
 -u, --user                  display information about users\n\
 -g, --group                 display information about groups\n\
@@ -59,6 +200,11 @@ static void usage(void)
 -c, --batch-translation     translate big number of ids at once\n\
 -C, --no-batch-translation  translate ids one by one\n\
 -F, --format=formatname     report information for specific format\n\
+-O, --output=format         output format: default, csv, json or binary\n\
+    --sort=key              sort entries by space, inodes, percent or grace\n\
+    --top=n                 report only n entries with the highest sort key\n\
+    --filter=expr           report only entries matching the filter\n\
+    --aggregate[=detail]    sum usage of each id over all filesystems\n\
 -h, --help                  display this help message and exit\n\
 -V, --version               display version information and exit\n\n"), progname);
 	fprintf(stderr, _("Bugs to %s\n"), MY_EMAIL);
@@ -84,10 +230,15 @@ static void parse_options(int argcnt, char **argstr)
 		{ "no-cache", 0, NULL, 'C' },
 		{ "no-autofs", 0, NULL, 'i' },
 		{ "format", 1, NULL, 'F' },
+		{ "output", 1, NULL, 'O' },
+		{ "sort", 1, NULL, 256 },
+		{ "top", 1, NULL, 257 },
+		{ "filter", 1, NULL, 258 },
+		{ "aggregate", 2, NULL, 259 },
 		{ NULL, 0, NULL, 0 }
 	};
 
-	while ((ret = getopt_long(argcnt, argstr, "VavughtspncCiF:", long_opts, NULL)) != -1) {
+	while ((ret = getopt_long(argcnt, argstr, "VavughtspncCiF:O:", long_opts, NULL)) != -1) {
 		switch (ret) {
 			case '?':
 			case 'h':
@@ -133,6 +284,58 @@ static void parse_options(int argcnt, char **argstr)
 			case 'n':
 				flags |= FL_NONAME;
 				break;
+			case 256:
+				if (!strcmp(optarg, "space"))
+					sort_key = SORT_SPACE;
+				else if (!strcmp(optarg, "inodes"))
+					sort_key = SORT_INODES;
+				else if (!strcmp(optarg, "percent"))
+					sort_key = SORT_PERCENT;
+				else if (!strcmp(optarg, "grace"))
+					sort_key = SORT_GRACE;
+				else {
+					errstr(_("Unknown sort key: %s\n"), optarg);
+					usage();
+				}
+				break;
+			case 257: {
+				char *end;
+
+				top_count = strtol(optarg, &end, 10);
+				if (*end || top_count <= 0) {
+					errstr(_("Bad number of entries: %s\n"), optarg);
+					usage();
+				}
+				break;
+			}
+			case 258:
+				if (!(filter = compile_quota_filter(optarg)))
+					exit(1);
+				break;
+			case 259:
+				flags |= FL_AGGREGATE;
+				if (optarg) {
+					if (strcmp(optarg, "detail")) {
+						errstr(_("Unknown aggregation mode: %s\n"), optarg);
+						usage();
+					}
+					flags |= FL_AGGRDETAIL;
+				}
+				break;
+			case 'O':
+				if (!strcmp(optarg, "default"))
+					ofmt = OUT_DEFAULT;
+				else if (!strcmp(optarg, "csv"))
+					ofmt = OUT_CSV;
+				else if (!strcmp(optarg, "json"))
+					ofmt = OUT_JSON;
+				else if (!strcmp(optarg, "binary"))
+					ofmt = OUT_BINARY;
+				else {
+					errstr(_("Unknown output format: %s\n"), optarg);
+					usage();
+				}
+				break;
 
 		}
 	}
@@ -149,6 +352,16 @@ static void parse_options(int argcnt, char **argstr)
 		fputs(_("Specified both -n and -t but only one of them can be used.\n"), stderr);
 		exit(1);
 	}
+	if (flags & FL_AGGREGATE && ofmt == OUT_BINARY) {
+		fputs(_("Aggregated report cannot be printed in binary format.\n"), stderr);
+		exit(1);
+	}
+	if (top_count && sort_key == SORT_NONE)
+		sort_key = SORT_SPACE;
+	report_time = time(NULL);
+	/* Binary records carry just ids so don't waste time on translation */
+	if (ofmt == OUT_BINARY)
+		flags |= FL_NONAME;
 	if (!(flags & (FL_USER | FL_GROUP)))
 		flags |= FL_USER;
 	if (!(flags & FL_ALL)) {
@@ -167,8 +380,191 @@ static char overlim(qsize_t usage, qsize_t softlim, qsize_t hardlim)
 	return '-';
 }
 
+/* Append decimal representation of a number */
+static char *put_num(char *p, unsigned long long num)
+{
+	char tmp[24];
+	int i = 0;
+
+	do {
+		tmp[i++] = '0' + num % 10;
+		num /= 10;
+	} while (num);
+	while (i)
+		*p++ = tmp[--i];
+	return p;
+}
+
+/* Append string quoted for CSV if needed */
+static char *put_csv_str(char *p, const char *str)
+{
+	if (!strpbrk(str, ",\"\r\n"))
+		return stpcpy(p, str);
+	*p++ = '"';
+	for (; *str; str++) {
+		if (*str == '"')
+			*p++ = '"';
+		*p++ = *str;
+	}
+	*p++ = '"';
+	return p;
+}
+
+/* Append string as a JSON string */
+static char *put_json_str(char *p, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	*p++ = '"';
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		}
+		else if (c < 0x20) {
+			p = stpcpy(p, "\\u00");
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 15];
+		}
+		else
+			*p++ = c;
+	}
+	*p++ = '"';
+	return p;
+}
+
+static void write_output(FILE *out, const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, out) != len)
+		die(1, _("Cannot write output: %s\n"), strerror(errno));
+}
+
+/* Start output of one quota file in machine readable format */
+static void start_structured(struct report *r)
+{
+	const char *dev = r->h->qh_quotadev;
+	int type = r->type;
+	char *p;
+
+	r->row_prefix = smalloc(32 + 6 * strlen(dev));
+	p = r->row_prefix;
+	if (ofmt == OUT_CSV) {
+		p = stpcpy(p, type2name(type));
+		*p++ = ',';
+		p = put_csv_str(p, dev);
+		*p++ = ',';
+	}
+	else if (ofmt == OUT_JSON) {
+		p = stpcpy(p, "{\"type\":\"");
+		p = stpcpy(p, type2name(type));
+		p = stpcpy(p, "\",\"device\":");
+		p = put_json_str(p, dev);
+		*p++ = ',';
+	}
+	else {
+		struct rq_bin_file rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.tag = RQ_BIN_FILE;
+		rec.type = type;
+		rec.devlen = strlen(dev);
+		rec.bgrace = r->h->qh_info.dqi_bgrace;
+		rec.igrace = r->h->qh_info.dqi_igrace;
+		write_output(r->out, &rec, sizeof(rec));
+		write_output(r->out, dev, rec.devlen);
+	}
+	r->row_prefix_len = p - r->row_prefix;
+}
+
+/* Print one entry in machine readable format */
+static void print_structured(struct report *r, struct dquot *dquot, char *name)
+{
+	struct util_dqblk *entry = &dquot->dq_dqb;
+	u_int64_t btime = 0, itime = 0;
+	char line[OUTPUT_LINELEN], *p = line;
+
+	/* Grace time is running only when softlimit is exceeded */
+	if (entry->dqb_bsoftlimit && toqb(entry->dqb_curspace) >= entry->dqb_bsoftlimit)
+		btime = entry->dqb_btime;
+	if (entry->dqb_isoftlimit && entry->dqb_curinodes >= entry->dqb_isoftlimit)
+		itime = entry->dqb_itime;
+	/* Unresolved ids are passed as #id */
+	if (name[0] == '#')
+		name = NULL;
+
+	if (ofmt == OUT_BINARY) {
+		struct rq_bin_entry rec;
+
+		rec.tag = RQ_BIN_ENTRY;
+		rec.id = dquot->dq_id;
+		rec.curspace = entry->dqb_curspace;
+		rec.bsoftlimit = entry->dqb_bsoftlimit << QUOTABLOCK_BITS;
+		rec.bhardlimit = entry->dqb_bhardlimit << QUOTABLOCK_BITS;
+		rec.btime = btime;
+		rec.curinodes = entry->dqb_curinodes;
+		rec.isoftlimit = entry->dqb_isoftlimit;
+		rec.ihardlimit = entry->dqb_ihardlimit;
+		rec.itime = itime;
+		write_output(r->out, &rec, sizeof(rec));
+		return;
+	}
+	write_output(r->out, r->row_prefix, r->row_prefix_len);
+	if (ofmt == OUT_CSV) {
+		p = put_num(p, dquot->dq_id);
+		*p++ = ',';
+		if (name)
+			p = put_csv_str(p, name);
+		*p++ = ',';
+		p = put_num(p, entry->dqb_curspace);
+		*p++ = ',';
+		p = put_num(p, entry->dqb_bsoftlimit << QUOTABLOCK_BITS);
+		*p++ = ',';
+		p = put_num(p, entry->dqb_bhardlimit << QUOTABLOCK_BITS);
+		*p++ = ',';
+		p = put_num(p, btime);
+		*p++ = ',';
+		p = put_num(p, entry->dqb_curinodes);
+		*p++ = ',';
+		p = put_num(p, entry->dqb_isoftlimit);
+		*p++ = ',';
+		p = put_num(p, entry->dqb_ihardlimit);
+		*p++ = ',';
+		p = put_num(p, itime);
+		*p++ = '\n';
+	}
+	else {
+		p = stpcpy(p, "\"id\":");
+		p = put_num(p, dquot->dq_id);
+		p = stpcpy(p, ",\"name\":");
+		if (name)
+			p = put_json_str(p, name);
+		else
+			p = stpcpy(p, "null");
+		p = stpcpy(p, ",\"space_used\":");
+		p = put_num(p, entry->dqb_curspace);
+		p = stpcpy(p, ",\"space_soft\":");
+		p = put_num(p, entry->dqb_bsoftlimit << QUOTABLOCK_BITS);
+		p = stpcpy(p, ",\"space_hard\":");
+		p = put_num(p, entry->dqb_bhardlimit << QUOTABLOCK_BITS);
+		p = stpcpy(p, ",\"space_grace\":");
+		p = put_num(p, btime);
+		p = stpcpy(p, ",\"inodes_used\":");
+		p = put_num(p, entry->dqb_curinodes);
+		p = stpcpy(p, ",\"inodes_soft\":");
+		p = put_num(p, entry->dqb_isoftlimit);
+		p = stpcpy(p, ",\"inodes_hard\":");
+		p = put_num(p, entry->dqb_ihardlimit);
+		p = stpcpy(p, ",\"inodes_grace\":");
+		p = put_num(p, itime);
+		p = stpcpy(p, "}\n");
+	}
+	write_output(r->out, line, p - line);
+}
+
 /* Print one quota entry */
-static void print(struct dquot *dquot, char *name)
+static void print(struct report *r, struct dquot *dquot, char *name)
 {
 	char pname[MAXNAMELEN];
 	char time[MAXTIMELEN];
@@ -178,6 +574,10 @@ static void print(struct dquot *dquot, char *name)
 
 	if (!entry->dqb_curspace && !entry->dqb_curinodes && !(flags & FL_VERBOSE))
 		return;
+	if (ofmt != OUT_DEFAULT) {
+		print_structured(r, dquot, name);
+		return;
+	}
 	sstrncpy(pname, name, sizeof(pname));
 	if (flags & FL_TRUNCNAMES)
 		pname[PRINTNAMELEN] = 0;
@@ -194,7 +594,7 @@ static void print(struct dquot *dquot, char *name)
 	space2str(toqb(entry->dqb_curspace), numbuf[0], flags & FL_SHORTNUMS);
 	space2str(entry->dqb_bsoftlimit, numbuf[1], flags & FL_SHORTNUMS);
 	space2str(entry->dqb_bhardlimit, numbuf[2], flags & FL_SHORTNUMS);
-	printf("%-*s %c%c %7s %7s %7s %6s", PRINTNAMELEN, pname,
+	fprintf(r->out, "%-*s %c%c %7s %7s %7s %6s", PRINTNAMELEN, pname,
 	       overlim(qb2kb(toqb(entry->dqb_curspace)), qb2kb(entry->dqb_bsoftlimit), qb2kb(entry->dqb_bhardlimit)),
 	       overlim(entry->dqb_curinodes, entry->dqb_isoftlimit, entry->dqb_ihardlimit),
 	       numbuf[0], numbuf[1], numbuf[2], time);
@@ -211,26 +611,94 @@ static void print(struct dquot *dquot, char *name)
 	number2str(entry->dqb_curinodes, numbuf[0], flags & FL_SHORTNUMS);
 	number2str(entry->dqb_isoftlimit, numbuf[1], flags & FL_SHORTNUMS);
 	number2str(entry->dqb_ihardlimit, numbuf[2], flags & FL_SHORTNUMS);
-	printf(" %7s %5s %5s %6s\n", numbuf[0], numbuf[1], numbuf[2], time);
+	fprintf(r->out, " %7s %5s %5s %6s\n", numbuf[0], numbuf[1], numbuf[2], time);
 }
 
-/* Print all dquots in the cache */
-static void dump_cached_dquots(int type)
+static inline unsigned int hash_id(qid_t id)
 {
+	return id * 2654435761U;
+}
+
+/* Find first cached dquot with given id */
+static int cache_lookup(struct report *r, qid_t id)
+{
+	unsigned int h;
+
+	for (h = hash_id(id) & (CACHE_HASH_SIZE - 1); r->cache_hash[h]; h = (h + 1) & (CACHE_HASH_SIZE - 1))
+		if (r->dquot_cache[r->cache_hash[h] - 1].dq_id == id)
+			return r->cache_hash[h] - 1;
+	return -1;
+}
+
+static void cache_insert(struct report *r, int i)
+{
+	unsigned int h;
+
+	for (h = hash_id(r->dquot_cache[i].dq_id) & (CACHE_HASH_SIZE - 1); r->cache_hash[h]; h = (h + 1) & (CACHE_HASH_SIZE - 1))
+		if (r->dquot_cache[r->cache_hash[h] - 1].dq_id == r->dquot_cache[i].dq_id)
+			return;
+	r->cache_hash[h] = i + 1;
+}
+
+/* Return position of id in the database or -1 when it isn't there */
+static long id_index_find(struct id_index *idx, qid_t id)
+{
+	long h;
+
+	if (!idx->size)
+		return -1;
+	for (h = hash_id(id) & (idx->size - 1); idx->table[h].pos; h = (h + 1) & (idx->size - 1))
+		if (idx->table[h].id == id)
+			return idx->table[h].pos - 1;
+	return -1;
+}
+
+/* Remember position of id, the first occurrence wins */
+static void id_index_add(struct id_index *idx, qid_t id, long pos)
+{
+	long h;
+
+	if ((idx->used + 1) * 2 > idx->size) {
+		struct id_pos *old = idx->table;
+		long oldsize = idx->size, i;
+
+		idx->size = oldsize ? oldsize * 2 : 1024;
+		idx->table = smalloc(idx->size * sizeof(struct id_pos));
+		memset(idx->table, 0, idx->size * sizeof(struct id_pos));
+		for (i = 0; i < oldsize; i++) {
+			if (!old[i].pos)
+				continue;
+			for (h = hash_id(old[i].id) & (idx->size - 1); idx->table[h].pos; h = (h + 1) & (idx->size - 1));
+			idx->table[h] = old[i];
+		}
+		free(old);
+	}
+	for (h = hash_id(id) & (idx->size - 1); idx->table[h].pos; h = (h + 1) & (idx->size - 1))
+		if (idx->table[h].id == id)
+			return;
+	idx->table[h].id = id;
+	idx->table[h].pos = pos + 1;
+	idx->used++;
+}
+
+/* Scan the whole database and print cached dquots in its order */
+static void enumerate_cached_dquots(struct report *r)
+{
+	struct id_index *idx = id_index + r->type;
+	long pos = 0;
 	int i;
-	char namebuf[MAXNAMELEN];
 
-	if (!cached_dquots)
-		return;
-	if (type == USRQUOTA) {
+	if (r->type == USRQUOTA) {
 		struct passwd *pwent;
 
 		setpwent();
 		while ((pwent = getpwent())) {
-			for (i = 0; i < cached_dquots && pwent->pw_uid != dquot_cache[i].dq_id; i++);
-			if (i < cached_dquots && !(dquot_cache[i].dq_flags & DQ_PRINTED)) {
-				print(dquot_cache+i, pwent->pw_name);
-				dquot_cache[i].dq_flags |= DQ_PRINTED;
+			if (!idx->built)
+				id_index_add(idx, pwent->pw_uid, pos++);
+			i = cache_lookup(r, pwent->pw_uid);
+			if (i >= 0 && !(r->dquot_cache[i].dq_flags & DQ_PRINTED)) {
+				print(r, r->dquot_cache+i, pwent->pw_name);
+				r->dquot_cache[i].dq_flags |= DQ_PRINTED;
 			}
 		}
 		endpwent();
@@ -240,88 +708,845 @@ static void dump_cached_dquots(int type)
 
 		setgrent();
 		while ((grent = getgrent())) {
-			for (i = 0; i < cached_dquots && grent->gr_gid != dquot_cache[i].dq_id; i++);
-			if (i < cached_dquots && !(dquot_cache[i].dq_flags & DQ_PRINTED)) {
-				print(dquot_cache+i, grent->gr_name);
-				dquot_cache[i].dq_flags |= DQ_PRINTED;
+			if (!idx->built)
+				id_index_add(idx, grent->gr_gid, pos++);
+			i = cache_lookup(r, grent->gr_gid);
+			if (i >= 0 && !(r->dquot_cache[i].dq_flags & DQ_PRINTED)) {
+				print(r, r->dquot_cache+i, grent->gr_name);
+				r->dquot_cache[i].dq_flags |= DQ_PRINTED;
 			}
 		}
 		endgrent();
 	}
-	for (i = 0; i < cached_dquots; i++)
-		if (!(dquot_cache[i].dq_flags & DQ_PRINTED)) {
-			sprintf(namebuf, "#%u", dquot_cache[i].dq_id);
-			print(dquot_cache+i, namebuf);
+	if (!idx->built) {
+		idx->entries = pos;
+		idx->built = 1;
+	}
+}
+
+/* Thread resolving part of cached ids which were not printed yet. Unresolved ids get empty name. */
+static void *resolve_ids(void *arg)
+{
+	struct resolve_arg *ra = arg;
+	struct report *r = ra->r;
+	size_t buflen = 1024;
+	char *buf = smalloc(buflen);
+	int i, err;
+
+	for (i = ra->first; i < r->cached_dquots; i += RESOLVE_THREADS) {
+		r->cache_names[i][0] = 0;
+		if (r->dquot_cache[i].dq_flags & DQ_PRINTED)
+			continue;
+		do {
+			if (r->type == USRQUOTA) {
+				struct passwd pw, *res;
+
+				err = getpwuid_r(r->dquot_cache[i].dq_id, &pw, buf, buflen, &res);
+				if (!err && res)
+					sstrncpy(r->cache_names[i], pw.pw_name, MAXNAMELEN);
+			}
+			else {
+				struct group gr, *res;
+
+				err = getgrgid_r(r->dquot_cache[i].dq_id, &gr, buf, buflen, &res);
+				if (!err && res)
+					sstrncpy(r->cache_names[i], gr.gr_name, MAXNAMELEN);
+			}
+			if (err == ERANGE) {
+				buflen *= 2;
+				buf = srealloc(buf, buflen);
+			}
+		} while (err == ERANGE);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Cached dquot with its position in the database */
+struct cache_pos {
+	long pos;
+	int idx;
+};
+
+static int cmp_cache_pos(const void *a, const void *b)
+{
+	const struct cache_pos *pa = a, *pb = b;
+
+	if (pa->pos != pb->pos)
+		return pa->pos < pb->pos ? -1 : 1;
+	return pa->idx - pb->idx;
+}
+
+/* Resolve just the cached ids not printed yet and print them in the order of the database */
+static void resolve_cached_dquots(struct report *r)
+{
+	struct resolve_arg ra[RESOLVE_THREADS];
+	struct cache_pos order[MAX_CACHE_DQUOTS];
+	int threads = r->cached_dquots < RESOLVE_THREADS ? r->cached_dquots : RESOLVE_THREADS;
+	int i, cnt = 0;
+
+	for (i = 0; i < threads; i++) {
+		ra[i].r = r;
+		ra[i].first = i;
+	}
+	/* The first part is resolved by us, parts of threads we failed to create as well */
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&ra[i].thread, NULL, resolve_ids, ra + i))
+			ra[i].first = -1;
+	resolve_ids(ra);
+	for (i = 1; i < threads; i++) {
+		if (ra[i].first < 0) {
+			ra[i].first = i;
+			resolve_ids(ra + i);
+		}
+		else
+			pthread_join(ra[i].thread, NULL);
+	}
+
+	for (i = 0; i < r->cached_dquots; i++) {
+		if (!r->cache_names[i][0] || cache_lookup(r, r->dquot_cache[i].dq_id) != i)
+			continue;
+		order[cnt].pos = id_index_find(id_index + r->type, r->dquot_cache[i].dq_id);
+		/* Ids added to the database after we have enumerated it go last */
+		if (order[cnt].pos < 0)
+			order[cnt].pos = LONG_MAX;
+		order[cnt++].idx = i;
+	}
+	qsort(order, cnt, sizeof(struct cache_pos), cmp_cache_pos);
+	for (i = 0; i < cnt; i++) {
+		print(r, r->dquot_cache+order[i].idx, r->cache_names[order[i].idx]);
+		r->dquot_cache[order[i].idx].dq_flags |= DQ_PRINTED;
+	}
+}
+
+/*
+ * Print all dquots in the cache. The first time the database is enumerated
+ * and positions of ids are remembered. When the database turns out to be
+ * much larger than the cache, later batches resolve just the cached ids.
+ * Ids the enumeration did not return are resolved directly as well so
+ * that all batches name ids the same way.
+ */
+static void dump_cached_dquots(struct report *r)
+{
+	int i;
+	char namebuf[MAXNAMELEN];
+
+	if (!r->cached_dquots)
+		return;
+	pthread_mutex_lock(&name_lock);
+	if (id_index[r->type].built && (long)r->cached_dquots * RESOLVE_RATIO <= id_index[r->type].entries)
+		resolve_cached_dquots(r);
+	else {
+		enumerate_cached_dquots(r);
+		for (i = 0; i < r->cached_dquots; i++)
+			if (!(r->dquot_cache[i].dq_flags & DQ_PRINTED)) {
+				resolve_cached_dquots(r);
+				break;
+			}
+	}
+	pthread_mutex_unlock(&name_lock);
+	for (i = 0; i < r->cached_dquots; i++)
+		if (!(r->dquot_cache[i].dq_flags & DQ_PRINTED)) {
+			sprintf(namebuf, "#%u", r->dquot_cache[i].dq_id);
+			print(r, r->dquot_cache+i, namebuf);
+		}
+	memset(r->cache_hash, 0, sizeof(r->cache_hash));
+	r->cached_dquots = 0;
+}
+
+/* Usage relative to the lower nonzero limit, 0 without limits */
+static double usage_ratio(qsize_t usage, qsize_t softlim, qsize_t hardlim)
+{
+	qsize_t lim = softlim && (!hardlim || softlim < hardlim) ? softlim : hardlim;
+
+	if (!lim)
+		return 0;
+	return (double)usage / lim;
+}
+
+static double dquot_ratio(struct util_dqblk *d)
+{
+	double bratio = usage_ratio(toqb(d->dqb_curspace), d->dqb_bsoftlimit, d->dqb_bhardlimit);
+	double iratio = usage_ratio(d->dqb_curinodes, d->dqb_isoftlimit, d->dqb_ihardlimit);
+
+	return bratio > iratio ? bratio : iratio;
+}
+
+/* Time when the first running grace period expires, 0 if none is running */
+static time_t grace_expiry(struct util_dqblk *d)
+{
+	time_t expiry = 0;
+
+	if (d->dqb_bsoftlimit && toqb(d->dqb_curspace) >= d->dqb_bsoftlimit && d->dqb_btime)
+		expiry = d->dqb_btime;
+	if (d->dqb_isoftlimit && d->dqb_curinodes >= d->dqb_isoftlimit && d->dqb_itime &&
+	    (!expiry || d->dqb_itime < expiry))
+		expiry = d->dqb_itime;
+	return expiry;
+}
+
+/* Compare entries by sort key. Positive when a should be reported before b. */
+static int cmp_selected(struct dquot *a, struct dquot *b)
+{
+	struct util_dqblk *da = &a->dq_dqb, *db = &b->dq_dqb;
+
+	switch (sort_key) {
+		case SORT_SPACE:
+			if (da->dqb_curspace != db->dqb_curspace)
+				return da->dqb_curspace > db->dqb_curspace ? 1 : -1;
+			break;
+		case SORT_INODES:
+			if (da->dqb_curinodes != db->dqb_curinodes)
+				return da->dqb_curinodes > db->dqb_curinodes ? 1 : -1;
+			break;
+		case SORT_PERCENT: {
+			double ra = dquot_ratio(da), rb = dquot_ratio(db);
+
+			if (ra != rb)
+				return ra > rb ? 1 : -1;
+			break;
+		}
+		case SORT_GRACE: {
+			/* Expired grace has negative remaining time, entries without grace go last */
+			time_t ea = grace_expiry(da), eb = grace_expiry(db);
+
+			if (ea != eb) {
+				if (!ea || !eb)
+					return ea ? 1 : -1;
+				return ea - report_time < eb - report_time ? 1 : -1;
+			}
+			break;
+		}
+	}
+	/* Lower id first to make the order stable */
+	if (a->dq_id != b->dq_id)
+		return a->dq_id < b->dq_id ? 1 : -1;
+	return 0;
+}
+
+static void sel_swap(struct selected *a, struct selected *b)
+{
+	struct selected tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
+/* Restore min-heap property from position i downwards */
+static void sel_sift_down(struct report *r, int i)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < r->sel_cnt) {
+		if (child + 1 < r->sel_cnt && cmp_selected(&r->sel[child + 1].dquot, &r->sel[child].dquot) < 0)
+			child++;
+		if (cmp_selected(&r->sel[child].dquot, &r->sel[i].dquot) >= 0)
+			break;
+		sel_swap(r->sel + i, r->sel + child);
+		i = child;
+	}
+}
+
+/* Append dquot to entries kept for the report */
+static void append_selected(struct report *r, struct dquot *dquot, char *name)
+{
+	if (r->sel_cnt == r->sel_alloc) {
+		r->sel_alloc = r->sel_alloc ? r->sel_alloc * 2 : 64;
+		if (top_count && r->sel_alloc > top_count && !(flags & FL_AGGREGATE))
+			r->sel_alloc = top_count;
+		r->sel = srealloc(r->sel, r->sel_alloc * sizeof(struct selected));
+	}
+	memcpy(&r->sel[r->sel_cnt].dquot, dquot, sizeof(struct dquot));
+	r->sel[r->sel_cnt++].name = name ? sstrdup(name) : NULL;
+}
+
+/*
+ * Remember dquot for sorted report. With --top only top_count entries are
+ * kept in a min-heap so the least important one is replaced cheaply.
+ */
+static void select_dquot(struct report *r, struct dquot *dquot, char *name)
+{
+	int i;
+
+	if (top_count && r->sel_cnt == top_count) {
+		if (cmp_selected(dquot, &r->sel[0].dquot) <= 0)
+			return;
+		free(r->sel[0].name);
+		memcpy(&r->sel[0].dquot, dquot, sizeof(struct dquot));
+		r->sel[0].name = name ? sstrdup(name) : NULL;
+		sel_sift_down(r, 0);
+		return;
+	}
+	append_selected(r, dquot, name);
+	i = r->sel_cnt - 1;
+	if (!top_count)
+		return;
+	/* Sift up */
+	while (i > 0 && cmp_selected(&r->sel[i].dquot, &r->sel[(i - 1) / 2].dquot) < 0) {
+		sel_swap(r->sel + i, r->sel + (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static int cmp_selected_desc(const void *a, const void *b)
+{
+	return cmp_selected((struct dquot *)&((struct selected *)b)->dquot,
+			    (struct dquot *)&((struct selected *)a)->dquot);
+}
+
+/* Sort selected entries, translate their names and print them */
+static void print_selected(struct report *r)
+{
+	char namebuf[MAXNAMELEN];
+	int i;
+
+	if (r->sel_cnt)
+		qsort(r->sel, r->sel_cnt, sizeof(struct selected), cmp_selected_desc);
+	for (i = 0; i < r->sel_cnt; i++) {
+		char *name = r->sel[i].name;
+
+		if (!name) {
+			if (flags & FL_NONAME)
+				sprintf(namebuf, "#%u", r->sel[i].dquot.dq_id);
+			else {
+				pthread_mutex_lock(&name_lock);
+				id2name(r->sel[i].dquot.dq_id, r->type, namebuf);
+				pthread_mutex_unlock(&name_lock);
+			}
+			name = namebuf;
 		}
-	cached_dquots = 0;
+		print(r, &r->sel[i].dquot, name);
+		free(r->sel[i].name);
+	}
+	free(r->sel);
+	r->sel = NULL;
+	r->sel_cnt = r->sel_alloc = 0;
 }
 
 /* Callback routine called by scan_dquots on each dquot */
 static int output(struct dquot *dquot, char *name)
 {
+	struct report *r = cur_report;
+
+	if (filter && !quota_filter_match(filter, dquot, report_time))
+		return 0;
+	if (flags & FL_AGGREGATE) {
+		/* Entries are merged with other filesystems once all scans are done */
+		if (dquot->dq_dqb.dqb_curspace || dquot->dq_dqb.dqb_curinodes || flags & FL_VERBOSE)
+			append_selected(r, dquot, name);
+		return 0;
+	}
+	if (sort_key != SORT_NONE) {
+		/* Entries which wouldn't be printed mustn't take place of others */
+		if (dquot->dq_dqb.dqb_curspace || dquot->dq_dqb.dqb_curinodes || flags & FL_VERBOSE)
+			select_dquot(r, dquot, name);
+		return 0;
+	}
+
 	if (flags & FL_NONAME) {	/* We should translate names? */
 		char namebuf[MAXNAMELEN];
 
 		sprintf(namebuf, "#%u", dquot->dq_id);
-		print(dquot, namebuf);
+		print(r, dquot, namebuf);
 	}
 	else if (name || flags & FL_NOCACHE) {	/* We shouldn't do batched id->name translations? */
 		char namebuf[MAXNAMELEN];
 
 		if (!name) {
+			pthread_mutex_lock(&name_lock);
 			id2name(dquot->dq_id, dquot->dq_h->qh_type, namebuf);
+			pthread_mutex_unlock(&name_lock);
 			name = namebuf;
 		}
-		print(dquot, name);
+		print(r, dquot, name);
 	}
 	else {	/* Lets cache the dquot for later printing */
-		memcpy(dquot_cache+cached_dquots++, dquot, sizeof(struct dquot));
-		if (cached_dquots >= MAX_CACHE_DQUOTS)
-			dump_cached_dquots(dquot->dq_h->qh_type);
+		memcpy(r->dquot_cache+r->cached_dquots, dquot, sizeof(struct dquot));
+		cache_insert(r, r->cached_dquots++);
+		if (r->cached_dquots >= MAX_CACHE_DQUOTS)
+			dump_cached_dquots(r);
 	}
 	return 0;
 }
 
-/* Dump information stored in one quota file */
-static void report_it(struct quota_handle *h, int type)
+static int scan_report(struct report *r)
 {
-	char bgbuf[MAXTIMELEN], igbuf[MAXTIMELEN];
-	char *spacehdr;
+	struct quota_handle *h = r->h;
+	int ret;
 
-	if (flags & FL_SHORTNUMS)
-		spacehdr = _("Space");
+	/* These formats scan by going through the passwd / group database */
+	if (h->qh_fmt == QF_XFS || h->qh_fmt == QF_META) {
+		pthread_mutex_lock(&name_lock);
+		ret = h->qh_ops->scan_dquots(h, output);
+		pthread_mutex_unlock(&name_lock);
+	}
 	else
-		spacehdr = _("Block");
+		ret = h->qh_ops->scan_dquots(h, output);
+	return ret;
+}
 
-	printf(_("*** Report for %s quotas on device %s\n"), _(type2name(type)), h->qh_quotadev);
-	time2str(h->qh_info.dqi_bgrace, bgbuf, TF_ROUND);
-	time2str(h->qh_info.dqi_igrace, igbuf, TF_ROUND);
-	printf(_("Block grace time: %s; Inode grace time: %s\n"), bgbuf, igbuf);
-	printf(_("                        %s limits                File limits\n"), spacehdr);
-	printf(_("%-9s       used    soft    hard  grace    used  soft  hard  grace\n"), (type == USRQUOTA)?_("User"):_("Group"));
-	printf("----------------------------------------------------------------------\n");
+/* Build report of one quota file into its buffer */
+static void build_report(struct report *r)
+{
+	struct quota_handle *h = r->h;
+	int type = r->type, ret;
 
-	if (h->qh_ops->scan_dquots(h, output) < 0)
+	if (flags & FL_AGGREGATE) {
+		cur_report = r;
+		if (scan_report(r) < 0)
+			r->failed = 1;
+		cur_report = NULL;
 		return;
-	dump_cached_dquots(type);
-	if (h->qh_ops->report) {
+	}
+	if (!(r->out = open_memstream(&r->buf, &r->len)))
+		die(1, _("Cannot allocate report buffer: %s\n"), strerror(errno));
+	if (ofmt != OUT_DEFAULT)
+		start_structured(r);
+	else {
+		char bgbuf[MAXTIMELEN], igbuf[MAXTIMELEN];
+		char *spacehdr;
+
+		if (flags & FL_SHORTNUMS)
+			spacehdr = _("Space");
+		else
+			spacehdr = _("Block");
+
+		fprintf(r->out, _("*** Report for %s quotas on device %s\n"), _(type2name(type)), h->qh_quotadev);
+		time2str(h->qh_info.dqi_bgrace, bgbuf, TF_ROUND);
+		time2str(h->qh_info.dqi_igrace, igbuf, TF_ROUND);
+		fprintf(r->out, _("Block grace time: %s; Inode grace time: %s\n"), bgbuf, igbuf);
+		fprintf(r->out, _("                        %s limits                File limits\n"), spacehdr);
+		fprintf(r->out, _("%-9s       used    soft    hard  grace    used  soft  hard  grace\n"), (type == USRQUOTA)?_("User"):_("Group"));
+		fprintf(r->out, "----------------------------------------------------------------------\n");
+	}
+
+	cur_report = r;
+	ret = scan_report(r);
+	if (ret < 0) {
+		r->failed = 1;
+		while (r->sel_cnt)
+			free(r->sel[--r->sel_cnt].name);
+		free(r->sel);
+	}
+	else if (sort_key != SORT_NONE)
+		print_selected(r);
+	else
+		dump_cached_dquots(r);
+	cur_report = NULL;
+	if (fclose(r->out) < 0)
+		die(1, _("Cannot allocate report buffer: %s\n"), strerror(errno));
+}
+
+/* Print report of one quota file */
+static void print_report(struct report *r)
+{
+	write_output(stdout, r->buf, r->len);
+	free(r->buf);
+	free(r->row_prefix);
+	if (ofmt == OUT_DEFAULT && !r->failed && r->h->qh_ops->report) {
 		putchar('\n');
-		h->qh_ops->report(h, flags & FL_VERBOSE);
+		r->h->qh_ops->report(r->h, flags & FL_VERBOSE);
 		putchar('\n');
 	}
 }
 
+static struct aggregate *get_aggregate(qid_t id)
+{
+	unsigned int h, i, mask;
+
+	if ((agg_used + 1) * 2 > agg_size) {
+		struct aggregate *old = agg_table;
+		unsigned int oldsize = agg_size;
+
+		agg_size = oldsize ? oldsize * 2 : 1024;
+		agg_table = smalloc(agg_size * sizeof(struct aggregate));
+		memset(agg_table, 0, agg_size * sizeof(struct aggregate));
+		mask = agg_size - 1;
+		for (i = 0; i < oldsize; i++) {
+			if (!old[i].used)
+				continue;
+			for (h = hash_id(old[i].id) & mask; agg_table[h].used; h = (h + 1) & mask);
+			agg_table[h] = old[i];
+			/* Tail pointer may point into the old table */
+			if (agg_table[h].detail_tail == &old[i].detail)
+				agg_table[h].detail_tail = &agg_table[h].detail;
+		}
+		free(old);
+	}
+	mask = agg_size - 1;
+	for (h = hash_id(id) & mask; agg_table[h].used; h = (h + 1) & mask)
+		if (agg_table[h].id == id)
+			return agg_table + h;
+	agg_table[h].used = 1;
+	agg_table[h].id = id;
+	agg_table[h].detail_tail = &agg_table[h].detail;
+	agg_used++;
+	return agg_table + h;
+}
+
+/* Add entries of one quota file to aggregates */
+static void merge_report(struct report *r)
+{
+	int i;
+
+	for (i = 0; i < r->sel_cnt && !r->failed; i++) {
+		struct util_dqblk *d = &r->sel[i].dquot.dq_dqb;
+		struct aggregate *a = get_aggregate(r->sel[i].dquot.dq_id);
+		time_t expiry = grace_expiry(d);
+		double ratio = dquot_ratio(d);
+
+		if (!a->name)
+			a->name = r->sel[i].name;
+		else
+			free(r->sel[i].name);
+		a->space += d->dqb_curspace;
+		a->inodes += d->dqb_curinodes;
+		a->fs++;
+		if (overlim(qb2kb(toqb(d->dqb_curspace)), qb2kb(d->dqb_bsoftlimit), 0) == '+' ||
+		    overlim(d->dqb_curinodes, d->dqb_isoftlimit, 0) == '+')
+			a->over_soft++;
+		if (overlim(qb2kb(toqb(d->dqb_curspace)), 0, qb2kb(d->dqb_bhardlimit)) == '+' ||
+		    overlim(d->dqb_curinodes, 0, d->dqb_ihardlimit) == '+')
+			a->over_hard++;
+		if (expiry && (!a->grace || expiry < a->grace))
+			a->grace = expiry;
+		if (ratio > a->ratio)
+			a->ratio = ratio;
+		if (flags & FL_AGGRDETAIL) {
+			struct agg_detail *det = smalloc(sizeof(struct agg_detail));
+
+			det->h = r->h;
+			det->dqb = *d;
+			det->next = NULL;
+			*a->detail_tail = det;
+			a->detail_tail = &det->next;
+		}
+	}
+	/* Names of failed report weren't taken over */
+	for (; i < r->sel_cnt; i++)
+		free(r->sel[i].name);
+	free(r->sel);
+	r->sel = NULL;
+	r->sel_cnt = r->sel_alloc = 0;
+}
+
+/* Compare aggregates by sort key (by id without it). Negative when a goes first. */
+static int cmp_aggregate(const void *pa, const void *pb)
+{
+	const struct aggregate *a = *(struct aggregate * const *)pa, *b = *(struct aggregate * const *)pb;
+
+	switch (sort_key) {
+		case SORT_SPACE:
+			if (a->space != b->space)
+				return a->space > b->space ? -1 : 1;
+			break;
+		case SORT_INODES:
+			if (a->inodes != b->inodes)
+				return a->inodes > b->inodes ? -1 : 1;
+			break;
+		case SORT_PERCENT:
+			if (a->ratio != b->ratio)
+				return a->ratio > b->ratio ? -1 : 1;
+			break;
+		case SORT_GRACE:
+			if (a->grace != b->grace) {
+				if (!a->grace || !b->grace)
+					return a->grace ? -1 : 1;
+				return a->grace < b->grace ? -1 : 1;
+			}
+			break;
+	}
+	if (a->id != b->id)
+		return a->id < b->id ? -1 : 1;
+	return 0;
+}
+
+static void print_aggregate_text(struct aggregate *a, char *name)
+{
+	char numbuf[2][MAXNUMLEN], time[MAXTIMELEN];
+	struct agg_detail *det;
+
+	space2str(toqb(a->space), numbuf[0], flags & FL_SHORTNUMS);
+	number2str(a->inodes, numbuf[1], flags & FL_SHORTNUMS);
+	if (a->grace)
+		difftime2str(a->grace, time);
+	else
+		time[0] = 0;
+	printf("%-*s %9s %9s %4d %5d %5d  %s\n", PRINTNAMELEN, name, numbuf[0], numbuf[1],
+	       a->fs, a->over_soft, a->over_hard, time);
+	for (det = a->detail; det; det = det->next) {
+		time_t expiry = grace_expiry(&det->dqb);
+
+		space2str(toqb(det->dqb.dqb_curspace), numbuf[0], flags & FL_SHORTNUMS);
+		number2str(det->dqb.dqb_curinodes, numbuf[1], flags & FL_SHORTNUMS);
+		if (expiry)
+			difftime2str(expiry, time);
+		else
+			time[0] = 0;
+		printf("  %-*s %9s %9s      %c%c     %s\n", PRINTNAMELEN - 2, det->h->qh_quotadev,
+		       numbuf[0], numbuf[1],
+		       overlim(qb2kb(toqb(det->dqb.dqb_curspace)), qb2kb(det->dqb.dqb_bsoftlimit), qb2kb(det->dqb.dqb_bhardlimit)),
+		       overlim(det->dqb.dqb_curinodes, det->dqb.dqb_isoftlimit, det->dqb.dqb_ihardlimit), time);
+	}
+}
+
+/* Append one line of aggregated CSV output, dev is NULL for the sum */
+static char *put_aggregate_csv(char *p, int type, struct aggregate *a, char *name, char *dev,
+			       struct util_dqblk *d)
+{
+	p = stpcpy(p, type2name(type));
+	*p++ = ',';
+	p = put_num(p, a->id);
+	*p++ = ',';
+	if (name)
+		p = put_csv_str(p, name);
+	*p++ = ',';
+	if (dev)
+		p = put_csv_str(p, dev);
+	*p++ = ',';
+	if (d) {
+		p = put_num(p, d->dqb_curspace);
+		*p++ = ',';
+		p = put_num(p, d->dqb_curinodes);
+		p = stpcpy(p, ",1,");
+		p = put_num(p, overlim(qb2kb(toqb(d->dqb_curspace)), qb2kb(d->dqb_bsoftlimit), 0) == '+' ||
+				overlim(d->dqb_curinodes, d->dqb_isoftlimit, 0) == '+');
+		*p++ = ',';
+		p = put_num(p, overlim(qb2kb(toqb(d->dqb_curspace)), 0, qb2kb(d->dqb_bhardlimit)) == '+' ||
+				overlim(d->dqb_curinodes, 0, d->dqb_ihardlimit) == '+');
+		*p++ = ',';
+		p = put_num(p, grace_expiry(d));
+	}
+	else {
+		p = put_num(p, a->space);
+		*p++ = ',';
+		p = put_num(p, a->inodes);
+		*p++ = ',';
+		p = put_num(p, a->fs);
+		*p++ = ',';
+		p = put_num(p, a->over_soft);
+		*p++ = ',';
+		p = put_num(p, a->over_hard);
+		*p++ = ',';
+		p = put_num(p, a->grace);
+	}
+	*p++ = '\n';
+	return p;
+}
+
+static void print_aggregate_csv(int type, struct aggregate *a, char *name)
+{
+	char line[OUTPUT_LINELEN];
+	struct agg_detail *det;
+
+	write_output(stdout, line, put_aggregate_csv(line, type, a, name, NULL, NULL) - line);
+	for (det = a->detail; det; det = det->next) {
+		char *dline = smalloc(OUTPUT_LINELEN + 2 * strlen(det->h->qh_quotadev));
+
+		write_output(stdout, dline, put_aggregate_csv(dline, type, a, name, det->h->qh_quotadev, &det->dqb) - dline);
+		free(dline);
+	}
+}
+
+static void print_aggregate_json(int type, struct aggregate *a, char *name)
+{
+	char line[OUTPUT_LINELEN], *p = line;
+	struct agg_detail *det;
+
+	p = stpcpy(p, "{\"type\":\"");
+	p = stpcpy(p, type2name(type));
+	p = stpcpy(p, "\",\"id\":");
+	p = put_num(p, a->id);
+	p = stpcpy(p, ",\"name\":");
+	if (name)
+		p = put_json_str(p, name);
+	else
+		p = stpcpy(p, "null");
+	p = stpcpy(p, ",\"space_used\":");
+	p = put_num(p, a->space);
+	p = stpcpy(p, ",\"inodes_used\":");
+	p = put_num(p, a->inodes);
+	p = stpcpy(p, ",\"filesystems\":");
+	p = put_num(p, a->fs);
+	p = stpcpy(p, ",\"over_soft\":");
+	p = put_num(p, a->over_soft);
+	p = stpcpy(p, ",\"over_hard\":");
+	p = put_num(p, a->over_hard);
+	p = stpcpy(p, ",\"grace\":");
+	p = put_num(p, a->grace);
+	if (flags & FL_AGGRDETAIL) {
+		p = stpcpy(p, ",\"devices\":[");
+		write_output(stdout, line, p - line);
+		for (det = a->detail; det; det = det->next) {
+			char *dline = smalloc(OUTPUT_LINELEN + 6 * strlen(det->h->qh_quotadev));
+
+			p = dline;
+			if (det != a->detail)
+				*p++ = ',';
+			p = stpcpy(p, "{\"device\":");
+			p = put_json_str(p, det->h->qh_quotadev);
+			p = stpcpy(p, ",\"space_used\":");
+			p = put_num(p, det->dqb.dqb_curspace);
+			p = stpcpy(p, ",\"space_soft\":");
+			p = put_num(p, det->dqb.dqb_bsoftlimit << QUOTABLOCK_BITS);
+			p = stpcpy(p, ",\"space_hard\":");
+			p = put_num(p, det->dqb.dqb_bhardlimit << QUOTABLOCK_BITS);
+			p = stpcpy(p, ",\"inodes_used\":");
+			p = put_num(p, det->dqb.dqb_curinodes);
+			p = stpcpy(p, ",\"inodes_soft\":");
+			p = put_num(p, det->dqb.dqb_isoftlimit);
+			p = stpcpy(p, ",\"inodes_hard\":");
+			p = put_num(p, det->dqb.dqb_ihardlimit);
+			p = stpcpy(p, ",\"grace\":");
+			p = put_num(p, grace_expiry(&det->dqb));
+			*p++ = '}';
+			write_output(stdout, dline, p - dline);
+			free(dline);
+		}
+		p = line;
+		*p++ = ']';
+	}
+	p = stpcpy(p, "}\n");
+	write_output(stdout, line, p - line);
+}
+
+/* Print aggregates of all filesystems and free them */
+static void print_aggregates(int type, int fscount)
+{
+	struct aggregate **order;
+	char namebuf[MAXNAMELEN];
+	unsigned int i, cnt = 0;
+
+	order = smalloc(sizeof(struct aggregate *) * (agg_used + 1));
+	for (i = 0; i < agg_size; i++)
+		if (agg_table[i].used)
+			order[cnt++] = agg_table + i;
+	qsort(order, cnt, sizeof(struct aggregate *), cmp_aggregate);
+	if (top_count && cnt > top_count)
+		cnt = top_count;
+
+	if (ofmt == OUT_DEFAULT) {
+		printf(_("*** Aggregated report for %s quotas on %d filesystems\n"), _(type2name(type)), fscount);
+		printf(_("%-9s      used     files   fs  soft  hard  grace\n"), (type == USRQUOTA)?_("User"):_("Group"));
+		printf("------------------------------------------------------\n");
+	}
+	for (i = 0; i < cnt; i++) {
+		struct aggregate *a = order[i];
+		char *name = a->name;
+
+		if (!name && !(flags & FL_NONAME)) {
+			if (!id2name(a->id, type, namebuf))
+				name = namebuf;
+		}
+		if (ofmt == OUT_CSV)
+			print_aggregate_csv(type, a, name);
+		else if (ofmt == OUT_JSON)
+			print_aggregate_json(type, a, name);
+		else {
+			if (!name) {
+				sprintf(namebuf, "#%u", a->id);
+				name = namebuf;
+			}
+			print_aggregate_text(a, name);
+		}
+	}
+	if (ofmt == OUT_DEFAULT)
+		putchar('\n');
+
+	for (i = 0; i < agg_size; i++) {
+		struct agg_detail *det, *next;
+
+		if (!agg_table[i].used)
+			continue;
+		free(agg_table[i].name);
+		for (det = agg_table[i].detail; det; det = next) {
+			next = det->next;
+			free(det);
+		}
+	}
+	free(order);
+	free(agg_table);
+	agg_table = NULL;
+	agg_size = agg_used = 0;
+}
+
+/* Worker building reports until there are none left */
+static void *report_worker(void *arg)
+{
+	struct report *r;
+
+	while (1) {
+		pthread_mutex_lock(&report_lock);
+		r = reports[next_report];
+		if (r)
+			next_report++;
+		pthread_mutex_unlock(&report_lock);
+		if (!r)
+			break;
+		build_report(r);
+		pthread_mutex_lock(&report_lock);
+		r->done = 1;
+		pthread_cond_broadcast(&report_done);
+		pthread_mutex_unlock(&report_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Scan quota files on REPORT_THREADS threads. Reports are buffered and
+ * printed in the order of handles as soon as all preceding ones are done.
+ */
 static void report(int type)
 {
 	struct quota_handle **handles;
-	int i;
+	pthread_t threads[REPORT_THREADS];
+	int i, cnt, nthreads;
 
 	if (flags & FL_ALL)
 		handles = create_handle_list(0, NULL, type, fmt, IOI_READONLY | IOI_INITSCAN, MS_LOCALONLY | (flags & FL_NOAUTOFS ? MS_NO_AUTOFS : 0));
 	else
 		handles = create_handle_list(mntcnt, mnt, type, fmt, IOI_READONLY | IOI_INITSCAN, MS_LOCALONLY | (flags & FL_NOAUTOFS ? MS_NO_AUTOFS : 0));
-	for (i = 0; handles[i]; i++)
-		report_it(handles[i], type);
+	for (cnt = 0; handles[cnt]; cnt++);
+	reports = smalloc(sizeof(struct report *) * (cnt + 1));
+	for (i = 0; i < cnt; i++) {
+		reports[i] = smalloc(sizeof(struct report));
+		memset(reports[i], 0, sizeof(struct report));
+		reports[i]->h = handles[i];
+		reports[i]->type = type;
+	}
+	reports[cnt] = NULL;
+	next_report = 0;
+
+	/* We build reports as well so there's no need for a thread with just one quota file */
+	for (nthreads = 0; nthreads < REPORT_THREADS && nthreads < cnt - 1; nthreads++)
+		if (pthread_create(threads + nthreads, NULL, report_worker, NULL))
+			break;
+	for (i = 0; i < cnt; i++) {
+		pthread_mutex_lock(&report_lock);
+		/* Help with building while our report isn't finished */
+		while (!reports[i]->done && reports[next_report]) {
+			struct report *r = reports[next_report++];
+
+			pthread_mutex_unlock(&report_lock);
+			build_report(r);
+			pthread_mutex_lock(&report_lock);
+			r->done = 1;
+			pthread_cond_broadcast(&report_done);
+		}
+		while (!reports[i]->done)
+			pthread_cond_wait(&report_done, &report_lock);
+		pthread_mutex_unlock(&report_lock);
+		if (flags & FL_AGGREGATE)
+			merge_report(reports[i]);
+		else
+			print_report(reports[i]);
+		free(reports[i]);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	if (flags & FL_AGGREGATE)
+		print_aggregates(type, cnt);
+	free(reports);
 	dispose_handle_list(handles);
 }
 
@@ -333,11 +1558,34 @@ int main(int argc, char **argv)
 	parse_options(argc, argv);
 	init_kernel_interface();
 
+	if (ofmt != OUT_DEFAULT) {
+		setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFSIZE);
+		if (ofmt == OUT_CSV && flags & FL_AGGREGATE) {
+			static const char csv_header[] = "type,id,name,device,space_used,inodes_used,filesystems,"
+				"over_soft,over_hard,grace\n";
+
+			write_output(stdout, csv_header, sizeof(csv_header) - 1);
+		}
+		else if (ofmt == OUT_CSV) {
+			static const char csv_header[] = "type,device,id,name,space_used,space_soft,space_hard,space_grace,"
+				"inodes_used,inodes_soft,inodes_hard,inodes_grace\n";
+
+			write_output(stdout, csv_header, sizeof(csv_header) - 1);
+		}
+		else if (ofmt == OUT_BINARY) {
+			struct rq_bin_header hdr = { RQ_BIN_MAGIC, RQ_BIN_VERSION };
+
+			write_output(stdout, &hdr, sizeof(hdr));
+		}
+	}
+
 	if (flags & FL_USER)
 		report(USRQUOTA);
 
 	if (flags & FL_GROUP)
 		report(GRPQUOTA);
 
+	if (ofmt != OUT_DEFAULT && fflush(stdout) < 0)
+		die(1, _("Cannot write output: %s\n"), strerror(errno));
 	return 0;
 }
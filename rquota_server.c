@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <syslog.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "mntopt.h"
 #include "quotaops.h"
@@ -54,11 +55,6 @@ extern int flags;
 
 extern char nfs_pseudoroot[PATH_MAX];
 
-/*
- * Global unix authentication credentials.
- */
-extern struct authunix_parms *unix_cred;
-
 int in_group(gid_t * gids, u_int len, gid_t gid)
 {
 	gid_t *gidsp = gids + len;
@@ -136,9 +132,231 @@ static inline void servutil2netdqblk(struct rquota *n, struct util_dqblk *u)
 		n->rq_ftimeleft = 0;
 }
 
+#define HANDLE_CACHE_SIZE 64	/* Maximal number of cached quota handles */
+#define HANDLE_CACHE_TTL 60	/* Seconds after which cached handle is initialized again */
+#define WRITE_LOCKS 16		/* Number of locks serializing modifications of quota files */
+
+/* Quota handle kept between requests */
+struct cached_handle {
+	struct cached_handle *next;
+	char *path;		/* Path from the request */
+	int type;
+	int ioflags;
+	int refs;		/* Number of requests using the handle */
+	int dead;		/* Removed from the cache, free when last request is done */
+	time_t created;
+	struct quota_handle *h;
+};
+
+/*
+ * Requests are processed by several threads. The lock protects the handle
+ * cache and scanning of mounts which keeps its state in global variables.
+ */
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_handle *handle_cache;	/* Most recently used first */
+static int handle_cache_cnt;
+static unsigned long handle_cache_gen;	/* Generation of mount table the handles belong to */
+
+#ifdef RPC_SETQUOTA
+/* Modifications of one quota file are serialized by one of these locks */
+static pthread_mutex_t write_locks[WRITE_LOCKS] = {
+	[0 ... WRITE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+#endif
+
+static void free_cached_handle(struct cached_handle *ch)
+{
+	end_io(ch->h);
+	free(ch->path);
+	free(ch);
+}
+
+/* Remove handle from the cache. It is freed once no request uses it. */
+static void drop_cached_handle(struct cached_handle *ch)
+{
+	handle_cache_cnt--;
+	if (ch->refs)
+		ch->dead = 1;
+	else
+		free_cached_handle(ch);
+}
+
+static void flush_handle_cache(void)
+{
+	struct cached_handle *ch;
+
+	while ((ch = handle_cache)) {
+		handle_cache = ch->next;
+		drop_cached_handle(ch);
+	}
+}
+
+/* Drop cached handles when mounts have changed */
+static void check_handle_cache(void)
+{
+	unsigned long gen = mount_table_generation();
+
+	if (gen != handle_cache_gen) {
+		flush_handle_cache();
+		handle_cache_gen = gen;
+	}
+}
+
+/* Find valid cached handle and move it to the front of the cache */
+static struct cached_handle *find_cached_handle(char *path, int type, int ioflags, time_t now)
+{
+	struct cached_handle *ch, **prevp;
+
+	for (prevp = &handle_cache; (ch = *prevp); prevp = &ch->next) {
+		if (ch->type != type || ch->ioflags != ioflags || strcmp(ch->path, path))
+			continue;
+		*prevp = ch->next;
+		if (now - ch->created >= HANDLE_CACHE_TTL) {
+			drop_cached_handle(ch);
+			return NULL;
+		}
+		ch->next = handle_cache;
+		handle_cache = ch;
+		ch->refs++;
+		return ch;
+	}
+	return NULL;
+}
+
+/* Copy mount entry so that it can be used after the mount scan has ended */
+static void copy_mount_entry(struct mount_entry *dst, struct mount_entry *src)
+{
+	*dst = *src;
+	dst->me_type = sstrdup(src->me_type);
+	dst->me_opts = sstrdup(src->me_opts);
+	dst->me_devname = sstrdup(src->me_devname);
+	dst->me__dir = sstrdup(src->me__dir);
+	dst->me_dir = sstrdup(src->me_dir);
+}
+
+static void free_mount_entry_copy(struct mount_entry *mnt)
+{
+	free(mnt->me_type);
+	free(mnt->me_opts);
+	free((char *)mnt->me_devname);
+	free((char *)mnt->me__dir);
+	free((char *)mnt->me_dir);
+}
+
+/*
+ * Get quota handle for filesystem with given path. Handles of filesystems
+ * where the kernel manages quota are cached. Handles with quota file open
+ * are not as they hold a lock of the file and would block quota tools.
+ * *chp is set to the cache entry the handle belongs to (NULL if none).
+ */
+static struct quota_handle *get_quota_handle(char *path, int type, int ioflags, struct cached_handle **chp)
+{
+	struct cached_handle *ch, **prevp;
+	struct mount_entry *mnt, mntcopy;
+	struct quota_handle *h;
+	time_t now = time(NULL);
+
+	*chp = NULL;
+	pthread_mutex_lock(&handle_lock);
+	check_handle_cache();
+	if ((ch = find_cached_handle(path, type, ioflags, now))) {
+		pthread_mutex_unlock(&handle_lock);
+		*chp = ch;
+		return ch->h;
+	}
+
+	if (init_mounts_scan(1, &path, MS_QUIET | MS_NO_MNTPOINT | MS_NFS_ALL | ((flags & FL_AUTOFS) ? 0 : MS_NO_AUTOFS)) < 0) {
+		pthread_mutex_unlock(&handle_lock);
+		return NULL;
+	}
+	if (!(mnt = get_next_mount())) {
+		end_mounts_scan();
+		pthread_mutex_unlock(&handle_lock);
+		return NULL;
+	}
+	copy_mount_entry(&mntcopy, mnt);
+	end_mounts_scan();
+	pthread_mutex_unlock(&handle_lock);
+
+	/* Initialization can wait for a slow filesystem, don't hold up other requests */
+	h = init_io(&mntcopy, type, -1, ioflags);
+	free_mount_entry_copy(&mntcopy);
+	if (!h || h->qh_fd != -1)
+		return h;
+
+	pthread_mutex_lock(&handle_lock);
+	/* Mounts could have changed while we were looking up the filesystem */
+	check_handle_cache();
+	/* Another request could have created the handle in the meantime */
+	if ((ch = find_cached_handle(path, type, ioflags, now))) {
+		pthread_mutex_unlock(&handle_lock);
+		end_io(h);
+		*chp = ch;
+		return ch->h;
+	}
+	ch = smalloc(sizeof(struct cached_handle));
+	ch->path = sstrdup(path);
+	ch->type = type;
+	ch->ioflags = ioflags;
+	ch->refs = 1;
+	ch->dead = 0;
+	ch->created = now;
+	ch->h = h;
+	ch->next = handle_cache;
+	handle_cache = ch;
+	if (++handle_cache_cnt > HANDLE_CACHE_SIZE) {
+		struct cached_handle *last;
+
+		for (prevp = &handle_cache; (*prevp)->next; prevp = &(*prevp)->next);
+		last = *prevp;
+		*prevp = NULL;
+		drop_cached_handle(last);
+	}
+	pthread_mutex_unlock(&handle_lock);
+	*chp = ch;
+	return h;
+}
+
+/*
+ * Release handle obtained by get_quota_handle(). When the request failed,
+ * cached handle is dropped as well since quota could have been turned off.
+ */
+static void put_quota_handle(struct quota_handle *h, struct cached_handle *ch, int failed)
+{
+	struct cached_handle **prevp;
+
+	if (!ch) {
+		end_io(h);
+		return;
+	}
+	pthread_mutex_lock(&handle_lock);
+	ch->refs--;
+	if (failed && !ch->dead) {
+		for (prevp = &handle_cache; *prevp != ch; prevp = &(*prevp)->next);
+		*prevp = ch->next;
+		drop_cached_handle(ch);
+	}
+	else if (ch->dead && !ch->refs)
+		free_cached_handle(ch);
+	pthread_mutex_unlock(&handle_lock);
+}
+
+#ifdef RPC_SETQUOTA
+/* Get lock serializing modifications of quota file the handle is for */
+static pthread_mutex_t *quota_write_lock(struct quota_handle *h)
+{
+	unsigned int hash = h->qh_type;
+	char *c;
+
+	for (c = h->qh_quotadev; *c; c++)
+		hash = hash * 31 + *c;
+	return write_locks + hash % WRITE_LOCKS;
+}
+#endif
+
 setquota_rslt *setquotainfo(int lflags, caddr_t * argp, struct svc_req *rqstp)
 {
-	static setquota_rslt result;
+	static __thread setquota_rslt result;
 
 #if defined(RPC_SETQUOTA)
 	union {
@@ -147,11 +365,13 @@ setquota_rslt *setquotainfo(int lflags, caddr_t * argp, struct svc_req *rqstp)
 	} arguments;
 	struct util_dqblk dqblk;
 	struct dquot *dquot;
-	struct mount_entry *mnt;
 	char pathname[PATH_MAX] = {0};
 	char *pathp = pathname;
 	int id, qcmd, type;
-	struct quota_handle *handles[2] = { NULL, NULL };
+	struct authunix_parms *unix_cred = (struct authunix_parms *)rqstp->rq_clntcred;
+	struct cached_handle *ch;
+	struct quota_handle *h;
+	pthread_mutex_t *write_lock;
 
 	/*
 	 * First check authentication.
@@ -192,19 +412,15 @@ setquota_rslt *setquotainfo(int lflags, caddr_t * argp, struct svc_req *rqstp)
 	result.status = Q_NOQUOTA;
 	result.setquota_rslt_u.sqr_rquota.rq_bsize = RPC_DQBLK_SIZE;
 
-	if (init_mounts_scan(1, &pathp, MS_QUIET | MS_NO_MNTPOINT | MS_NFS_ALL | ((flags & FL_AUTOFS) ? 0 : MS_NO_AUTOFS)) < 0)
-		goto out;
-	if (!(mnt = get_next_mount())) {
-		end_mounts_scan();
+	if (!(h = get_quota_handle(pathp, type, 0, &ch)))
 		goto out;
-	}
-	if (!(handles[0] = init_io(mnt, type, -1, 0))) {
-		end_mounts_scan();
+	write_lock = quota_write_lock(h);
+	pthread_mutex_lock(write_lock);
+	if (!(dquot = h->qh_ops->read_dquot(h, id))) {
+		pthread_mutex_unlock(write_lock);
+		put_quota_handle(h, ch, 1);
 		goto out;
 	}
-	end_mounts_scan();
-	if (!(dquot = handles[0]->qh_ops->read_dquot(handles[0], id)))
-		goto out;
 	if (qcmd == QCMD(Q_RPC_SETQLIM, type) || qcmd == QCMD(Q_RPC_SETQUOTA, type)) {
 		dquot->dq_dqb.dqb_bsoftlimit = dqblk.dqb_bsoftlimit;
 		dquot->dq_dqb.dqb_bhardlimit = dqblk.dqb_bhardlimit;
@@ -217,14 +433,17 @@ setquota_rslt *setquotainfo(int lflags, caddr_t * argp, struct svc_req *rqstp)
 		dquot->dq_dqb.dqb_curspace = dqblk.dqb_curspace;
 		dquot->dq_dqb.dqb_curinodes = dqblk.dqb_curinodes;
 	}
-	if (handles[0]->qh_ops->commit_dquot(dquot, COMMIT_LIMITS) == -1) {
+	if (h->qh_ops->commit_dquot(dquot, COMMIT_LIMITS) == -1) {
+		pthread_mutex_unlock(write_lock);
 		free(dquot);
+		put_quota_handle(h, ch, 1);
 		goto out;
 	}
+	pthread_mutex_unlock(write_lock);
 	free(dquot);
+	put_quota_handle(h, ch, 0);
 	result.status = Q_OK;
 out:
-	dispose_handle_list(handles);
 #else
 	result.status = Q_EPERM;
 #endif
@@ -233,17 +452,18 @@ out:
 
 getquota_rslt *getquotainfo(int lflags, caddr_t * argp, struct svc_req * rqstp)
 {
-	static getquota_rslt result;
+	static __thread getquota_rslt result;
 	union {
 		getquota_args *args;
 		ext_getquota_args *ext_args;
 	} arguments;
 	struct dquot *dquot = NULL;
-	struct mount_entry *mnt;
 	char pathname[PATH_MAX] = {0};
 	char *pathp = pathname;
-	int id, type;
-	struct quota_handle *handles[2] = { NULL, NULL };
+	int id, type, retry;
+	struct authunix_parms *unix_cred = (struct authunix_parms *)rqstp->rq_clntcred;
+	struct cached_handle *ch;
+	struct quota_handle *h;
 
 	/*
 	 * First check authentication.
@@ -283,28 +503,25 @@ getquota_rslt *getquotainfo(int lflags, caddr_t * argp, struct svc_req * rqstp)
 
 	result.status = Q_NOQUOTA;
 
-	if (init_mounts_scan(1, &pathp, MS_QUIET | MS_NO_MNTPOINT | MS_NFS_ALL | ((flags & FL_AUTOFS) ? 0 : MS_NO_AUTOFS)) < 0)
-		goto out;
-	if (!(mnt = get_next_mount())) {
-		end_mounts_scan();
-		goto out;
+	for (retry = 0; ; retry++) {
+		if (!(h = get_quota_handle(pathp, type, IOI_READONLY, &ch)))
+			goto out;
+		if (!(lflags & ACTIVE) || QIO_ENABLED(h))
+			dquot = h->qh_ops->read_dquot(h, id);
+		if (dquot || !ch || retry)
+			break;
+		/* Quota could have been turned off since the handle was cached */
+		put_quota_handle(h, ch, 1);
 	}
-	if (!(handles[0] = init_io(mnt, type, -1, IOI_READONLY))) {
-		end_mounts_scan();
-		goto out;
-	}
-	end_mounts_scan();
-	if (!(lflags & ACTIVE) || QIO_ENABLED(handles[0]))
-		dquot = handles[0]->qh_ops->read_dquot(handles[0], id);
 	if (dquot) {
 		result.status = Q_OK;
 		result.getquota_rslt_u.gqr_rquota.rq_active =
-			QIO_ENABLED(handles[0]) ? TRUE : FALSE;
+			QIO_ENABLED(h) ? TRUE : FALSE;
 		servutil2netdqblk(&result.getquota_rslt_u.gqr_rquota, &dquot->dq_dqb);
 		free(dquot);
 	}
+	put_quota_handle(h, ch, !dquot);
 out:
-	dispose_handle_list(handles);
 	return (&result);
 }
 
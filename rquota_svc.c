@@ -33,6 +33,9 @@
 #include <getopt.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #ifdef HOSTS_ACCESS
 #include <tcpd.h>
 #include <netdb.h>
@@ -54,11 +57,6 @@ extern int svcudp_socket (u_long __number, int __port, int __reuse);
 
 char *progname;
 
-/*
- * Global authentication credentials.
- */
-struct authunix_parms *unix_cred;
-
 #define FL_SETQUOTA 1	/* Enable setquota rpc */
 #define FL_NODAEMON 2	/* Disable daemon() call */
 #define FL_AUTOFS   4	/* Don't ignore autofs mountpoints */
@@ -66,8 +64,37 @@ struct authunix_parms *unix_cred;
 int flags;				/* Options specified on command line */ 
 static int port;			/* Port to use (0 for default one) */
 static char xtab_path[PATH_MAX];	/* Path to NFSD export table */
+static int threads;			/* Number of threads processing requests */
 char nfs_pseudoroot[PATH_MAX];		/* Root of the virtual NFS filesystem ('/' for NFSv3) */
 
+#define QUEUE_LEN 64	/* Maximal number of transports waiting for a thread */
+
+#define FD_BUSY 1	/* Transport is queued or served by a worker */
+#define FD_UDP 2	/* Transport is one of UDP transports sharing the socket */
+
+/*
+ * The main thread polls transports and queues those with a pending request.
+ * A worker then receives, processes and answers the request. A transport is
+ * not polled while it is queued or served since its buffers are in use.
+ * All UDP transports share one (nonblocking) socket so that several UDP
+ * requests can be processed at once.
+ */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_avail = PTHREAD_COND_INITIALIZER;	/* Transport was queued */
+static pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;	/* Worker took a transport */
+static int queue[QUEUE_LEN];		/* Descriptors of queued transports */
+static int queue_head, queue_cnt;
+static unsigned char *fd_flags;		/* FD_* flags of transports indexed by descriptor */
+static int fd_flags_size;
+static int udp_pending;			/* Queued UDP request was not received yet */
+static int tcp_listen_fd = -1;		/* Rendezvous transport, served by the main thread */
+static int wake_pipe[2];		/* Wakes up main thread when transport can be polled again */
+static __thread int udp_serving;	/* Worker serves UDP request announced by udp_pending */
+
+#ifdef HOSTS_ACCESS
+static pthread_mutex_t access_lock = PTHREAD_MUTEX_INITIALIZER;	/* libwrap is not thread safe */
+#endif
+
 static struct option options[]= {
 	{ "version", 0, NULL, 'V' },
 	{ "help", 0, NULL, 'h' },
@@ -79,6 +106,7 @@ static struct option options[]= {
 	{ "autofs", 0, NULL, 'I'},
 	{ "port", 1, NULL, 'p' },
 	{ "xtab", 1, NULL, 'x' },
+	{ "threads", 1, NULL, 't' },
 	{ NULL, 0, NULL , 0 }
 };
 
@@ -93,6 +121,7 @@ static void show_help(void)
  -p --port <port>      listen on given port\n\
  -s --no-setquota      disables remote calls to setquota (default)\n\
  -S --setquota         enables remote calls to setquota\n\
+ -t --threads <num>    process requests in given number of threads\n\
  -x --xtab <path>      set an alternative file with NFSD export table\n"), progname);
 
 #else
@@ -102,6 +131,7 @@ static void show_help(void)
  -F --foreground       starts the quota service in foreground\n\
  -I --autofs           do not ignore mountpoints mounted by automounter\n\
  -p --port <port>      listen on given port\n\
+ -t --threads <num>    process requests in given number of threads\n\
  -x --xtab <path>      set an alternative file with NFSD export table\n"), progname);
 #endif
 }
@@ -156,12 +186,60 @@ static void parse_options(int argc, char **argv)
 				}
 				sstrncpy(xtab_path, optarg, PATH_MAX);
 				break;
+			case 't':
+				threads = strtol(optarg, &endptr, 0);
+				if (*endptr || threads <= 0) {
+					errstr(_("Illegal number of threads: %s\n"), optarg);
+					show_help();
+					exit(1);
+				}
+				break;
 			default:
 				errstr(_("Unknown option '%c'.\n"), opt);
 				show_help();
 				exit(1);
 		}
 	}
+	if (!threads) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads <= 0)
+			threads = 1;
+	}
+}
+
+/* Set flags of transport with given descriptor */
+static void set_fd_flags(int fd, int set)
+{
+	if (fd >= fd_flags_size) {
+		int size = fd + 64;
+
+		fd_flags = srealloc(fd_flags, size);
+		memset(fd_flags + fd_flags_size, 0, size - fd_flags_size);
+		fd_flags_size = size;
+	}
+	fd_flags[fd] |= set;
+}
+
+/* Wake up main thread to poll transports again */
+static void wake_main(void)
+{
+	if (write(wake_pipe[1], "", 1) < 0 && errno != EAGAIN)
+		errstr(_("Cannot wake up main thread: %s\n"), strerror(errno));
+}
+
+/*
+ * Worker has received its UDP request from the shared socket so the main
+ * thread can poll the socket for further requests.
+ */
+static void udp_received(void)
+{
+	if (!udp_serving)
+		return;
+	udp_serving = 0;
+	pthread_mutex_lock(&queue_lock);
+	udp_pending = 0;
+	pthread_mutex_unlock(&queue_lock);
+	wake_main();
 }
 
 
@@ -173,8 +251,11 @@ static int good_client(struct sockaddr_in *addr, ulong rq_proc)
 {
 #ifdef HOSTS_ACCESS
 	struct request_info req;
+	int allowed;
 #endif
-	char *remote = inet_ntoa(addr->sin_addr);
+	char remote[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &addr->sin_addr, remote, sizeof(remote));
 
 	if (rq_proc==RQUOTAPROC_SETQUOTA ||
 	     rq_proc==RQUOTAPROC_SETACTIVEQUOTA) {
@@ -198,9 +279,12 @@ static int good_client(struct sockaddr_in *addr, ulong rq_proc)
 	/* NOTE: we could use different servicename for setquota calls to
 	 * allow only some hosts to call setquota. */
 
+	pthread_mutex_lock(&access_lock);
 	request_init(&req, RQ_DAEMON, "rquotad", RQ_CLIENT_SIN, addr, 0);
 	sock_methods(&req);
-	if (hosts_access(&req))
+	allowed = hosts_access(&req);
+	pthread_mutex_unlock(&access_lock);
+	if (allowed)
 		return 1;
 	errstr(_("Denied access to host %s\n"), remote);
 	return 0;
@@ -222,6 +306,8 @@ static void rquotaprog_1(struct svc_req *rqstp, register SVCXPRT * transp)
 	xdrproc_t xdr_argument, xdr_result;
 	char *(*local) (char *, struct svc_req *);
 
+	udp_received();
+
 	/*
 	 *  Authenticate host
 	 */
@@ -239,11 +325,10 @@ static void rquotaprog_1(struct svc_req *rqstp, register SVCXPRT * transp)
 	}
 
 	/*
-	 * Get authentication.
+	 * Get authentication. Credentials are passed in rqstp->rq_clntcred.
 	 */
 	switch (rqstp->rq_cred.oa_flavor) {
 	  case AUTH_UNIX:
-		  unix_cred = (struct authunix_parms *)rqstp->rq_clntcred;
 		  break;
 	  case AUTH_NULL:
 	  default:
@@ -308,6 +393,8 @@ static void rquotaprog_2(struct svc_req *rqstp, register SVCXPRT * transp)
 	xdrproc_t xdr_argument, xdr_result;
 	char *(*local) (char *, struct svc_req *);
 
+	udp_received();
+
 	/*
 	 *  Authenticate host
 	 */
@@ -325,11 +412,10 @@ static void rquotaprog_2(struct svc_req *rqstp, register SVCXPRT * transp)
 	}
 
 	/*
-	 * Get authentication.
+	 * Get authentication. Credentials are passed in rqstp->rq_clntcred.
 	 */
 	switch (rqstp->rq_cred.oa_flavor) {
 	  case AUTH_UNIX:
-		  unix_cred = (struct authunix_parms *)rqstp->rq_clntcred;
 		  break;
 	  case AUTH_NULL:
 	  default:
@@ -423,6 +509,162 @@ static void get_pseudoroot(void)
 	fclose(f);
 }
 
+/* Queue transport with pending request, wait while the queue is full */
+static void queue_transport(int fd)
+{
+	pthread_mutex_lock(&queue_lock);
+	while (queue_cnt == QUEUE_LEN)
+		pthread_cond_wait(&queue_space, &queue_lock);
+	set_fd_flags(fd, FD_BUSY);
+	if (fd_flags[fd] & FD_UDP)
+		udp_pending = 1;
+	queue[(queue_head + queue_cnt++) % QUEUE_LEN] = fd;
+	pthread_cond_signal(&queue_avail);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Receive, process and answer requests on queued transports */
+static void *serve_requests(void *arg)
+{
+	int fd;
+
+	while (1) {
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_cnt)
+			pthread_cond_wait(&queue_avail, &queue_lock);
+		fd = queue[queue_head];
+		queue_head = (queue_head + 1) % QUEUE_LEN;
+		queue_cnt--;
+		udp_serving = fd_flags[fd] & FD_UDP;
+		pthread_cond_signal(&queue_space);
+		pthread_mutex_unlock(&queue_lock);
+
+		svc_getreq_common(fd);
+
+		pthread_mutex_lock(&queue_lock);
+		/* Request could have been rejected before reaching the dispatcher */
+		if (udp_serving) {
+			udp_serving = 0;
+			udp_pending = 0;
+		}
+		fd_flags[fd] &= ~FD_BUSY;
+		pthread_mutex_unlock(&queue_lock);
+		wake_main();
+	}
+	return NULL;
+}
+
+/* Create UDP transports for workers sharing the socket of the registered one */
+static void create_udp_transports(int sock)
+{
+	int i, fd;
+
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+		errstr(_("Cannot set socket to nonblocking mode: %s\n"), strerror(errno));
+		exit(1);
+	}
+	set_fd_flags(sock, FD_UDP);
+	for (i = 1; i < threads; i++) {
+		if ((fd = dup(sock)) < 0 || !svcudp_create(fd)) {
+			errstr(_("cannot create udp service.\n"));
+			exit(1);
+		}
+		set_fd_flags(fd, FD_UDP);
+	}
+}
+
+static void start_workers(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t sigs, oldsigs;
+	int i, started = 0;
+
+	if (pipe(wake_pipe) < 0 || fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+		errstr(_("Cannot create pipe: %s\n"), strerror(errno));
+		exit(1);
+	}
+	/* Signals are handled by the main thread */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < threads; i++)
+		if (!pthread_create(&thread, &attr, serve_requests, NULL))
+			started++;
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+	if (!started) {
+		errstr(_("Cannot create threads processing requests.\n"));
+		exit(1);
+	}
+}
+
+/*
+ * Poll transports and queue those with pending requests for workers. New
+ * connections are accepted directly. Returns only when polling fails.
+ */
+static void run_service(void)
+{
+	struct pollfd *pfd = NULL;
+	int pfd_size = 0, cnt, i, fd, udp_polled;
+	char buf[64];
+
+	while (1) {
+		if (pfd_size < svc_max_pollfd + 1) {
+			pfd_size = svc_max_pollfd + 1;
+			pfd = srealloc(pfd, pfd_size * sizeof(struct pollfd));
+		}
+		pfd[0].fd = wake_pipe[0];
+		pfd[0].events = POLLIN;
+		cnt = 1;
+		udp_polled = 0;
+		pthread_mutex_lock(&queue_lock);
+		/*
+		 * Workers only clear entries of svc_pollfd when destroying
+		 * transports, the array grows only when this thread accepts
+		 * a connection.
+		 */
+		for (i = 0; i < svc_max_pollfd; i++) {
+			fd = svc_pollfd[i].fd;
+			if (fd < 0)
+				continue;
+			if (fd < fd_flags_size) {
+				if (fd_flags[fd] & FD_BUSY)
+					continue;
+				/* One free UDP transport is enough, it has to receive first */
+				if (fd_flags[fd] & FD_UDP) {
+					if (udp_pending || udp_polled)
+						continue;
+					udp_polled = 1;
+				}
+			}
+			pfd[cnt].fd = fd;
+			pfd[cnt].events = svc_pollfd[i].events;
+			pfd[cnt++].revents = 0;
+		}
+		pthread_mutex_unlock(&queue_lock);
+
+		if (poll(pfd, cnt, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			free(pfd);
+			return;
+		}
+		if (pfd[0].revents)
+			while (read(wake_pipe[0], buf, sizeof(buf)) > 0);
+		for (i = 1; i < cnt; i++) {
+			if (!pfd[i].revents)
+				continue;
+			if (pfd[i].fd == tcp_listen_fd)
+				svc_getreq_common(pfd[i].fd);
+			else
+				queue_transport(pfd[i].fd);
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
 	register SVCXPRT *transp;
@@ -462,6 +704,7 @@ int main(int argc, char **argv)
 		errstr(_("unable to register (RQUOTAPROG, EXT_RQUOTAVERS, UDP).\n"));
 		exit(1);
 	}
+	create_udp_transports(transp->xp_fd);
 
 	sock = svctcp_socket(RQUOTAPROG, port, 1);
 	transp = svctcp_create(sock == -1 ? RPC_ANYSOCK : sock, 0, 0);
@@ -469,6 +712,7 @@ int main(int argc, char **argv)
 		errstr(_("cannot create TCP service.\n"));
 		exit(1);
 	}
+	tcp_listen_fd = transp->xp_fd;
 	if (!svc_register(transp, RQUOTAPROG, RQUOTAVERS, rquotaprog_1, IPPROTO_TCP)) {
 		errstr(_("unable to register (RQUOTAPROG, RQUOTAVERS, TCP).\n"));
 		exit(1);
@@ -482,8 +726,9 @@ int main(int argc, char **argv)
 		use_syslog();
 		daemon(0, 0);
 	}
-	svc_run();
-	errstr(_("svc_run returned\n"));
+	start_workers();
+	run_service();
+	errstr(_("Polling of RPC transports failed: %s\n"), strerror(errno));
 	exit(1);
 	/* NOTREACHED */
 }
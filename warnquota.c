@@ -29,6 +29,7 @@
 #include <grp.h>
 #include <time.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/utsname.h>
@@ -42,6 +43,7 @@
 #include "common.h"
 #include "quotasys.h"
 #include "quotaio.h"
+#include "quotafilter.h"
 
 /* these are just defaults, overridden in the WARNQUOTA_CONF file */
 #define MAIL_CMD "/usr/lib/sendmail -t"
@@ -78,6 +80,7 @@
 #define ADMIN_TAB_ALLOC 256		/* How many entries to admins table should we allocate at once? */
 #define WARNQUOTA_CONF "/etc/warnquota.conf"
 #define ADMINSFILE "/etc/quotagrpadmins"
+#define SCAN_THREADS 8			/* Number of quota files scanned in parallel */
 
 #define FL_USER 1
 #define FL_GROUP 2
@@ -91,6 +94,14 @@ struct usage {
 	struct usage *next;
 };
 
+/* Dquots over softlimit found when scanning one quota file */
+struct scan_result {
+	struct quota_handle *h;
+	struct dquot *dquots;
+	char **names;		/* Names passed by scan_dquots() or NULL */
+	int count, alloc;
+};
+
 #ifdef USE_LDAP_MAIL_LOOKUP
 static LDAP *ldapconn = NULL;
 #endif
@@ -156,6 +167,14 @@ static struct adminstable *adminstable;
  */
 static struct offenderlist *offenders = (struct offenderlist *)0;
 
+static struct quota_filter *filter;	/* Warn only about entries matching the filter */
+static time_t scan_time;
+
+static __thread struct scan_result *cur_scan;	/* Quota file the thread is scanning */
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;	/* Protects next_scan and passwd scans */
+static struct scan_result *scans;
+static int scan_cnt, next_scan;
+
 /*
  * add any cleanup functions here
  */
@@ -291,16 +310,92 @@ static int deliverable(struct dquot *dquot)
 	return 1;
 }
 
+/* Remember dquot over softlimit, it is checked and added to offenders after all scans finish */
 static int check_offence(struct dquot *dquot, char *name)
 {
+	struct scan_result *sr = cur_scan;
+
+	if (filter && !quota_filter_match(filter, dquot, scan_time))
+		return 0;
 	if ((dquot->dq_dqb.dqb_bsoftlimit && toqb(dquot->dq_dqb.dqb_curspace) >= dquot->dq_dqb.dqb_bsoftlimit)
 	    || (dquot->dq_dqb.dqb_isoftlimit && dquot->dq_dqb.dqb_curinodes >= dquot->dq_dqb.dqb_isoftlimit)) {
-		if(deliverable(dquot))
-			add_offence(dquot, name);
+		if (sr->count == sr->alloc) {
+			sr->alloc = sr->alloc ? sr->alloc * 2 : 64;
+			sr->dquots = srealloc(sr->dquots, sr->alloc * sizeof(struct dquot));
+			sr->names = srealloc(sr->names, sr->alloc * sizeof(char *));
+		}
+		memcpy(sr->dquots + sr->count, dquot, sizeof(struct dquot));
+		sr->names[sr->count++] = name ? sstrdup(name) : NULL;
 	}
 	return 0;
 }
 
+static void scan_one(struct scan_result *sr)
+{
+	struct quota_handle *h = sr->h;
+
+	cur_scan = sr;
+	/* These formats scan by going through the passwd / group database */
+	if (h->qh_fmt == QF_XFS || h->qh_fmt == QF_META) {
+		pthread_mutex_lock(&scan_lock);
+		h->qh_ops->scan_dquots(h, check_offence);
+		pthread_mutex_unlock(&scan_lock);
+	}
+	else
+		h->qh_ops->scan_dquots(h, check_offence);
+	cur_scan = NULL;
+}
+
+/* Worker scanning quota files until there are none left */
+static void *scan_worker(void *arg)
+{
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&scan_lock);
+		i = next_scan < scan_cnt ? next_scan++ : -1;
+		pthread_mutex_unlock(&scan_lock);
+		if (i < 0)
+			break;
+		scan_one(scans + i);
+	}
+	return NULL;
+}
+
+/*
+ * Scan quota files on SCAN_THREADS threads and then process found dquots
+ * in the order of handles so that results don't depend on timing.
+ */
+static void scan_handles(struct quota_handle **handles)
+{
+	pthread_t threads[SCAN_THREADS];
+	int i, j, nthreads;
+
+	for (scan_cnt = 0; handles[scan_cnt]; scan_cnt++);
+	scans = smalloc(sizeof(struct scan_result) * (scan_cnt + 1));
+	memset(scans, 0, sizeof(struct scan_result) * (scan_cnt + 1));
+	for (i = 0; i < scan_cnt; i++)
+		scans[i].h = handles[i];
+	next_scan = 0;
+	for (nthreads = 0; nthreads < SCAN_THREADS && nthreads < scan_cnt - 1; nthreads++)
+		if (pthread_create(threads + nthreads, NULL, scan_worker, NULL))
+			break;
+	scan_worker(NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < scan_cnt; i++) {
+		for (j = 0; j < scans[i].count; j++) {
+			if (deliverable(scans[i].dquots + j))
+				add_offence(scans[i].dquots + j, scans[i].names[j]);
+			free(scans[i].names[j]);
+		}
+		free(scans[i].dquots);
+		free(scans[i].names);
+	}
+	free(scans);
+}
+
 static FILE *run_mailer(char *command)
 {
 	int pipefd[2];
@@ -943,7 +1038,6 @@ static void warn_quota(int fs_count, char **fs)
 {
 	struct quota_handle **handles;
 	struct configparams config;
-	int i;
 
 	if (readconfigfile(configfile, &config) < 0)
 		wc_exit(1);
@@ -956,8 +1050,7 @@ static void warn_quota(int fs_count, char **fs)
 			maildev_handle = NULL;
 		else
 			maildev_handle = find_handle_dev(maildev, handles);
-		for (i = 0; handles[i]; i++)
-			handles[i]->qh_ops->scan_dquots(handles[i], check_offence);
+		scan_handles(handles);
 		dispose_handle_list(handles);
 	}
 	if (flags & FL_GROUP) {
@@ -968,8 +1061,7 @@ static void warn_quota(int fs_count, char **fs)
 			maildev_handle = NULL;
 		else
 			maildev_handle = find_handle_dev(maildev, handles);
-		for (i = 0; handles[i]; i++)
-			handles[i]->qh_ops->scan_dquots(handles[i], check_offence);
+		scan_handles(handles);
 		dispose_handle_list(handles);
 	}
 	if (mail_to_offenders(&config) < 0)
@@ -985,6 +1077,7 @@ static void usage(void)
 -s, --human-readable            send information in more human friendly units\n\
 -i, --no-autofs                 avoid autofs mountpoints\n\
 -d, --no-details                do not send quota information itself\n\
+    --filter=expr               warn only about entries matching the filter\n\
 -F, --format=formatname         use quotafiles of specific format\n\
 -c, --config=config-file        non-default config file\n\
 -q, --quota-tab=quotatab-file   non-default quotatab\n\
@@ -1010,6 +1103,7 @@ static void parse_options(int argcnt, char **argstr)
 		{ "no-autofs", 0, NULL, 'i' },
 		{ "human-readable", 0, NULL, 's' },
 		{ "no-details", 0, NULL, 'd' },
+		{ "filter", 1, NULL, 256 },
 		{ NULL, 0, NULL, 0 }
 	};
  
@@ -1049,10 +1143,15 @@ static void parse_options(int argcnt, char **argstr)
 		  case 'd':
 			flags |= FL_NODETAILS;
 			break;
+		  case 256:
+			if (!(filter = compile_quota_filter(optarg)))
+				wc_exit(1);
+			break;
 		}
 	}
 	if (!(flags & FL_USER) && !(flags & FL_GROUP))
 		flags |= FL_USER;
+	scan_time = time(NULL);
 }
  
 static void get_host_name(void)